@@ -0,0 +1,28 @@
+/*
+ * JSON codec using jansson's own decoder and encoder.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <jansson.h>
+
+#include "jsonrpc_codec.h"
+
+json_t *jsonrpc_codec_decode(const char *buf, size_t len, size_t flags,
+		json_error_t *error)
+{
+	return json_loadb(buf, len, flags, error);
+}
+
+json_t *jsonrpc_codec_decode_file(FILE *file, size_t flags,
+		json_error_t *error)
+{
+	return json_loadf(file, flags, error);
+}
+
+int jsonrpc_codec_encode(const json_t *value, jsonrpc_write_t write,
+		void *priv, size_t flags)
+{
+	return json_dump_callback(value, write, priv, flags);
+}
@@ -0,0 +1,650 @@
+/*
+ * JSON codec with a decoder of its own, which works directly on the input
+ * buffer. It builds the same jansson values as json_loadb(), but without
+ * jansson's generic input stream and token layer. Strings without escapes
+ * are created straight from the input. Encoding is left to jansson.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <jansson.h>
+
+#include "jsonrpc_codec.h"
+#include "jsonrpc_alloc.h"
+
+/* the same limit jansson uses */
+#define MAX_DEPTH 2048
+
+#define JSON_INT_MAX ((json_int_t)(((uint64_t)1 << (sizeof(json_int_t) * 8 - 1)) - 1))
+
+struct parser {
+	const char *start;
+	const char *p;
+	const char *end;
+	size_t flags;
+	json_error_t *error;
+	int depth;
+	/* strings with escapes are assembled here */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void *parser_error(struct parser *ps, const char *msg)
+{
+	json_error_t *error = ps->error;
+	const char *walk;
+
+	if (!error || error->text[0]) {
+		return NULL;
+	}
+
+	error->line = 1;
+	error->column = 0;
+	for (walk = ps->start; walk < ps->p; walk++) {
+		if (*walk == '\n') {
+			error->line++;
+			error->column = 0;
+		} else {
+			error->column++;
+		}
+	}
+	error->position = ps->p - ps->start;
+	snprintf(error->source, sizeof(error->source), "<buffer>");
+	if (ps->p < ps->end) {
+		snprintf(error->text, sizeof(error->text), "%s near '%c'", msg,
+				*ps->p);
+	} else {
+		snprintf(error->text, sizeof(error->text), "%s near end of file",
+				msg);
+	}
+
+	return NULL;
+}
+
+static void skip_ws(struct parser *ps)
+{
+	const char *p = ps->p;
+
+	while (p < ps->end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+				*p == '\r')) {
+		p++;
+	}
+	ps->p = p;
+}
+
+static bool buf_append(struct parser *ps, const char *data, size_t len)
+{
+	if (ps->len + len > ps->size) {
+		size_t size = ps->size ? ps->size : 256;
+		char *buf;
+
+		while (ps->len + len > size) {
+			size *= 2;
+		}
+		buf = realloc(ps->buf, size);
+		if (!buf) {
+			return false;
+		}
+		ps->buf = buf;
+		ps->size = size;
+	}
+
+	memcpy(ps->buf + ps->len, data, len);
+	ps->len += len;
+
+	return true;
+}
+
+static int parse_hex4(const char *p, const char *end)
+{
+	int i, value = 0;
+
+	if (end - p < 4) {
+		return -1;
+	}
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+
+		value <<= 4;
+		if (c >= '0' && c <= '9') {
+			value |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			value |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			value |= c - 'A' + 10;
+		} else {
+			return -1;
+		}
+	}
+
+	return value;
+}
+
+static bool append_utf8(struct parser *ps, uint32_t cp)
+{
+	char out[4];
+	size_t len;
+
+	if (cp < 0x80) {
+		out[0] = cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		len = 2;
+	} else if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		len = 3;
+	} else {
+		out[0] = 0xf0 | (cp >> 18);
+		out[1] = 0x80 | ((cp >> 12) & 0x3f);
+		out[2] = 0x80 | ((cp >> 6) & 0x3f);
+		out[3] = 0x80 | (cp & 0x3f);
+		len = 4;
+	}
+
+	return buf_append(ps, out, len);
+}
+
+/* the escape sequence starts at ps->p, right after the backslash */
+static bool parse_escape(struct parser *ps)
+{
+	const char *p = ps->p;
+	int cp, low;
+	char c;
+
+	switch (*p) {
+	case '"': case '\\': case '/':
+		c = *p;
+		break;
+	case 'b': c = '\b'; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'u':
+		cp = parse_hex4(p + 1, ps->end);
+		if (cp < 0) {
+			parser_error(ps, "invalid escape");
+			return false;
+		}
+		p += 5;
+		if (cp >= 0xd800 && cp <= 0xdbff) {
+			/* a high surrogate must be followed by a low one */
+			if (ps->end - p < 2 || p[0] != '\\' || p[1] != 'u' ||
+					(low = parse_hex4(p + 2, ps->end)) < 0xdc00 ||
+					low > 0xdfff) {
+				parser_error(ps, "invalid Unicode escape");
+				return false;
+			}
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+			p += 6;
+		} else if (cp >= 0xdc00 && cp <= 0xdfff) {
+			parser_error(ps, "invalid Unicode escape");
+			return false;
+		} else if (cp == 0 && !(ps->flags & JSON_ALLOW_NUL)) {
+			parser_error(ps, "\\u0000 is not allowed without JSON_ALLOW_NUL");
+			return false;
+		}
+		ps->p = p;
+		if (!append_utf8(ps, cp)) {
+			parser_error(ps, "out of memory");
+			return false;
+		}
+		return true;
+	default:
+		parser_error(ps, "invalid escape");
+		return false;
+	}
+
+	ps->p = p + 1;
+	if (!buf_append(ps, &c, 1)) {
+		parser_error(ps, "out of memory");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Parse the string starting at the opening quote at ps->p. The result either
+ * points into the input or into the parser's buffer, where it is valid until
+ * the next string is parsed.
+ */
+static bool parse_string(struct parser *ps, const char **_str, size_t *_len)
+{
+	const char *p = ps->p + 1, *end = ps->end, *run;
+	size_t n;
+
+	/* plain ASCII without escapes is used as is */
+	run = p;
+	while (p < end && *p != '"' && *p != '\\' &&
+			(unsigned char)*p >= 0x20 && (unsigned char)*p < 0x80) {
+		p++;
+	}
+	if (p < end && *p == '"') {
+		*_str = run;
+		*_len = p - run;
+		ps->p = p + 1;
+		return true;
+	}
+
+	ps->len = 0;
+	for (;;) {
+		if (p > run && !buf_append(ps, run, p - run)) {
+			ps->p = p;
+			parser_error(ps, "out of memory");
+			return false;
+		}
+		ps->p = p;
+
+		if (p == end) {
+			parser_error(ps, "premature end of input");
+			return false;
+		} else if (*p == '"') {
+			break;
+		} else if ((unsigned char)*p < 0x20) {
+			parser_error(ps, "control character in string");
+			return false;
+		} else if (*p == '\\') {
+			ps->p = p + 1;
+			if (!parse_escape(ps)) {
+				return false;
+			}
+			p = ps->p;
+		} else {
+			n = jsonrpc_utf8_check((const unsigned char *)p,
+					(const unsigned char *)end);
+			if (!n) {
+				parser_error(ps, "unable to decode byte");
+				return false;
+			}
+			if (!buf_append(ps, p, n)) {
+				parser_error(ps, "out of memory");
+				return false;
+			}
+			p += n;
+		}
+
+		run = p;
+		while (p < end && *p != '"' && *p != '\\' &&
+				(unsigned char)*p >= 0x20 && (unsigned char)*p < 0x80) {
+			p++;
+		}
+	}
+
+	*_str = ps->buf;
+	*_len = ps->len;
+	ps->p = p + 1;
+
+	return true;
+}
+
+static json_t *parse_number(struct parser *ps)
+{
+	const char *p = ps->p, *end = ps->end, *digits;
+	bool negative = false, real = false;
+	uint64_t value = 0;
+	char tmp[64], *copy, *endptr;
+	size_t len;
+	double d;
+
+	if (*p == '-') {
+		negative = true;
+		p++;
+	}
+	digits = p;
+	if (p < end && *p == '0') {
+		p++;
+	} else {
+		while (p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+		if (p == digits) {
+			return parser_error(ps, "invalid token");
+		}
+	}
+	if (p < end && *p == '.') {
+		real = true;
+		digits = ++p;
+		while (p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+		if (p == digits) {
+			ps->p = p;
+			return parser_error(ps, "invalid token");
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		real = true;
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		digits = p;
+		while (p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+		if (p == digits) {
+			ps->p = p;
+			return parser_error(ps, "invalid token");
+		}
+	}
+
+	if (!real && !(ps->flags & JSON_DECODE_INT_AS_REAL)) {
+		for (digits = ps->p + negative; digits < p; digits++) {
+			unsigned int d = *digits - '0';
+
+			if (value > ((uint64_t)JSON_INT_MAX + 1 - d) / 10) {
+				return parser_error(ps, negative ?
+						"too big negative integer" : "too big integer");
+			}
+			value = value * 10 + d;
+		}
+		if (!negative && value > (uint64_t)JSON_INT_MAX) {
+			return parser_error(ps, "too big integer");
+		}
+		ps->p = p;
+		return json_integer(negative ? (json_int_t)(0 - value) :
+				(json_int_t)value);
+	}
+
+	/* strtod() needs a terminated string */
+	len = p - ps->p;
+	copy = len < sizeof(tmp) ? tmp : malloc(len + 1);
+	if (!copy) {
+		return parser_error(ps, "out of memory");
+	}
+	memcpy(copy, ps->p, len);
+	copy[len] = '\0';
+	errno = 0;
+	d = strtod(copy, &endptr);
+	if (copy != tmp) {
+		free(copy);
+	}
+	if (errno == ERANGE && (d == HUGE_VAL || d == -HUGE_VAL)) {
+		return parser_error(ps, "real number overflow");
+	}
+
+	ps->p = p;
+	return json_real(d);
+}
+
+static json_t *parse_value(struct parser *ps);
+
+static json_t *parse_array(struct parser *ps)
+{
+	json_t *array, *value;
+
+	ps->p++;
+	array = json_array();
+	if (!array) {
+		return parser_error(ps, "out of memory");
+	}
+
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == ']') {
+		ps->p++;
+		return array;
+	}
+
+	for (;;) {
+		value = parse_value(ps);
+		if (!value) {
+			goto error;
+		}
+		if (json_array_append_new(array, value)) {
+			parser_error(ps, "out of memory");
+			goto error;
+		}
+
+		skip_ws(ps);
+		if (ps->p < ps->end && *ps->p == ',') {
+			ps->p++;
+			skip_ws(ps);
+		} else if (ps->p < ps->end && *ps->p == ']') {
+			ps->p++;
+			return array;
+		} else {
+			parser_error(ps, "']' expected");
+			goto error;
+		}
+	}
+
+error:
+	json_decref(array);
+	return NULL;
+}
+
+static json_t *parse_object(struct parser *ps)
+{
+	json_t *object, *value;
+	char tmp[64], *key = NULL;
+	const char *str;
+	size_t len;
+
+	ps->p++;
+	object = json_object();
+	if (!object) {
+		return parser_error(ps, "out of memory");
+	}
+
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == '}') {
+		ps->p++;
+		return object;
+	}
+
+	for (;;) {
+		if (ps->p == ps->end || *ps->p != '"') {
+			parser_error(ps, "string or '}' expected");
+			goto error;
+		}
+		if (!parse_string(ps, &str, &len)) {
+			goto error;
+		}
+		if (memchr(str, '\0', len)) {
+			parser_error(ps, "NUL byte in object key not supported");
+			goto error;
+		}
+
+		/* the key has to survive parsing the value */
+		key = len < sizeof(tmp) ? tmp : malloc(len + 1);
+		if (!key) {
+			parser_error(ps, "out of memory");
+			goto error;
+		}
+		memcpy(key, str, len);
+		key[len] = '\0';
+
+		skip_ws(ps);
+		if (ps->p == ps->end || *ps->p != ':') {
+			parser_error(ps, "':' expected");
+			goto error;
+		}
+		ps->p++;
+		skip_ws(ps);
+
+		value = parse_value(ps);
+		if (!value) {
+			goto error;
+		}
+		if (json_object_set_new_nocheck(object, key, value)) {
+			parser_error(ps, "out of memory");
+			goto error;
+		}
+		if (key != tmp) {
+			free(key);
+		}
+		key = NULL;
+
+		skip_ws(ps);
+		if (ps->p < ps->end && *ps->p == ',') {
+			ps->p++;
+			skip_ws(ps);
+		} else if (ps->p < ps->end && *ps->p == '}') {
+			ps->p++;
+			return object;
+		} else {
+			parser_error(ps, "'}' expected");
+			goto error;
+		}
+	}
+
+error:
+	if (key != tmp) {
+		free(key);
+	}
+	json_decref(object);
+	return NULL;
+}
+
+static json_t *parse_value(struct parser *ps)
+{
+	const char *p = ps->p;
+	json_t *value;
+	size_t left = ps->end - p;
+	const char *str;
+	size_t len;
+
+	if (p == ps->end) {
+		return parser_error(ps, "unexpected token");
+	}
+
+	switch (*p) {
+	case '{':
+	case '[':
+		if (++ps->depth > MAX_DEPTH) {
+			return parser_error(ps, "maximum parsing depth reached");
+		}
+		value = (*p == '{') ? parse_object(ps) : parse_array(ps);
+		ps->depth--;
+		return value;
+	case '"':
+		if (!parse_string(ps, &str, &len)) {
+			return NULL;
+		}
+		value = json_stringn_nocheck(str, len);
+		return value ? value : parser_error(ps, "out of memory");
+	case 't':
+		if (left >= 4 && !memcmp(p, "true", 4)) {
+			ps->p += 4;
+			return json_true();
+		}
+		break;
+	case 'f':
+		if (left >= 5 && !memcmp(p, "false", 5)) {
+			ps->p += 5;
+			return json_false();
+		}
+		break;
+	case 'n':
+		if (left >= 4 && !memcmp(p, "null", 4)) {
+			ps->p += 4;
+			return json_null();
+		}
+		break;
+	case '-':
+	case '0' ... '9':
+		return parse_number(ps);
+	}
+
+	return parser_error(ps, "invalid token");
+}
+
+json_t *jsonrpc_codec_decode(const char *buf, size_t len, size_t flags,
+		json_error_t *error)
+{
+	struct parser ps = {
+		.start = buf,
+		.p = buf,
+		.end = buf + len,
+		.flags = flags,
+		.error = error,
+	};
+	json_t *value = NULL;
+
+	if (error) {
+		memset(error, 0, sizeof(*error));
+	}
+
+	skip_ws(&ps);
+	if (!(flags & JSON_DECODE_ANY) &&
+			(ps.p == ps.end || (*ps.p != '[' && *ps.p != '{'))) {
+		parser_error(&ps, "'[' or '{' expected");
+		goto out;
+	}
+
+	value = parse_value(&ps);
+	if (!value) {
+		goto out;
+	}
+
+	if (!(flags & JSON_DISABLE_EOF_CHECK)) {
+		skip_ws(&ps);
+		if (ps.p != ps.end) {
+			parser_error(&ps, "end of file expected");
+			json_decref(value);
+			value = NULL;
+			goto out;
+		}
+	}
+	if (error) {
+		error->position = ps.p - ps.start;
+	}
+
+out:
+	free(ps.buf);
+	return value;
+}
+
+json_t *jsonrpc_codec_decode_file(FILE *file, size_t flags,
+		json_error_t *error)
+{
+	char *buf = NULL, *new;
+	size_t len = 0, size = 0;
+	json_t *value;
+
+	while (!feof(file) && !ferror(file)) {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			new = realloc(buf, size);
+			if (!new) {
+				break;
+			}
+			buf = new;
+		}
+		len += fread(buf + len, 1, size - len, file);
+	}
+	if (ferror(file) || !feof(file)) {
+		free(buf);
+		if (error) {
+			memset(error, 0, sizeof(*error));
+			snprintf(error->text, sizeof(error->text),
+					"unable to read the input");
+		}
+		return NULL;
+	}
+
+	value = jsonrpc_codec_decode(buf ? buf : "", len, flags, error);
+	free(buf);
+
+	return value;
+}
+
+int jsonrpc_codec_encode(const json_t *value, jsonrpc_write_t write,
+		void *priv, size_t flags)
+{
+	return json_dump_callback(value, write, priv, flags);
+}
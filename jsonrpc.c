@@ -7,17 +7,57 @@
 
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include <jansson.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "jsonrpc.h"
+#include "jsonrpc_codec.h"
+#include "jsonrpc_cache.h"
+#include "jsonrpc_flight.h"
+#include "jsonrpc_hash.h"
+#include "jsonrpc_msgpack.h"
+#include "jsonrpc_alloc.h"
 
 struct rpc_callback {
 	const char *name;
+	size_t len;
+	uint64_t hash;
+	/* the position in the registry, stable once registered */
+	unsigned int id;
 	rpc_callback cb;
-	struct rpc_callback *next;
+	rpc_async_callback async;
+	rpc_lazy_callback lazy;
+	struct jsonrpc_cache *cache;
+	struct jsonrpc_flight *flight;
+	unsigned int max_concurrent;
+	/* calls running right now, only counted with a max_concurrent */
+	unsigned int active;
 };
 
+/*
+ * Registered methods are stored in a dense array, and their position is
+ * their id. Lookups go through an open addressing hash index whose slots
+ * contain the id plus one, so zero marks a free slot. The index is kept at
+ * most half full.
+ */
+struct rpc_registry {
+	struct rpc_callback *methods;
+	size_t count;
+	size_t size;
+	unsigned int *index;
+	size_t mask;
+	bool sealed;
+};
+
+/* methods registered with JSONRPC_SEALED, provided by the linker */
+extern const struct jsonrpc_method __start_jsonrpc_methods[] __attribute__((weak));
+extern const struct jsonrpc_method __stop_jsonrpc_methods[] __attribute__((weak));
+
 enum rsp_error {
 	ERR_NO_ERR,
 	ERR_PARSE_ERROR,
@@ -25,366 +65,3730 @@ enum rsp_error {
 	ERR_METHOD_NOT_FOUND,
 	ERR_INVALID_PARAMS,
 	ERR_INTERNAL_ERROR,
+	/* rejected by the limits */
+	ERR_SERVER_BUSY,
+	ERR_TOO_LARGE,
+};
+
+/* already encoded JSON, see jsonrpc_result_raw() */
+struct raw_json {
+	const char *json;
+	size_t len;
+	void (*free)(void *);
 };
 
 struct jsonrpc_ret {
 	enum {
 		JSONRPC_ERROR,
 		JSONRPC_RESULT,
+		JSONRPC_RESULT_RAW,
 	} type;
+	/* the result, or the error data */
 	json_t *obj;
+	struct raw_json raw;
+	enum rsp_error err;
+	/* NULL if allocated */
+	struct ret_pool *pool;
 };
 
-static jsonrpc_confflags_t config;
-static struct rpc_callback *rpc_callbacks = NULL;
+/*
+ * Asynchronous requests. Every member of a (batch) request has a completion
+ * handle. Its response is encoded as soon as it completes, which may happen
+ * on any thread. The last completion assembles the response and passes it to
+ * the done callback. The request tree, and thus the params, are kept until
+ * then.
+ */
+struct jsonrpc_async {
+	/* NULL if this is a struct async_waiter */
+	struct async_request *req;
+	json_t *id;
+	char *response;
+	/* for the post hooks, params are borrowed from the request tree */
+	struct rpc_callback *walk;
+	json_t *params;
+	unsigned int sampled;
+};
 
-static json_t *jsonrpc_error_object(enum rsp_error err, json_t *data)
-{
-	json_t *errobj;
+struct async_request {
+	struct jsonrpc_ctx *ctx;
+	jsonrpc_done_t done;
+	void *priv;
+	json_t *request;
+	bool batch;
+	/* counted against max_inflight until done is called */
+	bool counted;
+	/* members which haven't completed yet, plus one for the dispatcher */
+	size_t pending;
+	size_t count;
+	struct jsonrpc_async members[];
+};
 
-	static const int code[] = {
-		[ERR_PARSE_ERROR] = -32700,
-		[ERR_INVALID_REQUEST] = -32600,
-		[ERR_METHOD_NOT_FOUND] = -32601,
-		[ERR_INVALID_PARAMS] = -32602,
-		[ERR_INTERNAL_ERROR] = -32603,
-	};
+/*
+ * The registry and the configuration are set up before the context is used.
+ * The first request seals the registry, after which it is only read, so any
+ * number of threads can handle requests without taking a lock.
+ */
+struct jsonrpc_ctx {
+	jsonrpc_confflags_t config;
+	struct rpc_registry registry;
+	jsonrpc_executor_t executor;
+	void *executor_priv;
+	struct jsonrpc_hook hooks[JSONRPC_MAX_HOOKS];
+	unsigned int nhooks;
+	struct jsonrpc_limits limits;
+	/* requests handled right now, only counted with a max_inflight */
+	unsigned int inflight;
+	pthread_mutex_t lock;
+#ifdef JSONRPC_STATS
+	unsigned long stats_id;
+	struct stats_block *stats;
+#endif
+};
 
-	static const char *message[] = {
-		[ERR_PARSE_ERROR] = "Parse error",
-		[ERR_INVALID_REQUEST] = "Invalid Request",
-		[ERR_METHOD_NOT_FOUND] = "Method not found",
-		[ERR_INVALID_PARAMS] = "Invalid params",
-		[ERR_INTERNAL_ERROR] = "Internal error",
-	};
+/*
+ * Return values are handed out from a small per-thread pool, so the usual
+ * single result per call does not hit the allocator. Only if a callback holds
+ * more return values at once than there are slots, they are allocated.
+ *
+ * A return value may be released on another thread, for example by
+ * jsonrpc_complete(), so the slots are given back to the pool they came from
+ * with an atomic operation. A pool outlives its thread until its last slot is
+ * given back.
+ */
+#define RET_POOL_SIZE 8
+/* in the used mask, once the owning thread has exited */
+#define RET_POOL_EXITED (1u << 31)
 
-	errobj = json_object();
-	json_object_set_new(errobj, "code", json_integer(code[err]));
-	json_object_set_new(errobj, "message", json_string(message[err]));
-	if (!(config & JSONRPC_DISABLE_ERROR_TEXT) && data) {
-		json_object_set(errobj, "data", data);
-	}
+struct ret_pool {
+	unsigned int used;
+	struct jsonrpc_ret rets[RET_POOL_SIZE];
+};
 
-	return errobj;
-}
+static __thread struct ret_pool *ret_pool;
+static pthread_once_t ret_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ret_pool_key;
 
-static json_t *jsonrpc_error_object_str(enum rsp_error err, const char *str)
-{
-	json_t *errobj, *data;
-	data = json_string(str);
-	errobj = jsonrpc_error_object(err, data);
-	json_decref(data);
+static struct jsonrpc_ctx default_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-	return errobj;
+static struct jsonrpc_ctx *ctx_get(jsonrpc_ctx_t *ctx)
+{
+	return ctx ? ctx : &default_ctx;
 }
 
-static json_t *jsonrpc_response_object(json_t *result, json_t *error,
-		json_t *id)
+static jsonrpc_confflags_t ctx_config(const struct jsonrpc_ctx *ctx)
 {
-	json_t *rspobj;
+	return __atomic_load_n(&ctx->config, __ATOMIC_RELAXED);
+}
 
-	assert((result == NULL && error != NULL) || (result != NULL && error == NULL));
-	assert(id);
+static struct rpc_callback *find_callback(const struct rpc_registry *reg,
+		const char *name, size_t len)
+{
+	unsigned int slot;
+	uint64_t hash;
+	size_t pos;
 
-	rspobj = json_object();
-	json_object_set_new(rspobj, "jsonrpc", json_string("2.0"));
-	if (result) {
-		json_object_set(rspobj, "result", result);
+	if (!reg->index) {
+		return NULL;
 	}
-	if (error) {
-		json_object_set(rspobj, "error", error);
+
+	hash = jsonrpc_hash(name, len);
+	for (pos = hash & reg->mask; (slot = reg->index[pos]); pos = (pos + 1) & reg->mask) {
+		struct rpc_callback *walk = &reg->methods[slot - 1];
+		if (walk->hash == hash && walk->len == len &&
+				!memcmp(walk->name, name, len)) {
+			return walk;
+		}
 	}
-	json_object_set(rspobj, "id", id);
 
-	return rspobj;
+	return NULL;
 }
 
-static json_t *decode_request(FILE *file, const char *buf, size_t len,
-		json_t **_request)
+static void index_insert(unsigned int *index, size_t mask, uint64_t hash,
+		unsigned int slot)
 {
-	json_t *request;
-	json_error_t err;
+	size_t pos;
 
-	if (file) {
-		request = json_loadf(file, 0, &err);
-	} else {
-		request = json_loadb(buf, len, 0, &err);
-	}
-	if (!request) {
-		return jsonrpc_error_object_str(ERR_PARSE_ERROR, err.text);
-	}
+	for (pos = hash & mask; index[pos]; pos = (pos + 1) & mask)
+		;
+	index[pos] = slot;
+}
 
-	*_request = request;
+static void index_rebuild(struct rpc_registry *reg, size_t slots)
+{
+	unsigned int *index;
+	size_t i;
 
-	return NULL;
+	index = calloc(slots, sizeof(*index));
+	assert(index);
+
+	for (i = 0; i < reg->count; i++) {
+		index_insert(index, slots - 1, reg->methods[i].hash, i + 1);
+	}
+
+	free(reg->index);
+	reg->index = index;
+	reg->mask = slots - 1;
 }
 
-static json_t *validate_request(json_t *req, json_t **_method, json_t **_params,
-		json_t **_id)
+/* exactly one of the callbacks is set */
+static bool method_valid(const struct jsonrpc_method *method)
 {
-	int rc;
-	json_error_t err;
-	char *jsonrpc;
-	json_t *method = NULL, *params = NULL, *id = NULL;
+	return method->name &&
+		!!method->cb + !!method->async + !!method->lazy == 1;
+}
 
-	rc = json_unpack_ex(req, &err, 0, "{s:s,s:o,s?o,s?o}",
-			"jsonrpc", &jsonrpc,
-			"method", &method,
-			"params", &params,
-			"id", &id);
+static int registry_add(struct rpc_registry *reg,
+		const struct jsonrpc_method *method)
+{
+	struct rpc_callback *new;
+	const char *name = method->name;
+	size_t len;
 
-	if (rc) {
-		return jsonrpc_error_object_str(ERR_INVALID_REQUEST, err.text);
+	if (reg->sealed || !method_valid(method)) {
+		return -1;
 	}
+	len = strlen(name);
 
-	if (id && !json_is_string(id) && !json_is_number(id) && !json_is_null(id)) {
-		return jsonrpc_error_object_str(ERR_INVALID_REQUEST,
-				"\"id\" must contain a string, number, or NULL value");
+	/* the first registration of a name wins */
+	if (find_callback(reg, name, len)) {
+		return -1;
 	}
 
-	if (strcmp(jsonrpc, "2.0")) {
-		return jsonrpc_error_object_str(ERR_INVALID_REQUEST,
-				"\"jsonrpc\" must be exactly \"2.0\"");
+	if (reg->count == reg->size) {
+		reg->size = reg->size ? reg->size * 2 : 16;
+		reg->methods = realloc(reg->methods, reg->size * sizeof(*new));
+		assert(reg->methods);
 	}
 
-	if (!json_is_string(method)) {
-		return jsonrpc_error_object_str(ERR_INVALID_REQUEST,
-				"\"method\" must be a string");
+	new = &reg->methods[reg->count++];
+	new->name = name;
+	new->len = len;
+	new->hash = jsonrpc_hash(name, len);
+	new->id = reg->count - 1;
+	new->cb = method->cb;
+	new->async = method->async;
+	new->lazy = method->lazy;
+	new->cache = NULL;
+	new->max_concurrent = method->max_concurrent;
+	new->active = 0;
+	if (method->cb && method->cache_ttl && method->cache_size) {
+		new->cache = jsonrpc_cache_create(method->cache_ttl,
+				method->cache_size);
+		assert(new->cache);
+	}
+	new->flight = NULL;
+	if (method->cb && method->single_flight) {
+		new->flight = jsonrpc_flight_create();
+		assert(new->flight);
 	}
 
-	if (params && !json_is_array(params) && !json_is_object(params)) {
-		return jsonrpc_error_object_str(ERR_INVALID_REQUEST,
-				"\"params\" must be a an array or an object");
+	if (reg->count * 2 > reg->mask + 1) {
+		index_rebuild(reg, reg->mask ? (reg->mask + 1) * 2 : 32);
+	} else {
+		index_insert(reg->index, reg->mask, new->hash, reg->count);
 	}
 
-	*_id = json_incref(id);
-	*_method = json_incref(method);
-	*_params = json_incref(params);
+	return 0;
+}
 
-	return NULL;
+static size_t section_count(void)
+{
+	return __stop_jsonrpc_methods - __start_jsonrpc_methods;
 }
 
-static json_t *dispatch_request(const char* method, json_t *params,
-		json_t **_result)
+/*
+ * Add the given methods from the linker section and compact the registry
+ * before it is frozen. The method array and the index are sized exactly
+ * once, so there is no per-method allocation.
+ */
+static void registry_seal(struct rpc_registry *reg,
+		const struct jsonrpc_method *start, const struct jsonrpc_method *stop)
 {
-	jsonrpc_ret_t ret;
-	json_t *result = NULL;
-	struct rpc_callback *walk;
+	const struct jsonrpc_method *walk;
+	size_t total, slots = 32;
 
-	/* find callback */
-	for (walk = rpc_callbacks; walk; walk = walk->next) {
-		if (!strcmp(method, walk->name)) {
-			break;
+	total = reg->count + (stop - start);
+	if (total) {
+		reg->methods = realloc(reg->methods, total * sizeof(*reg->methods));
+		assert(reg->methods);
+		reg->size = total;
+
+		while (slots < total * 2) {
+			slots *= 2;
 		}
+		index_rebuild(reg, slots);
 	}
 
-	if (!walk) {
-		return jsonrpc_error_object(ERR_METHOD_NOT_FOUND, NULL);
+	for (walk = start; walk < stop; walk++) {
+		registry_add(reg, walk);
 	}
+}
 
-	/* call callback */
-	ret = walk->cb(params);
-	if (!ret) {
-		return jsonrpc_error_object(ERR_INTERNAL_ERROR, NULL);
-	} else if (ret->type == JSONRPC_ERROR) {
-		json_t *err = ret->obj;
-		free(ret);
-		return err;
-	} else if (ret->type == JSONRPC_RESULT) {
-		result = ret->obj;
-	} else {
-		return jsonrpc_error_object(ERR_INTERNAL_ERROR, NULL);
-	}
-	free(ret);
-	*_result = result;
+static void registry_free(struct rpc_registry *reg)
+{
+	size_t i;
 
-	return NULL;
+	for (i = 0; i < reg->count; i++) {
+		jsonrpc_cache_destroy(reg->methods[i].cache);
+		jsonrpc_flight_destroy(reg->methods[i].flight);
+	}
+	free(reg->methods);
+	free(reg->index);
+	memset(reg, 0, sizeof(*reg));
 }
 
-static char *encode_response(json_t *response)
+static bool ctx_sealed(const struct jsonrpc_ctx *ctx)
 {
-	size_t flags = 0;
+	return __atomic_load_n(&ctx->registry.sealed, __ATOMIC_ACQUIRE);
+}
 
-	if (config & JSONRPC_ORDERED_RESPONSE) {
-		flags |= JSON_PRESERVE_ORDER;
+static void ctx_seal(struct jsonrpc_ctx *ctx)
+{
+	struct rpc_registry *reg = &ctx->registry;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!reg->sealed) {
+		/* the linker section belongs to the default context */
+		if (ctx == &default_ctx) {
+			registry_seal(reg, __start_jsonrpc_methods, __stop_jsonrpc_methods);
+		} else {
+			registry_seal(reg, NULL, NULL);
+		}
+		__atomic_store_n(&reg->sealed, true, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+#ifdef JSONRPC_ALLOC_TRACE
+#ifndef JSONRPC_STATS
+#error "JSONRPC_ALLOC_TRACE is reported through the stats, it needs JSONRPC_STATS"
+#endif
+
+__thread struct jsonrpc_alloc_trace jsonrpc_alloc_trace;
 
-	return json_dumps(response, flags);
+static json_malloc_t trace_next_malloc;
+
+/* jansson's allocations are counted along with the ones of the library */
+static void *trace_json_malloc(size_t size)
+{
+	jsonrpc_alloc_note(size);
+	return trace_next_malloc(size);
 }
 
-static json_t *_jsonrpc_handle_single_request(json_t *request)
+/* before any method is registered, and before the arena chains up */
+static void __attribute__((constructor)) trace_install(void)
 {
-	json_t *error;
-	json_t *method = NULL, *params = NULL, *id = NULL;
-	json_t *result = NULL;
-	json_t *response = NULL;
+	json_free_t next_free;
 
-	error = validate_request(request, &method, &params, &id);
-	if (error) {
-		/* if there was an parse error or an invalid request error, the id must
-		 * be set to null */
-		id = json_null();
-	}
+	json_get_alloc_funcs(&trace_next_malloc, &next_free);
+	json_set_alloc_funcs(trace_json_malloc, next_free);
+}
+#endif
 
-	if (!error) {
-		error = dispatch_request(json_string_value(method), params, &result);
-		json_decref(method);
-		json_decref(params);
-	}
+#ifdef JSONRPC_STATS
+/*
+ * Call counters and latency histograms. Every thread counts into a block of
+ * its own per context. A block is only ever written by its thread, so
+ * counting takes neither a lock nor an atomic read-modify-write. Snapshots
+ * add up the blocks of all threads.
+ */
+enum stats_phase {
+	PHASE_DECODE,
+	PHASE_VALIDATE,
+	PHASE_DISPATCH,
+	PHASE_ENCODE,
+	PHASE_COUNT,
+};
 
-	if (!id) {
-		/* this is a notification, no response is sent */
-		json_decref(result);
-		json_decref(error);
-		return NULL;
-	}
+#define ERR_COUNT (ERR_TOO_LARGE + 1)
+
+/* bucket n counts latencies below 2^n nanoseconds */
+#define STATS_BUCKETS 40
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+/* heap allocations, only counted with JSONRPC_ALLOC_TRACE */
+struct stats_allocs {
+	uint64_t count;
+	uint64_t bytes;
+};
+
+struct stats_method {
+	uint64_t calls;
+	uint64_t errors[ERR_COUNT];
+	struct stats_hist latency;
+	struct stats_allocs allocs;
+};
+
+struct stats_block {
+	struct stats_block *next;
+	pthread_t owner;
+	struct stats_hist phases[PHASE_COUNT];
+	struct stats_allocs phase_allocs[PHASE_COUNT];
+	uint64_t errors[ERR_COUNT];
+	/* indexed like the registry, replaced with the context lock held */
+	struct stats_method *methods;
+	size_t count;
+};
+
+#define STATS_CACHE_SIZE 4
+
+/* the blocks of the calling thread, by context id */
+static __thread struct {
+	unsigned long id;
+	struct stats_block *block;
+} stats_cache[STATS_CACHE_SIZE];
+
+static unsigned long stats_last_id;
+
+static const char *const stats_phase_names[PHASE_COUNT] = {
+	"decode", "validate", "dispatch", "encode",
+};
+
+static const char *const stats_error_names[ERR_COUNT] = {
+	NULL, "parse_error", "invalid_request", "method_not_found",
+	"invalid_params", "internal_error", "server_busy", "too_large",
+};
 
-	response = jsonrpc_response_object(result, error, id);
-	json_decref(result);
-	json_decref(error);
-	json_decref(id);
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return response;
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-static json_t *_jsonrpc_handle_multiple_requests(json_t *requests)
+/* where a phase or a method call started */
+struct stats_start {
+	uint64_t ns;
+	struct stats_allocs allocs;
+};
+
+static struct stats_allocs stats_allocs_now(void)
 {
-	int i;
-	json_t *responses;
+#ifdef JSONRPC_ALLOC_TRACE
+	return (struct stats_allocs){
+		jsonrpc_alloc_trace.count,
+		jsonrpc_alloc_trace.bytes,
+	};
+#else
+	return (struct stats_allocs){ 0, 0 };
+#endif
+}
 
-	responses = json_array();
-	for (i = 0; i < json_array_size(requests); i++) {
-		json_t *request = json_array_get(requests, i);
-		json_t *response = _jsonrpc_handle_single_request(request);
-		if (response) {
-			json_array_append_new(responses, response);
-		}
+static struct stats_start stats_begin(void)
+{
+	return (struct stats_start){ stats_now(), stats_allocs_now() };
+}
+
+/* only the owner writes, snapshots may read concurrently */
+static void stats_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			__ATOMIC_RELAXED);
+}
+
+/* the allocations since start, taken before the stats allocate themselves */
+static void stats_allocs_add(struct stats_allocs *allocs,
+		const struct stats_allocs *now, const struct stats_start *start)
+{
+#ifdef JSONRPC_ALLOC_TRACE
+	stats_add(&allocs->count, now->count - start->allocs.count);
+	stats_add(&allocs->bytes, now->bytes - start->allocs.bytes);
+#endif
+}
+
+static void stats_hist_add(struct stats_hist *hist, uint64_t ns)
+{
+	unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
+	stats_add(&hist->buckets[bucket], 1);
+	stats_add(&hist->count, 1);
+	if (ns > hist->max) {
+		__atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+	}
+}
+
+static struct stats_block *stats_get(struct jsonrpc_ctx *ctx)
+{
+	unsigned int slot = ctx->stats_id % STATS_CACHE_SIZE;
+	struct stats_block *block;
+
+	if (stats_cache[slot].block && stats_cache[slot].id == ctx->stats_id) {
+		return stats_cache[slot].block;
 	}
 
-	if (json_array_size(responses) == 0) {
-		json_decref(responses);
-		responses = NULL;
+	/* a block of an exited thread is taken over by a new one */
+	pthread_mutex_lock(&ctx->lock);
+	for (block = ctx->stats; block; block = block->next) {
+		if (pthread_equal(block->owner, pthread_self())) {
+			break;
+		}
+	}
+	if (!block) {
+		block = calloc(1, sizeof(*block));
+		assert(block);
+		block->owner = pthread_self();
+		block->next = ctx->stats;
+		ctx->stats = block;
 	}
+	pthread_mutex_unlock(&ctx->lock);
 
-	return responses;
+	stats_cache[slot].id = ctx->stats_id;
+	stats_cache[slot].block = block;
+
+	return block;
 }
 
-static char *_jsonrpc_handle_request(FILE* file, const char *buf, size_t len)
+static void stats_phase(struct jsonrpc_ctx *ctx, enum stats_phase phase,
+		const struct stats_start *start)
 {
-	char *ret;
-	json_t *id, *error, *request = NULL, *response;
+	struct stats_allocs allocs = stats_allocs_now();
+	uint64_t ns = stats_now() - start->ns;
+	struct stats_block *block = stats_get(ctx);
 
-	error = decode_request(file, buf, len, &request);
-	if (error) {
-		goto error;
-	}
+	stats_hist_add(&block->phases[phase], ns);
+	stats_allocs_add(&block->phase_allocs[phase], &allocs, start);
+}
 
-	if (json_is_array(request) && json_array_size(request) == 0) {
-		json_decref(request);
-		error = jsonrpc_error_object_str(ERR_INVALID_REQUEST,
-				"Request must not be an empty array.");
-		goto error;
+static void stats_error(struct jsonrpc_ctx *ctx, enum rsp_error err)
+{
+	stats_add(&stats_get(ctx)->errors[err], 1);
+}
+
+/* methods may have been registered since the block was last grown */
+static void stats_grow(struct jsonrpc_ctx *ctx, struct stats_block *block)
+{
+	size_t count = ctx->registry.count;
+	struct stats_method *methods, *old;
+
+	methods = calloc(count, sizeof(*methods));
+	assert(methods);
+	if (block->count) {
+		memcpy(methods, block->methods, block->count * sizeof(*methods));
 	}
 
-	if (!json_is_array(request)) {
-		response = _jsonrpc_handle_single_request(request);
-	} else {
-		response = _jsonrpc_handle_multiple_requests(request);
+	pthread_mutex_lock(&ctx->lock);
+	old = block->methods;
+	block->methods = methods;
+	block->count = count;
+	pthread_mutex_unlock(&ctx->lock);
+
+	free(old);
+}
+
+static void stats_call(struct jsonrpc_ctx *ctx, struct rpc_callback *walk,
+		const struct stats_start *start, enum rsp_error err)
+{
+	struct stats_allocs allocs = stats_allocs_now();
+	uint64_t ns = stats_now() - start->ns;
+	struct stats_block *block = stats_get(ctx);
+	size_t index = walk->id;
+	struct stats_method *method;
+
+	if (index >= block->count) {
+		stats_grow(ctx, block);
 	}
-	json_decref(request);
+	method = &block->methods[index];
 
-	ret = encode_response(response);
-	json_decref(response);
+	stats_add(&method->calls, 1);
+	if (err != ERR_NO_ERR) {
+		stats_add(&method->errors[err], 1);
+	}
+	stats_hist_add(&method->latency, ns);
+	stats_hist_add(&block->phases[PHASE_DISPATCH], ns);
+	stats_allocs_add(&method->allocs, &allocs, start);
+	stats_allocs_add(&block->phase_allocs[PHASE_DISPATCH], &allocs, start);
+}
 
-	return ret;
+static void stats_hist_sum(struct stats_hist *sum, const struct stats_hist *hist)
+{
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	unsigned int i;
 
-error:
-	id = json_null();
-	response = jsonrpc_response_object(NULL, error, id);
-	json_decref(id);
-	json_decref(error);
-	ret = encode_response(response);
-	json_decref(response);
+	sum->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	if (max > sum->max) {
+		sum->max = max;
+	}
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		sum->buckets[i] += __atomic_load_n(&hist->buckets[i],
+				__ATOMIC_RELAXED);
+	}
+}
 
-	return ret;
+static void stats_allocs_sum(struct stats_allocs *sum,
+		const struct stats_allocs *allocs)
+{
+	sum->count += __atomic_load_n(&allocs->count, __ATOMIC_RELAXED);
+	sum->bytes += __atomic_load_n(&allocs->bytes, __ATOMIC_RELAXED);
 }
 
+static void stats_errors_sum(uint64_t *sum, const uint64_t *errors)
+{
+	unsigned int i;
 
-char *jsonrpc_handle_request(const char *buf, size_t len)
+	for (i = 0; i < ERR_COUNT; i++) {
+		sum[i] += __atomic_load_n(&errors[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* percentiles are the upper bound of their bucket, but at most the maximum */
+static json_t *stats_hist_json(const struct stats_hist *hist)
 {
-	return _jsonrpc_handle_request(NULL, buf, len);
+	static const unsigned int percentiles[] = { 50, 90, 99 };
+	json_t *obj;
+	unsigned int i, bucket;
+
+	obj = json_object();
+	json_object_set_new(obj, "count", json_integer(hist->count));
+	json_object_set_new(obj, "max", json_integer(hist->max));
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		uint64_t rank = (hist->count * percentiles[i] + 99) / 100;
+		uint64_t seen = 0, value = 0;
+		char key[8];
+
+		for (bucket = 0; rank && bucket < STATS_BUCKETS; bucket++) {
+			seen += hist->buckets[bucket];
+			if (seen >= rank) {
+				value = (1ull << bucket) - 1;
+				break;
+			}
+		}
+		if (value > hist->max) {
+			value = hist->max;
+		}
+		snprintf(key, sizeof(key), "p%u", percentiles[i]);
+		json_object_set_new(obj, key, json_integer(value));
+	}
+
+	return obj;
 }
 
-char *jsonrpc_handle_request_from_file(FILE *file)
+static void stats_allocs_json(json_t *obj, const struct stats_allocs *allocs)
 {
-	return _jsonrpc_handle_request(file, NULL, 0);
+#ifdef JSONRPC_ALLOC_TRACE
+	json_object_set_new(obj, "allocs", json_integer(allocs->count));
+	json_object_set_new(obj, "alloc_bytes", json_integer(allocs->bytes));
+#endif
 }
 
-jsonrpc_ret_t jsonrpc_result(json_t *result)
+static json_t *stats_errors_json(const uint64_t *errors)
 {
-	jsonrpc_ret_t ret;
+	json_t *obj = json_object();
+	unsigned int i;
 
-	ret = malloc(sizeof(struct jsonrpc_ret));
-	ret->type = JSONRPC_RESULT;
-	ret->obj = result;
-	return ret;
+	for (i = ERR_NO_ERR + 1; i < ERR_COUNT; i++) {
+		json_object_set_new(obj, stats_error_names[i], json_integer(errors[i]));
+	}
+
+	return obj;
 }
 
-static jsonrpc_ret_t _jsonrpc_error(enum rsp_error err, json_t *data)
+static json_t *stats_snapshot(struct jsonrpc_ctx *ctx)
 {
-	jsonrpc_ret_t ret;
+	struct stats_hist phases[PHASE_COUNT];
+	struct stats_allocs phase_allocs[PHASE_COUNT];
+	uint64_t errors[ERR_COUNT] = { 0 };
+	struct stats_method *methods;
+	struct stats_block *block;
+	json_t *snapshot, *phases_obj, *methods_obj, *obj;
+	size_t count, i;
+
+	memset(phases, 0, sizeof(phases));
+	memset(phase_allocs, 0, sizeof(phase_allocs));
+
+	pthread_mutex_lock(&ctx->lock);
+	count = ctx->registry.count;
+	methods = calloc(count + 1, sizeof(*methods));
+	if (!methods) {
+		pthread_mutex_unlock(&ctx->lock);
+		return NULL;
+	}
 
-	ret = malloc(sizeof(struct jsonrpc_ret));
-	ret->type = JSONRPC_ERROR;
-	ret->obj = jsonrpc_error_object(err, data);
-	json_decref(data);
-	return ret;
+	for (block = ctx->stats; block; block = block->next) {
+		for (i = 0; i < PHASE_COUNT; i++) {
+			stats_hist_sum(&phases[i], &block->phases[i]);
+			stats_allocs_sum(&phase_allocs[i], &block->phase_allocs[i]);
+		}
+		stats_errors_sum(errors, block->errors);
+		for (i = 0; i < block->count && i < count; i++) {
+			methods[i].calls += __atomic_load_n(&block->methods[i].calls,
+					__ATOMIC_RELAXED);
+			stats_errors_sum(methods[i].errors, block->methods[i].errors);
+			stats_hist_sum(&methods[i].latency, &block->methods[i].latency);
+			stats_allocs_sum(&methods[i].allocs, &block->methods[i].allocs);
+		}
+	}
+
+	phases_obj = json_object();
+	for (i = 0; i < PHASE_COUNT; i++) {
+		obj = stats_hist_json(&phases[i]);
+		stats_allocs_json(obj, &phase_allocs[i]);
+		json_object_set_new(phases_obj, stats_phase_names[i], obj);
+	}
+
+	/* methods which were never called are left out */
+	methods_obj = json_object();
+	for (i = 0; i < count; i++) {
+		if (!methods[i].calls) {
+			continue;
+		}
+		obj = json_object();
+		json_object_set_new(obj, "calls", json_integer(methods[i].calls));
+		json_object_set_new(obj, "errors",
+				stats_errors_json(methods[i].errors));
+		json_object_set_new(obj, "latency",
+				stats_hist_json(&methods[i].latency));
+		stats_allocs_json(obj, &methods[i].allocs);
+		json_object_set_new(methods_obj, ctx->registry.methods[i].name, obj);
+	}
+
+	snapshot = json_object();
+	json_object_set_new(snapshot, "errors", stats_errors_json(errors));
+	json_object_set_new(snapshot, "phases", phases_obj);
+	json_object_set_new(snapshot, "methods", methods_obj);
+	pthread_mutex_unlock(&ctx->lock);
+	free(methods);
+
+	return snapshot;
 }
 
-jsonrpc_ret_t jsonrpc_error_invalid_params(json_t *data)
+static void stats_free(struct jsonrpc_ctx *ctx)
 {
-	return _jsonrpc_error(ERR_INVALID_PARAMS, data);
+	struct stats_block *block, *next;
+
+	for (block = ctx->stats; block; block = next) {
+		next = block->next;
+		free(block->methods);
+		free(block);
+	}
+	ctx->stats = NULL;
 }
 
-jsonrpc_ret_t jsonrpc_error_internal_error(json_t *data)
+#define STATS_START(start) struct stats_start start = stats_begin()
+#define STATS_PHASE(ctx, phase, start) stats_phase(ctx, phase, &start)
+#define STATS_CALL(ctx, walk, start, err) stats_call(ctx, walk, &start, err)
+#define STATS_ERROR(ctx, err) stats_error(ctx, err)
+#else
+#define STATS_START(start)
+#define STATS_PHASE(ctx, phase, start) do { } while (0)
+#define STATS_CALL(ctx, walk, start, err) do { } while (0)
+#define STATS_ERROR(ctx, err) do { } while (0)
+#endif
+
+/*
+ * Per-request arena. While a request is handled with JSONRPC_REQUEST_ARENA
+ * set, all jansson allocations of the handling thread are carved out of
+ * thread-local chunks and freeing them is a no-op. The arena is reset in one
+ * go when the request is done. Allocations outside of an arena scope and
+ * frees of memory the arena doesn't own go to the allocation functions that
+ * were installed before.
+ */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+	struct arena_chunk *base;
+	struct arena_chunk *chunks;
+	/* the chunks ordered by address, which arena_owns() searches */
+	struct arena_chunk **sorted;
+	size_t count;
+	size_t size;
+	char *cur;
+	char *end;
+	bool active;
+};
+
+static __thread struct arena arena;
+static json_malloc_t arena_next_malloc;
+static json_free_t arena_next_free;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+static struct arena_chunk *arena_chunk_new(size_t size)
 {
-	return _jsonrpc_error(ERR_INTERNAL_ERROR, data);
+	struct arena_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + size);
+	if (chunk) {
+		chunk->next = NULL;
+		chunk->size = size;
+	}
+
+	return chunk;
 }
 
-void _jsonrpc_register(const char *name, rpc_callback cb)
+/* links a new chunk of the scope, or frees it if it can't be tracked */
+static int arena_add(struct arena *a, struct arena_chunk *chunk)
 {
-	struct rpc_callback *new;
+	size_t lo = 0, hi = a->count, mid;
 
-	new = malloc(sizeof(*new));
-	assert(new);
+	if (a->count == a->size) {
+		size_t size = a->size ? a->size * 2 : 8;
+		struct arena_chunk **sorted;
 
-	new->name = name;
-	new->cb = cb;
-	new->next = NULL;
+		sorted = realloc(a->sorted, size * sizeof(*sorted));
+		if (!sorted) {
+			free(chunk);
+			return -1;
+		}
+		a->sorted = sorted;
+		a->size = size;
+	}
 
-	if (rpc_callbacks == NULL) {
-		rpc_callbacks = new;
-	} else {
-		struct rpc_callback *walk = rpc_callbacks;
-		while (walk->next) {
-			walk = walk->next;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((uintptr_t)a->sorted[mid] < (uintptr_t)chunk) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		walk->next = new;
 	}
+	memmove(&a->sorted[lo + 1], &a->sorted[lo],
+			(a->count - lo) * sizeof(*a->sorted));
+	a->sorted[lo] = chunk;
+	a->count++;
+
+	chunk->next = a->chunks;
+	a->chunks = chunk;
+
+	return 0;
 }
 
-static void __attribute__((destructor)) _jsonrpc_unregister_all(void)
+static bool arena_owns(const struct arena *a, const void *ptr)
 {
-	struct rpc_callback *next, *walk = rpc_callbacks;
+	const struct arena_chunk *chunk;
+	uintptr_t p = (uintptr_t)ptr;
+	size_t lo = 0, hi = a->count, mid;
 
-	while (walk) {
-		next = walk->next;
-		free(walk);
-		walk = next;
+	if (a->base && p - (uintptr_t)a->base->data < a->base->size) {
+		return true;
+	}
+
+	/* the last chunk starting at or before ptr is the only candidate */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((uintptr_t)a->sorted[mid]->data <= p) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	if (!lo) {
+		return false;
+	}
+	chunk = a->sorted[lo - 1];
+
+	return p - (uintptr_t)chunk->data < chunk->size;
+}
+
+static void *arena_malloc(size_t size)
+{
+	struct arena *a = &arena;
+	struct arena_chunk *chunk;
+	void *ptr;
+
+	if (!a->active) {
+		return arena_next_malloc(size);
+	}
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > (size_t)(a->end - a->cur)) {
+		/* large allocations get a chunk of their own */
+		if (size > ARENA_CHUNK_SIZE / 4) {
+			chunk = arena_chunk_new(size);
+			if (!chunk || arena_add(a, chunk)) {
+				return NULL;
+			}
+			return chunk->data;
+		}
+
+		chunk = arena_chunk_new(ARENA_CHUNK_SIZE);
+		if (!chunk || arena_add(a, chunk)) {
+			return NULL;
+		}
+		a->cur = chunk->data;
+		a->end = chunk->data + chunk->size;
+	}
+
+	ptr = a->cur;
+	a->cur += size;
+
+	return ptr;
+}
+
+static void arena_free(void *ptr)
+{
+	if (ptr && !arena_owns(&arena, ptr)) {
+		arena_next_free(ptr);
+	}
+}
+
+/* frees the base chunk when a thread exits */
+static void arena_destroy(void *base)
+{
+	free(base);
+}
+
+static void arena_install(void)
+{
+	pthread_key_create(&arena_key, arena_destroy);
+	json_get_alloc_funcs(&arena_next_malloc, &arena_next_free);
+	json_set_alloc_funcs(arena_malloc, arena_free);
+}
+
+static void arena_enter(void)
+{
+	struct arena *a = &arena;
+
+	if (!a->base) {
+		a->base = arena_chunk_new(ARENA_CHUNK_SIZE);
+		pthread_setspecific(arena_key, a->base);
+	}
+	if (a->base) {
+		a->cur = a->base->data;
+		a->end = a->base->data + a->base->size;
+	}
+	a->active = true;
+}
+
+/* release everything allocated since arena_enter(), keeping the base chunk */
+static void arena_leave(void)
+{
+	struct arena *a = &arena;
+	struct arena_chunk *next, *walk = a->chunks;
+
+	while (walk) {
+		next = walk->next;
+		free(walk);
+		walk = next;
+	}
+	a->chunks = NULL;
+	free(a->sorted);
+	a->sorted = NULL;
+	a->count = a->size = 0;
+	a->cur = a->end = NULL;
+	a->active = false;
+}
+
+/*
+ * A response before it is encoded. It carries either a result, a raw result
+ * or an error code with optional data, the error object itself is never
+ * built.
+ */
+struct response {
+	json_t *id;
+	/* or the id as it was sent, see plain_id() */
+	const char *raw_id;
+	size_t raw_id_len;
+	json_t *result;
+	struct raw_json raw;
+	enum rsp_error err;
+	json_t *data;
+};
+
+/* set the error of a response, consumes data and always returns -1 */
+static int rsp_error(struct jsonrpc_ctx *ctx, struct response *rsp,
+		enum rsp_error err, json_t *data)
+{
+	if (ctx_config(ctx) & JSONRPC_DISABLE_ERROR_TEXT) {
+		json_decref(data);
+		data = NULL;
+	}
+	STATS_ERROR(ctx, err);
+	rsp->err = err;
+	rsp->data = data;
+
+	return -1;
+}
+
+static int rsp_error_str(struct jsonrpc_ctx *ctx, struct response *rsp,
+		enum rsp_error err, const char *str)
+{
+	/* don't bother creating the text if it is dropped anyway */
+	if (ctx_config(ctx) & JSONRPC_DISABLE_ERROR_TEXT) {
+		return rsp_error(ctx, rsp, err, NULL);
+	}
+
+	return rsp_error(ctx, rsp, err, json_string(str));
+}
+
+static void rsp_free(struct response *rsp)
+{
+	json_decref(rsp->id);
+	json_decref(rsp->result);
+	json_decref(rsp->data);
+	if (rsp->raw.free) {
+		rsp->raw.free((void *)rsp->raw.json);
+	}
+	memset(rsp, 0, sizeof(*rsp));
+}
+
+static int decode_request(struct jsonrpc_ctx *ctx, FILE *file,
+		const char *buf, size_t len, json_t **_request, struct response *rsp)
+{
+	json_t *request;
+	json_error_t err;
+	STATS_START(start);
+
+	if (file) {
+		request = jsonrpc_codec_decode_file(file, 0, &err);
+	} else {
+		request = jsonrpc_codec_decode(buf, len, 0, &err);
+	}
+	STATS_PHASE(ctx, PHASE_DECODE, start);
+	if (!request) {
+		return rsp_error_str(ctx, rsp, ERR_PARSE_ERROR, err.text);
+	}
+
+	*_request = request;
+
+	return 0;
+}
+
+/*
+ * Pick the members of the request envelope in a single pass over the keys
+ * instead of looking up every member on its own. Unknown members are
+ * ignored, like json_unpack() does without JSON_STRICT.
+ */
+static int validate_request(struct jsonrpc_ctx *ctx, json_t *req,
+		json_t **_method, json_t **_params, json_t **_id,
+		struct response *rsp)
+{
+	void *iter;
+	json_t *jsonrpc = NULL, *method = NULL, *params = NULL, *id = NULL;
+
+	if (!json_is_object(req)) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"request must be an object");
+	}
+
+	for (iter = json_object_iter(req); iter;
+			iter = json_object_iter_next(req, iter)) {
+		const char *key = json_object_iter_key(iter);
+		json_t *value = json_object_iter_value(iter);
+
+		switch (key[0]) {
+		case 'j':
+			if (!strcmp(key, "jsonrpc")) {
+				jsonrpc = value;
+			}
+			break;
+		case 'm':
+			if (!strcmp(key, "method")) {
+				method = value;
+			}
+			break;
+		case 'p':
+			if (!strcmp(key, "params")) {
+				params = value;
+			}
+			break;
+		case 'i':
+			if (key[1] == 'd' && key[2] == '\0') {
+				id = value;
+			}
+			break;
+		}
+	}
+
+	if (!jsonrpc) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"\"jsonrpc\" is missing");
+	}
+
+	if (!method) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"\"method\" is missing");
+	}
+
+	if (id && !json_is_string(id) && !json_is_number(id) && !json_is_null(id)) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"\"id\" must contain a string, number, or NULL value");
+	}
+
+	if (!json_is_string(jsonrpc) || json_string_length(jsonrpc) != 3 ||
+			memcmp(json_string_value(jsonrpc), "2.0", 3)) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"\"jsonrpc\" must be exactly \"2.0\"");
+	}
+
+	if (!json_is_string(method)) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"\"method\" must be a string");
+	}
+
+	if (params && !json_is_array(params) && !json_is_object(params)) {
+		return rsp_error_str(ctx, rsp, ERR_INVALID_REQUEST,
+				"\"params\" must be a an array or an object");
+	}
+
+	*_id = json_incref(id);
+	*_method = json_incref(method);
+	*_params = json_incref(params);
+
+	return 0;
+}
+
+static void ret_pool_exit(void *priv)
+{
+	struct ret_pool *pool = priv;
+
+	if (!(__atomic_fetch_or(&pool->used, RET_POOL_EXITED, __ATOMIC_ACQ_REL) &
+				~RET_POOL_EXITED)) {
+		free(pool);
+	}
+}
+
+static void ret_pool_install(void)
+{
+	pthread_key_create(&ret_pool_key, ret_pool_exit);
+}
+
+static struct ret_pool *ret_pool_get(void)
+{
+	if (!ret_pool) {
+		pthread_once(&ret_pool_once, ret_pool_install);
+		ret_pool = calloc(1, sizeof(*ret_pool));
+		assert(ret_pool);
+		pthread_setspecific(ret_pool_key, ret_pool);
+	}
+
+	return ret_pool;
+}
+
+static jsonrpc_ret_t ret_get(void)
+{
+	struct ret_pool *pool = ret_pool_get();
+	jsonrpc_ret_t ret;
+	unsigned int avail;
+
+	/* other threads only ever clear bits */
+	avail = ~__atomic_load_n(&pool->used, __ATOMIC_ACQUIRE) &
+			((1u << RET_POOL_SIZE) - 1);
+	if (avail) {
+		int slot = __builtin_ctz(avail);
+		__atomic_fetch_or(&pool->used, 1u << slot, __ATOMIC_RELAXED);
+		ret = &pool->rets[slot];
+		ret->pool = pool;
+	} else {
+		ret = malloc(sizeof(*ret));
+		assert(ret);
+		ret->pool = NULL;
+	}
+
+	return ret;
+}
+
+static void ret_put(jsonrpc_ret_t ret)
+{
+	struct ret_pool *pool = ret->pool;
+	unsigned int bit;
+
+	if (!pool) {
+		free(ret);
+		return;
+	}
+
+	bit = 1u << (ret - pool->rets);
+	if ((__atomic_fetch_and(&pool->used, ~bit, __ATOMIC_ACQ_REL) & ~bit) ==
+			RET_POOL_EXITED) {
+		free(pool);
+	}
+}
+
+static jsonrpc_ret_t _jsonrpc_error(enum rsp_error err, json_t *data)
+{
+	jsonrpc_ret_t ret;
+
+	/* the error object is built by the dispatcher, which knows the context */
+	ret = ret_get();
+	ret->type = JSONRPC_ERROR;
+	ret->err = err;
+	ret->obj = data;
+	return ret;
+}
+
+/*
+ * Move an object to the regular allocator if the calling thread is inside
+ * of an arena scope, so it can be handed to another request.
+ */
+static json_t *arena_escape(json_t *obj)
+{
+	json_t *copy;
+
+	if (!arena.active || !obj) {
+		return obj;
+	}
+
+	arena.active = false;
+	copy = json_deep_copy(obj);
+	arena.active = true;
+	json_decref(obj);
+
+	return copy;
+}
+
+/*
+ * Handle used when an asynchronous method is called from a synchronous
+ * request. The calling thread waits until the method has completed.
+ */
+struct async_waiter {
+	struct jsonrpc_async handle;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool completed;
+	bool has_ret;
+	struct jsonrpc_ret ret;
+};
+
+static void waiter_complete(struct async_waiter *waiter, jsonrpc_ret_t ret)
+{
+	pthread_mutex_lock(&waiter->lock);
+	if (ret) {
+		waiter->has_ret = true;
+		waiter->ret.type = ret->type;
+		waiter->ret.err = ret->err;
+		waiter->ret.obj = arena_escape(ret->obj);
+		waiter->ret.raw = ret->raw;
+		ret_put(ret);
+	}
+	waiter->completed = true;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->lock);
+}
+
+static jsonrpc_ret_t call_async(rpc_async_callback cb, json_t *params)
+{
+	jsonrpc_ret_t ret = NULL;
+	struct async_waiter waiter = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	cb(params, &waiter.handle);
+
+	pthread_mutex_lock(&waiter.lock);
+	while (!waiter.completed) {
+		pthread_cond_wait(&waiter.cond, &waiter.lock);
+	}
+	pthread_mutex_unlock(&waiter.lock);
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.lock);
+
+	if (waiter.has_ret) {
+		ret = ret_get();
+		ret->type = waiter.ret.type;
+		ret->err = waiter.ret.err;
+		ret->obj = waiter.ret.obj;
+		ret->raw = waiter.ret.raw;
+	}
+
+	return ret;
+}
+
+/* growing, NUL-terminated output string */
+struct strbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int strbuf_write(const char *data, size_t len, void *priv)
+{
+	struct strbuf *out = priv;
+
+	if (out->len + len + 1 > out->size) {
+		size_t size = out->size ? out->size : 256;
+		char *buf;
+
+		while (out->len + len + 1 > size) {
+			size *= 2;
+		}
+		buf = realloc(out->buf, size);
+		if (!buf) {
+			return -1;
+		}
+		out->buf = buf;
+		out->size = size;
+	}
+
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+	out->buf[out->len] = '\0';
+
+	return 0;
+}
+
+/* caller-provided buffer, len keeps counting past its end */
+struct fixedbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int fixedbuf_write(const char *data, size_t len, void *priv)
+{
+	struct fixedbuf *out = priv;
+
+	if (out->len <= out->size && len <= out->size - out->len) {
+		memcpy(out->buf + out->len, data, len);
+	}
+	out->len += len;
+
+	return 0;
+}
+
+/*
+ * Output as a list of buffers for writev(). What is written through the
+ * callback is copied into one buffer, raw results are only referenced. They
+ * are freed together with the list.
+ */
+struct iov_piece {
+	/* NULL if the piece is at off in the copy buffer */
+	const char *ref;
+	size_t off;
+	size_t len;
+};
+
+struct jsonrpc_iov {
+	struct strbuf copy;
+	struct iov_piece *pieces;
+	size_t count;
+	size_t size;
+	struct raw_json *raws;
+	size_t raw_count;
+	struct iovec *iov;
+};
+
+static struct iov_piece *iov_piece_new(struct jsonrpc_iov *iov)
+{
+	if (iov->count == iov->size) {
+		size_t size = iov->size ? iov->size * 2 : 8;
+		struct iov_piece *pieces;
+
+		pieces = realloc(iov->pieces, size * sizeof(*pieces));
+		if (!pieces) {
+			return NULL;
+		}
+		iov->pieces = pieces;
+		iov->size = size;
+	}
+
+	return &iov->pieces[iov->count++];
+}
+
+static int iov_write(const char *data, size_t len, void *priv)
+{
+	struct jsonrpc_iov *iov = priv;
+	struct iov_piece *last = iov->count ? &iov->pieces[iov->count - 1] : NULL;
+	size_t off = iov->copy.len;
+
+	if (strbuf_write(data, len, &iov->copy)) {
+		return -1;
+	}
+
+	/* consecutive copies end up in a single piece */
+	if (last && !last->ref) {
+		last->len += len;
+		return 0;
+	}
+
+	last = iov_piece_new(iov);
+	if (!last) {
+		return -1;
+	}
+	last->ref = NULL;
+	last->off = off;
+	last->len = len;
+
+	return 0;
+}
+
+/* takes over the raw result */
+static int iov_ref(struct jsonrpc_iov *iov, const struct raw_json *raw)
+{
+	struct iov_piece *piece;
+	struct raw_json *raws;
+
+	raws = realloc(iov->raws, (iov->raw_count + 1) * sizeof(*raws));
+	if (!raws) {
+		return -1;
+	}
+	iov->raws = raws;
+
+	piece = iov_piece_new(iov);
+	if (!piece) {
+		return -1;
+	}
+	piece->ref = raw->json;
+	piece->len = raw->len;
+	iov->raws[iov->raw_count++] = *raw;
+
+	return 0;
+}
+
+static int iov_finish(struct jsonrpc_iov *iov)
+{
+	size_t i;
+
+	iov->iov = calloc(iov->count, sizeof(*iov->iov));
+	if (!iov->iov) {
+		return -1;
+	}
+
+	for (i = 0; i < iov->count; i++) {
+		struct iov_piece *piece = &iov->pieces[i];
+
+		iov->iov[i].iov_base = (void *)(piece->ref ? piece->ref :
+				iov->copy.buf + piece->off);
+		iov->iov[i].iov_len = piece->len;
+	}
+
+	return 0;
+}
+
+/* the outcome of the handler rc, the iov is dropped unless it has a response */
+static int iov_done(jsonrpc_iov_t **iov, int rc)
+{
+	if (!rc && (*iov)->count) {
+		rc = iov_finish(*iov);
+		if (!rc) {
+			return 0;
+		}
+	}
+
+	jsonrpc_iov_free(*iov);
+	*iov = NULL;
+
+	return rc ? -1 : 0;
+}
+
+void jsonrpc_iov_free(jsonrpc_iov_t *iov)
+{
+	size_t i;
+
+	if (!iov) {
+		return;
+	}
+
+	for (i = 0; i < iov->raw_count; i++) {
+		if (iov->raws[i].free) {
+			iov->raws[i].free((void *)iov->raws[i].json);
+		}
+	}
+	free(iov->raws);
+	free(iov->copy.buf);
+	free(iov->pieces);
+	free(iov->iov);
+	free(iov);
+}
+
+const struct iovec *jsonrpc_iov_get(jsonrpc_iov_t *iov, int *count)
+{
+	*count = iov->count;
+
+	return iov->iov;
+}
+
+/*
+ * Params of lazy methods. One of the raw bytes and the decoded value is
+ * there from the start, the other one is made on demand.
+ */
+struct jsonrpc_params {
+	const char *raw;
+	size_t len;
+	json_t *json;
+	bool decoded;
+	bool owned;
+	char *encoded;
+};
+
+json_t *jsonrpc_params_get(jsonrpc_params_t params)
+{
+	json_error_t err;
+
+	if (!params->decoded) {
+		params->decoded = true;
+		params->json = jsonrpc_codec_decode(params->raw, params->len, 0, &err);
+		params->owned = true;
+	}
+
+	return params->json;
+}
+
+const char *jsonrpc_params_raw(jsonrpc_params_t params, size_t *len)
+{
+	struct strbuf out = { NULL, 0, 0 };
+
+	if (!params->raw && params->json) {
+		if (jsonrpc_codec_encode(params->json, strbuf_write, &out,
+					JSON_PRESERVE_ORDER)) {
+			free(out.buf);
+			return NULL;
+		}
+		params->encoded = out.buf;
+		params->raw = out.buf;
+		params->len = out.len;
+	}
+	*len = params->len;
+
+	return params->raw;
+}
+
+/*
+ * Hooks are picked once per call, so the pre and post hook of a sampled
+ * call both run. The tick is per thread to keep sampling free of shared
+ * writes.
+ */
+static __thread unsigned int hook_tick;
+
+static unsigned int hooks_sample(const struct jsonrpc_ctx *ctx)
+{
+	unsigned int i, tick = hook_tick++, sampled = 0;
+
+	for (i = 0; i < ctx->nhooks; i++) {
+		unsigned int sample = ctx->hooks[i].sample;
+
+		if (sample <= 1 || !(tick % sample)) {
+			sampled |= 1u << i;
+		}
+	}
+
+	return sampled;
+}
+
+/* returns the return value of the first pre hook which has one */
+static jsonrpc_ret_t hooks_pre(const struct jsonrpc_ctx *ctx,
+		unsigned int sampled, struct rpc_callback *walk, json_t *id,
+		struct jsonrpc_params *params)
+{
+	const struct jsonrpc_hook *hook;
+	jsonrpc_ret_t ret;
+	unsigned int i;
+
+	for (i = 0; i < ctx->nhooks; i++) {
+		hook = &ctx->hooks[i];
+		if ((sampled & (1u << i)) && hook->pre) {
+			ret = hook->pre(walk->name, id, params, hook->priv);
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void hooks_post(const struct jsonrpc_ctx *ctx, unsigned int sampled,
+		struct rpc_callback *walk, json_t *id, struct jsonrpc_params *params,
+		jsonrpc_ret_t ret)
+{
+	const struct jsonrpc_hook *hook;
+	unsigned int i;
+
+	for (i = ctx->nhooks; i--; ) {
+		hook = &ctx->hooks[i];
+		if ((sampled & (1u << i)) && hook->post) {
+			hook->post(walk->name, id, params, ret, hook->priv);
+		}
+	}
+}
+
+static int encode_value(struct jsonrpc_ctx *ctx, json_t *value,
+		jsonrpc_write_t write, void *priv);
+
+/*
+ * Waiting calls of a single-flight method get the outcome of the running
+ * one. Errors are shared as well, with their data decoded again.
+ */
+static jsonrpc_ret_t flight_ret(const char *shared, size_t len, int code)
+{
+	json_t *data = NULL;
+
+	if (!code) {
+		return jsonrpc_result_raw(shared, len, jsonrpc_flight_release);
+	}
+	if (len) {
+		data = jsonrpc_codec_decode(shared, len, JSON_DECODE_ANY, NULL);
+	}
+	jsonrpc_flight_release((void *)shared);
+
+	return _jsonrpc_error(code, data);
+}
+
+/*
+ * Passes the outcome of the running call to the waiting ones. A result
+ * which has to be encoded for them is handed out encoded to the caller,
+ * too.
+ */
+static void flight_end(struct jsonrpc_ctx *ctx, struct rpc_callback *walk,
+		struct jsonrpc_flight_call *call, jsonrpc_ret_t ret)
+{
+	struct strbuf value = { NULL, 0, 0 };
+	const char *shared = NULL;
+
+	if (!ret) {
+		shared = jsonrpc_flight_end(walk->flight, call, "", 0,
+				ERR_INTERNAL_ERROR);
+	} else if (ret->type == JSONRPC_RESULT_RAW) {
+		shared = jsonrpc_flight_end(walk->flight, call, ret->raw.json,
+				ret->raw.len, 0);
+	} else if (ret->type == JSONRPC_ERROR && !ret->obj) {
+		shared = jsonrpc_flight_end(walk->flight, call, "", 0, ret->err);
+	} else if (!encode_value(ctx, ret->obj, strbuf_write, &value)) {
+		shared = jsonrpc_flight_end(walk->flight, call, value.buf,
+				value.len, ret->type == JSONRPC_ERROR ? ret->err : 0);
+		if (shared && ret->type == JSONRPC_RESULT) {
+			json_decref(ret->obj);
+			ret->obj = NULL;
+			ret->type = JSONRPC_RESULT_RAW;
+			ret->raw.json = shared;
+			ret->raw.len = value.len;
+			ret->raw.free = jsonrpc_flight_release;
+			shared = NULL;
+		}
+	} else {
+		jsonrpc_flight_end(walk->flight, call, NULL, 0, 0);
+	}
+	if (shared) {
+		jsonrpc_flight_release((void *)shared);
+	}
+	free(value.buf);
+}
+
+/*
+ * Cached methods are answered from the encoded results of earlier calls
+ * with the same params, which skips both the method and the encoder, and
+ * single-flight methods from the running call with the same params. Keys
+ * are sorted and compact, so equal params make equal keys.
+ */
+static jsonrpc_ret_t call_keyed(struct jsonrpc_ctx *ctx,
+		struct rpc_callback *walk, json_t *params)
+{
+	char buf[256];
+	struct fixedbuf fixed = { buf, 0, sizeof(buf) };
+	struct strbuf key = { NULL, 0, 0 }, value = { NULL, 0, 0 };
+	struct jsonrpc_flight_call *call = NULL;
+	const char *key_buf = "", *cached;
+	size_t key_len = 0, len;
+	size_t flags = JSON_COMPACT | JSON_SORT_KEYS;
+	jsonrpc_ret_t ret;
+	int code;
+
+	if (params) {
+		jsonrpc_codec_encode(params, fixedbuf_write, &fixed, flags);
+		if (fixed.len <= fixed.size) {
+			key_buf = buf;
+			key_len = fixed.len;
+		} else if (!jsonrpc_codec_encode(params, strbuf_write, &key, flags)) {
+			key_buf = key.buf;
+			key_len = key.len;
+		} else {
+			free(key.buf);
+			return walk->cb(params);
+		}
+	}
+
+	if (walk->cache) {
+		cached = jsonrpc_cache_get(walk->cache, key_buf, key_len, &len);
+		if (cached) {
+			free(key.buf);
+			return jsonrpc_result_raw(cached, len, jsonrpc_cache_release);
+		}
+	}
+
+	if (walk->flight) {
+		call = jsonrpc_flight_begin(walk->flight, key_buf, key_len,
+				&cached, &len, &code);
+		if (cached) {
+			free(key.buf);
+			return flight_ret(cached, len, code);
+		}
+	}
+
+	/* errors are not cached */
+	ret = walk->cb(params);
+	if (walk->cache && ret && ret->type == JSONRPC_RESULT &&
+			!encode_value(ctx, ret->obj, strbuf_write, &value)) {
+		cached = jsonrpc_cache_set(walk->cache, key_buf, key_len, value.buf,
+				value.len);
+		if (cached) {
+			json_decref(ret->obj);
+			ret->obj = NULL;
+			ret->type = JSONRPC_RESULT_RAW;
+			ret->raw.json = cached;
+			ret->raw.len = value.len;
+			ret->raw.free = jsonrpc_cache_release;
+		}
+	}
+	if (call) {
+		flight_end(ctx, walk, call, ret);
+	}
+	free(value.buf);
+	free(key.buf);
+
+	return ret;
+}
+
+static jsonrpc_ret_t invoke_method(struct jsonrpc_ctx *ctx,
+		struct rpc_callback *walk, struct jsonrpc_params *params)
+{
+	if (walk->cache || walk->flight) {
+		return call_keyed(ctx, walk, params->json);
+	} else if (walk->lazy) {
+		return walk->lazy(params);
+	} else if (walk->async) {
+		return call_async(walk->async, params->json);
+	}
+
+	return walk->cb(params->json);
+}
+
+/*
+ * Methods with a max_concurrent reject calls beyond it instead of queueing
+ * them. The counter is only touched for these methods.
+ */
+static bool method_enter(struct rpc_callback *walk)
+{
+	if (!walk->max_concurrent) {
+		return true;
+	}
+	if (__atomic_add_fetch(&walk->active, 1, __ATOMIC_ACQUIRE) <=
+			walk->max_concurrent) {
+		return true;
+	}
+	__atomic_sub_fetch(&walk->active, 1, __ATOMIC_RELEASE);
+
+	return false;
+}
+
+static void method_leave(struct rpc_callback *walk)
+{
+	if (walk->max_concurrent) {
+		__atomic_sub_fetch(&walk->active, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Params are either decoded, or only raw for lazy methods. Both may be
+ * given, the raw bytes are then handed out as they are.
+ */
+static jsonrpc_ret_t call_method(struct jsonrpc_ctx *ctx,
+		struct rpc_callback *walk, json_t *id, const char *raw, size_t len,
+		json_t *json)
+{
+	struct jsonrpc_params params = {
+		.raw = raw,
+		.len = len,
+		.json = json,
+		.decoded = json || !raw,
+	};
+	unsigned int sampled = 0;
+	jsonrpc_ret_t ret = NULL;
+
+	if (!method_enter(walk)) {
+		return _jsonrpc_error(ERR_SERVER_BUSY, NULL);
+	}
+	if (ctx->nhooks) {
+		sampled = hooks_sample(ctx);
+	}
+	if (sampled) {
+		ret = hooks_pre(ctx, sampled, walk, id, &params);
+	}
+	if (!ret) {
+		ret = invoke_method(ctx, walk, &params);
+	}
+	if (sampled) {
+		hooks_post(ctx, sampled, walk, id, &params, ret);
+	}
+
+	method_leave(walk);
+
+	if (params.owned) {
+		json_decref(params.json);
+	}
+	free(params.encoded);
+
+	return ret;
+}
+
+/* turn the return value of a callback into either a result or an error */
+static int consume_ret(struct jsonrpc_ctx *ctx, jsonrpc_ret_t ret,
+		struct response *rsp)
+{
+	json_t *obj;
+	enum rsp_error err;
+
+	if (!ret) {
+		return rsp_error(ctx, rsp, ERR_INTERNAL_ERROR, NULL);
+	}
+
+	obj = ret->obj;
+	err = ret->err;
+	if (ret->type == JSONRPC_RESULT) {
+		ret_put(ret);
+		rsp->result = obj;
+		return 0;
+	} else if (ret->type == JSONRPC_RESULT_RAW) {
+		rsp->raw = ret->raw;
+		ret_put(ret);
+		return 0;
+	} else if (ret->type == JSONRPC_ERROR) {
+		ret_put(ret);
+		return rsp_error(ctx, rsp, err, obj);
+	}
+	ret_put(ret);
+
+	return rsp_error(ctx, rsp, ERR_INTERNAL_ERROR, NULL);
+}
+
+/* unknown methods, including the built-in rpc.stats */
+static int method_not_found(struct jsonrpc_ctx *ctx, const char *method,
+		size_t len, struct response *rsp)
+{
+#ifdef JSONRPC_STATS
+	if ((ctx_config(ctx) & JSONRPC_STATS_METHOD) && len == 9 &&
+			!memcmp(method, "rpc.stats", 9)) {
+		rsp->result = stats_snapshot(ctx);
+		if (!rsp->result) {
+			return rsp_error(ctx, rsp, ERR_INTERNAL_ERROR, NULL);
+		}
+		return 0;
+	}
+#endif
+
+	return rsp_error(ctx, rsp, ERR_METHOD_NOT_FOUND, NULL);
+}
+
+static int dispatch_request(struct jsonrpc_ctx *ctx, const char* method,
+		size_t len, json_t *params, json_t *id, struct response *rsp)
+{
+	jsonrpc_ret_t ret;
+	struct rpc_callback *walk;
+	int rc;
+
+	/* find callback */
+	walk = find_callback(&ctx->registry, method, len);
+	if (!walk) {
+		return method_not_found(ctx, method, len, rsp);
+	}
+
+	/* call callback */
+	STATS_START(start);
+	ret = call_method(ctx, walk, id, NULL, 0, params);
+	rc = consume_ret(ctx, ret, rsp);
+	STATS_CALL(ctx, walk, start, rsp->err);
+
+	return rc;
+}
+
+/*
+ * The constant parts of a response are kept preserialized, so only the
+ * result, the error data and the id go through the encoder. The separators
+ * are the same jansson uses without JSON_COMPACT.
+ */
+struct fragment {
+	const char *str;
+	size_t len;
+};
+
+#define FRAGMENT(s) { s, sizeof(s) - 1 }
+#define ERROR_FRAGMENTS(code, message) { \
+	FRAGMENT("\"error\": {\"code\": " #code ", \"message\": \"" message "\"}"), \
+	FRAGMENT("\"error\": {\"code\": " #code ", \"message\": \"" message \
+			"\", \"data\": "), \
+	code, FRAGMENT(message), \
+}
+
+static const struct fragment rsp_prefix = FRAGMENT("{\"jsonrpc\": \"2.0\", ");
+static const struct fragment rsp_result = FRAGMENT("\"result\": ");
+static const struct fragment rsp_id = FRAGMENT(", \"id\": ");
+
+static const struct {
+	/* the complete error member, and the one up to its data value */
+	struct fragment error;
+	struct fragment error_data;
+	/* the values on their own, for MessagePack */
+	int code;
+	struct fragment message;
+} error_fragments[] = {
+	[ERR_PARSE_ERROR] = ERROR_FRAGMENTS(-32700, "Parse error"),
+	[ERR_INVALID_REQUEST] = ERROR_FRAGMENTS(-32600, "Invalid Request"),
+	[ERR_METHOD_NOT_FOUND] = ERROR_FRAGMENTS(-32601, "Method not found"),
+	[ERR_INVALID_PARAMS] = ERROR_FRAGMENTS(-32602, "Invalid params"),
+	[ERR_INTERNAL_ERROR] = ERROR_FRAGMENTS(-32603, "Internal error"),
+	[ERR_SERVER_BUSY] = ERROR_FRAGMENTS(-32000, "Server busy"),
+	[ERR_TOO_LARGE] = ERROR_FRAGMENTS(-32001, "Request too large"),
+};
+
+/* whole responses for requests which are rejected before they are parsed */
+#define REJECTION(code, message) FRAGMENT("{\"jsonrpc\": \"2.0\", " \
+	"\"error\": {\"code\": " #code ", \"message\": \"" message "\"}, " \
+	"\"id\": null}")
+
+static const struct fragment rejections[] = {
+	[ERR_SERVER_BUSY] = REJECTION(-32000, "Server busy"),
+	[ERR_TOO_LARGE] = REJECTION(-32001, "Request too large"),
+};
+
+static int write_fragment(const struct fragment *fragment,
+		jsonrpc_write_t write, void *priv)
+{
+	return write(fragment->str, fragment->len, priv);
+}
+
+static int encode_value(struct jsonrpc_ctx *ctx, json_t *value,
+		jsonrpc_write_t write, void *priv)
+{
+	size_t flags = JSON_ENCODE_ANY;
+
+	if (ctx_config(ctx) & JSONRPC_ORDERED_RESPONSE) {
+		flags |= JSON_PRESERVE_ORDER;
+	}
+
+	return jsonrpc_codec_encode(value, write, priv, flags);
+}
+
+static int encode_id(struct jsonrpc_ctx *ctx, json_t *id,
+		jsonrpc_write_t write, void *priv)
+{
+	char buf[32];
+	int len;
+
+	/* the usual ids don't need the encoder */
+	if (json_is_null(id)) {
+		return write("null", 4, priv);
+	}
+	if (json_is_integer(id)) {
+		len = snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT,
+				json_integer_value(id));
+		return write(buf, len, priv);
+	}
+
+	return encode_value(ctx, id, write, priv);
+}
+
+/* raw results are referenced instead of copied if the output allows it */
+static int encode_raw(struct response *rsp, jsonrpc_write_t write, void *priv)
+{
+	if (write == iov_write) {
+		if (iov_ref(priv, &rsp->raw)) {
+			return -1;
+		}
+		rsp->raw.free = NULL;
+		return 0;
+	}
+
+	return write(rsp->raw.json, rsp->raw.len, priv);
+}
+
+static int _encode_response_cb(struct jsonrpc_ctx *ctx, struct response *rsp,
+		jsonrpc_write_t write, void *priv)
+{
+	bool result = rsp->result || rsp->raw.json;
+
+	assert((!result && rsp->err != ERR_NO_ERR) ||
+			(result && rsp->err == ERR_NO_ERR));
+	assert(rsp->id || rsp->raw_id);
+
+	if (write_fragment(&rsp_prefix, write, priv)) {
+		return -1;
+	}
+
+	if (rsp->result) {
+		if (write_fragment(&rsp_result, write, priv) ||
+				encode_value(ctx, rsp->result, write, priv)) {
+			return -1;
+		}
+	} else if (rsp->raw.json) {
+		if (write_fragment(&rsp_result, write, priv) ||
+				encode_raw(rsp, write, priv)) {
+			return -1;
+		}
+	} else if (rsp->data) {
+		if (write_fragment(&error_fragments[rsp->err].error_data, write, priv) ||
+				encode_value(ctx, rsp->data, write, priv) ||
+				write("}", 1, priv)) {
+			return -1;
+		}
+	} else {
+		if (write_fragment(&error_fragments[rsp->err].error, write, priv)) {
+			return -1;
+		}
+	}
+
+	if (write_fragment(&rsp_id, write, priv) ||
+			(rsp->raw_id ? write(rsp->raw_id, rsp->raw_id_len, priv) :
+			 encode_id(ctx, rsp->id, write, priv)) ||
+			write("}", 1, priv)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int encode_response_cb(struct jsonrpc_ctx *ctx, struct response *rsp,
+		jsonrpc_write_t write, void *priv)
+{
+	int ret;
+	STATS_START(start);
+
+	ret = _encode_response_cb(ctx, rsp, write, priv);
+	STATS_PHASE(ctx, PHASE_ENCODE, start);
+
+	return ret;
+}
+
+/*
+ * Batch responses are written as the members complete, with the brackets
+ * and separators in between. Members without a response, i.e.
+ * notifications, don't show up at all.
+ */
+struct batch_writer {
+	jsonrpc_write_t write;
+	void *priv;
+	bool started;
+};
+
+static int batch_next(struct batch_writer *out)
+{
+	bool started = out->started;
+
+	out->started = true;
+
+	return out->write(started ? ", " : "[", started ? 2 : 1, out->priv);
+}
+
+static int batch_finish(struct batch_writer *out)
+{
+	if (!out->started) {
+		return 0;
+	}
+
+	return out->write("]", 1, out->priv);
+}
+
+/*
+ * The returned string is freed by the caller. It is built with the regular
+ * allocator, so it never ends up in the arena.
+ */
+static char *encode_response(struct jsonrpc_ctx *ctx, struct response *rsp)
+{
+	struct strbuf out = { NULL, 0, 0 };
+
+	if (encode_response_cb(ctx, rsp, strbuf_write, &out)) {
+		free(out.buf);
+		return NULL;
+	}
+
+	return out.buf;
+}
+
+/* returns false for notifications, which don't get a response */
+static bool _jsonrpc_handle_single_request(struct jsonrpc_ctx *ctx,
+		json_t *request, struct response *rsp)
+{
+	json_t *method = NULL, *params = NULL, *id = NULL;
+	int invalid;
+	STATS_START(start);
+
+	invalid = validate_request(ctx, request, &method, &params, &id, rsp);
+	STATS_PHASE(ctx, PHASE_VALIDATE, start);
+	if (invalid) {
+		/* if there was an parse error or an invalid request error, the id must
+		 * be set to null */
+		rsp->id = json_null();
+		return true;
+	}
+
+	dispatch_request(ctx, json_string_value(method),
+			json_string_length(method), params, id, rsp);
+	json_decref(method);
+	json_decref(params);
+
+	if (!id) {
+		/* this is a notification, no response is sent */
+		rsp_free(rsp);
+		return false;
+	}
+	rsp->id = id;
+
+	return true;
+}
+
+/*
+ * Members of a parallel batch are encoded by the task which handled them.
+ * Their order is restored when the encoded members are written out.
+ */
+struct batch {
+	struct jsonrpc_ctx *ctx;
+	json_t *requests;
+	struct strbuf *responses;
+	bool failed;
+};
+
+static void batch_task(void *arg, size_t index)
+{
+	struct batch *batch = arg;
+	json_t *request = json_array_get(batch->requests, index);
+	struct strbuf *out = &batch->responses[index];
+	struct response rsp = { NULL };
+	bool arena_active = arena.active;
+
+	/*
+	 * The executor may run this on a thread which handles a request of
+	 * its own. Keep the response out of that thread's arena.
+	 */
+	arena.active = false;
+	if (_jsonrpc_handle_single_request(batch->ctx, request, &rsp)) {
+		if (encode_response_cb(batch->ctx, &rsp, strbuf_write, out)) {
+			__atomic_store_n(&batch->failed, true, __ATOMIC_RELAXED);
+		}
+		rsp_free(&rsp);
+	}
+	arena.active = arena_active;
+}
+
+static int handle_parallel(struct jsonrpc_ctx *ctx, json_t *requests,
+		struct batch_writer *out)
+{
+	size_t i, count = json_array_size(requests);
+	struct batch batch = {
+		.ctx = ctx,
+		.requests = requests,
+	};
+	int ret = 0;
+
+	batch.responses = calloc(count, sizeof(*batch.responses));
+	if (!batch.responses) {
+		return -1;
+	}
+
+	ctx->executor(ctx->executor_priv, batch_task, &batch, count);
+
+	if (batch.failed) {
+		ret = -1;
+	}
+	for (i = 0; i < count; i++) {
+		struct strbuf *rsp = &batch.responses[i];
+
+		if (!ret && rsp->len) {
+			ret = batch_next(out) || out->write(rsp->buf, rsp->len, out->priv);
+		}
+		free(rsp->buf);
+	}
+	free(batch.responses);
+
+	return ret ? -1 : 0;
+}
+
+static int _jsonrpc_handle_multiple_requests(struct jsonrpc_ctx *ctx,
+		json_t *requests, jsonrpc_write_t write, void *priv)
+{
+	size_t i, count = json_array_size(requests);
+	struct batch_writer out = {
+		.write = write,
+		.priv = priv,
+	};
+	struct response rsp = { NULL };
+	int ret = 0;
+
+	if ((ctx_config(ctx) & JSONRPC_PARALLEL_BATCH) && ctx->executor &&
+			count > 1) {
+		ret = handle_parallel(ctx, requests, &out);
+	} else {
+		/* only one member response exists at any time */
+		for (i = 0; i < count && !ret; i++) {
+			if (_jsonrpc_handle_single_request(ctx,
+						json_array_get(requests, i), &rsp)) {
+				ret = batch_next(&out) ||
+					encode_response_cb(ctx, &rsp, write, priv);
+				rsp_free(&rsp);
+			}
+		}
+	}
+
+	if (ret) {
+		return -1;
+	}
+
+	return batch_finish(&out);
+}
+
+/*
+ * Contexts are sealed by their first request. The default context only if it
+ * uses the linker section, so that methods can still be registered at
+ * runtime.
+ */
+static void ctx_prepare(struct jsonrpc_ctx *ctx)
+{
+	if (!ctx_sealed(ctx) && (ctx != &default_ctx || section_count())) {
+		ctx_seal(ctx);
+	}
+}
+
+/*
+ * Scanning of raw requests, without decoding them. It is stricter than the
+ * decoder where the two could disagree: strings with invalid UTF-8 or
+ * \u0000, and numbers which might not fit, fail the scan.
+ */
+#define STREAM_MAX_DEPTH 2048
+
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		p++;
+	}
+
+	return p;
+}
+
+static const char *skip_digits(const char *p, const char *end)
+{
+	while (p < end && *p >= '0' && *p <= '9') {
+		p++;
+	}
+
+	return p;
+}
+
+/* p points past the opening quote */
+static const char *skip_string(const char *p, const char *end)
+{
+	int i;
+
+	while (p < end) {
+		unsigned char c = *p++;
+
+		if (c == '"') {
+			return p;
+		} else if (c < 0x20) {
+			return NULL;
+		} else if (c >= 0x80) {
+			size_t n = jsonrpc_utf8_check((const unsigned char *)p - 1,
+					(const unsigned char *)end);
+			if (!n) {
+				return NULL;
+			}
+			p += n - 1;
+			continue;
+		} else if (c != '\\') {
+			continue;
+		}
+
+		if (p == end) {
+			return NULL;
+		}
+		c = *p++;
+		if (c == 'u') {
+			for (i = 0; i < 4; i++, p++) {
+				if (p == end || !*p || !strchr("0123456789abcdefABCDEF", *p)) {
+					return NULL;
+				}
+			}
+			if (!memcmp(p - 4, "0000", 4)) {
+				return NULL;
+			}
+		} else if (!c || !strchr("\"\\/bfnrt", c)) {
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static const char *skip_number(const char *p, const char *end)
+{
+	const char *digits;
+
+	if (p < end && *p == '-') {
+		p++;
+	}
+	if (p < end && *p == '0') {
+		p++;
+	} else {
+		digits = p;
+		p = skip_digits(p, end);
+		if (p == digits || p - digits > 18) {
+			return NULL;
+		}
+	}
+	if (p < end && *p == '.') {
+		digits = ++p;
+		p = skip_digits(p, end);
+		if (p == digits) {
+			return NULL;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		digits = p;
+		p = skip_digits(p, end);
+		if (p == digits || p - digits > 2) {
+			return NULL;
+		}
+	}
+
+	return p;
+}
+
+static const char *skip_literal(const char *p, const char *end,
+		const char *literal)
+{
+	size_t len = strlen(literal);
+
+	if ((size_t)(end - p) < len || memcmp(p, literal, len)) {
+		return NULL;
+	}
+
+	return p + len;
+}
+
+/* returns the end of the value starting at p, or NULL if it is malformed */
+static const char *skip_value(const char *p, const char *end, int depth)
+{
+	char close;
+
+	if (p == end || depth > STREAM_MAX_DEPTH) {
+		return NULL;
+	}
+
+	switch (*p) {
+	case '"':
+		return skip_string(p + 1, end);
+	case 't':
+		return skip_literal(p, end, "true");
+	case 'f':
+		return skip_literal(p, end, "false");
+	case 'n':
+		return skip_literal(p, end, "null");
+	case '{':
+	case '[':
+		close = (*p == '{') ? '}' : ']';
+		p = skip_ws(p + 1, end);
+		if (p < end && *p == close) {
+			return p + 1;
+		}
+		for (;;) {
+			if (close == '}') {
+				if (p == end || *p != '"') {
+					return NULL;
+				}
+				p = skip_string(p + 1, end);
+				if (!p) {
+					return NULL;
+				}
+				p = skip_ws(p, end);
+				if (p == end || *p != ':') {
+					return NULL;
+				}
+				p = skip_ws(p + 1, end);
+			}
+			p = skip_value(p, end, depth + 1);
+			if (!p) {
+				return NULL;
+			}
+			p = skip_ws(p, end);
+			if (p < end && *p == close) {
+				return p + 1;
+			}
+			if (p == end || *p != ',') {
+				return NULL;
+			}
+			p = skip_ws(p + 1, end);
+		}
+	default:
+		return skip_number(p, end);
+	}
+}
+
+/*
+ * Streamed batches. The raw input is checked for well-formedness first,
+ * which only needs a scan over the bytes. Then the members are parsed,
+ * handled and freed one at a time, so the whole batch never exists as a
+ * tree. Input which fails the scan takes the regular path, so malformed and
+ * empty batches get the same errors as before.
+ */
+
+/*
+ * Returns the number of members if buf holds a well-formed batch with at
+ * least one member, 0 otherwise.
+ */
+static size_t stream_batch_check(const char *buf, size_t len)
+{
+	const char *p = skip_ws(buf, buf + len), *end = buf + len;
+	size_t count = 0;
+
+	if (p == end || *p != '[') {
+		return 0;
+	}
+	do {
+		p = skip_value(skip_ws(p + 1, end), end, 1);
+		if (!p) {
+			return 0;
+		}
+		p = skip_ws(p, end);
+		count++;
+	} while (p < end && *p == ',');
+
+	if (p == end || *p != ']' || skip_ws(p + 1, end) != end) {
+		return 0;
+	}
+
+	return count;
+}
+
+/*
+ * Single requests are first handled from their raw bytes. The envelope is
+ * scanned for the members, and the params are only decoded once the method
+ * is known to exist, and not at all for lazy methods. Anything unusual,
+ * including every invalid request, takes the regular path, which reports
+ * the errors.
+ */
+struct envelope {
+	/* the method name without quotes, and the raw params and id values */
+	const char *method;
+	size_t method_len;
+	const char *params;
+	size_t params_len;
+	const char *id;
+	size_t id_len;
+};
+
+static bool envelope_member(const char *key, size_t key_len, const char *name,
+		const char **span)
+{
+	if (key_len != strlen(name) || memcmp(key, name, key_len)) {
+		return false;
+	}
+
+	/* duplicates are left to the decoder */
+	return !*span;
+}
+
+static bool scan_envelope(const char *p, const char *end, struct envelope *env)
+{
+	const char *key, *value, *jsonrpc = NULL;
+	size_t key_len, jsonrpc_len = 0;
+
+	memset(env, 0, sizeof(*env));
+
+	p = skip_ws(p, end);
+	if (p == end || *p != '{') {
+		return false;
+	}
+	p = skip_ws(p + 1, end);
+
+	for (;;) {
+		if (p == end || *p != '"') {
+			return false;
+		}
+		key = p + 1;
+		p = skip_string(key, end);
+		if (!p) {
+			return false;
+		}
+		key_len = p - 1 - key;
+		p = skip_ws(p, end);
+		if (p == end || *p != ':') {
+			return false;
+		}
+		value = skip_ws(p + 1, end);
+		p = skip_value(value, end, 1);
+		if (!p) {
+			return false;
+		}
+
+		if (memchr(key, '\\', key_len)) {
+			return false;
+		} else if (envelope_member(key, key_len, "jsonrpc", &jsonrpc)) {
+			jsonrpc = value;
+			jsonrpc_len = p - value;
+		} else if (envelope_member(key, key_len, "method", &env->method)) {
+			env->method = value;
+			env->method_len = p - value;
+		} else if (envelope_member(key, key_len, "params", &env->params)) {
+			env->params = value;
+			env->params_len = p - value;
+		} else if (envelope_member(key, key_len, "id", &env->id)) {
+			env->id = value;
+			env->id_len = p - value;
+		} else if ((key_len == 7 && !memcmp(key, "jsonrpc", 7)) ||
+				(key_len == 6 && !memcmp(key, "method", 6)) ||
+				(key_len == 6 && !memcmp(key, "params", 6)) ||
+				(key_len == 2 && !memcmp(key, "id", 2))) {
+			return false;
+		}
+
+		p = skip_ws(p, end);
+		if (p < end && *p == ',') {
+			p = skip_ws(p + 1, end);
+		} else if (p < end && *p == '}') {
+			break;
+		} else {
+			return false;
+		}
+	}
+	if (skip_ws(p + 1, end) != end) {
+		return false;
+	}
+
+	/* the same checks validate_request() does */
+	if (jsonrpc_len != 5 || memcmp(jsonrpc, "\"2.0\"", 5)) {
+		return false;
+	}
+	if (!env->method || *env->method != '"' ||
+			memchr(env->method, '\\', env->method_len)) {
+		return false;
+	}
+	env->method++;
+	env->method_len -= 2;
+	if (env->params && *env->params != '[' && *env->params != '{') {
+		return false;
+	}
+	if (env->id && strchr("[{tf", *env->id)) {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Ids which the encoder would write exactly as they were sent: null,
+ * integers which surely fit a json_int_t and strings without escapes. These
+ * are echoed from the request instead of being decoded.
+ */
+static bool plain_id(const char *id, size_t len)
+{
+	size_t i = 0;
+
+	if (*id == '"') {
+		return !memchr(id, '\\', len);
+	} else if (*id == 'n') {
+		return true;
+	}
+
+	if (id[0] == '-') {
+		i++;
+	}
+	if (len - i > 18 || (len - i > 1 && id[i] == '0') ||
+			(i && len == 2 && id[1] == '0')) {
+		return false;
+	}
+	for (; i < len; i++) {
+		if (id[i] < '0' || id[i] > '9') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* returns -1 if the request has to take the regular path */
+static int handle_raw_request(struct jsonrpc_ctx *ctx, const char *buf,
+		size_t len, struct response *rsp, bool *respond)
+{
+	struct envelope env;
+	struct rpc_callback *walk;
+	json_t *id = NULL, *params = NULL;
+	json_error_t err;
+	STATS_START(start);
+
+	if (!scan_envelope(buf, buf + len, &env)) {
+		return -1;
+	}
+	STATS_PHASE(ctx, PHASE_VALIDATE, start);
+
+	/* hooks get the id as an object */
+	if (env.id && (ctx->nhooks || !plain_id(env.id, env.id_len))) {
+		id = jsonrpc_codec_decode(env.id, env.id_len, JSON_DECODE_ANY, &err);
+		if (!id) {
+			return -1;
+		}
+	}
+
+	walk = find_callback(&ctx->registry, env.method, env.method_len);
+	if (!walk) {
+		method_not_found(ctx, env.method, env.method_len, rsp);
+	} else if (walk->lazy) {
+		STATS_START(call);
+		consume_ret(ctx, call_method(ctx, walk, id, env.params,
+					env.params_len, NULL), rsp);
+		STATS_CALL(ctx, walk, call, rsp->err);
+	} else {
+		if (env.params) {
+			STATS_START(decode);
+			params = jsonrpc_codec_decode(env.params, env.params_len, 0,
+					&err);
+			STATS_PHASE(ctx, PHASE_DECODE, decode);
+			if (!params) {
+				json_decref(id);
+				return -1;
+			}
+		}
+		STATS_START(call);
+		consume_ret(ctx, call_method(ctx, walk, id, env.params,
+					env.params_len, params), rsp);
+		STATS_CALL(ctx, walk, call, rsp->err);
+		json_decref(params);
+	}
+
+	*respond = env.id != NULL;
+	if (!env.id) {
+		/* this is a notification, no response is sent */
+		rsp_free(rsp);
+	} else if (id) {
+		rsp->id = id;
+	} else {
+		rsp->raw_id = env.id;
+		rsp->raw_id_len = env.id_len;
+	}
+
+	return 0;
+}
+
+static int handle_stream_batch(struct jsonrpc_ctx *ctx, const char *buf,
+		size_t len, bool arena_scope, jsonrpc_write_t write, void *priv)
+{
+	const char *p, *start, *end = buf + len;
+	struct batch_writer out = {
+		.write = write,
+		.priv = priv,
+	};
+	struct response rsp = { NULL };
+	json_error_t err;
+	json_t *request;
+	bool respond;
+	int ret = 0;
+
+	p = skip_ws(buf, end) + 1;
+	while (!ret) {
+		start = skip_ws(p, end);
+		p = skip_value(start, end, 0);
+
+		request = NULL;
+		if (handle_raw_request(ctx, start, p - start, &rsp, &respond)) {
+			request = jsonrpc_codec_decode(start, p - start,
+					JSON_DECODE_ANY, &err);
+			if (request) {
+				respond = _jsonrpc_handle_single_request(ctx, request, &rsp);
+			} else {
+				/* in case the decoder is stricter than the scan */
+				rsp_error_str(ctx, &rsp, ERR_PARSE_ERROR, err.text);
+				rsp.id = json_null();
+				respond = true;
+			}
+		}
+		if (respond) {
+			ret = batch_next(&out) || encode_response_cb(ctx, &rsp, write, priv);
+			rsp_free(&rsp);
+		}
+		json_decref(request);
+
+		/* nothing of the member is referenced anymore */
+		if (arena_scope) {
+			arena_leave();
+			arena_enter();
+		}
+
+		p = skip_ws(p, end);
+		if (*p++ == ']') {
+			break;
+		}
+	}
+
+	if (ret) {
+		return -1;
+	}
+
+	return batch_finish(&out);
+}
+
+/*
+ * The whole file is read, but not parsed at once. With a max, reading stops
+ * as soon as the file turns out to be larger.
+ */
+static char *read_file(FILE *file, size_t *_len, size_t max)
+{
+	char *buf = NULL, *new;
+	size_t len = 0, size = 0;
+
+	while (!feof(file) && !ferror(file) && (!max || len <= max)) {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			new = realloc(buf, size);
+			if (!new) {
+				free(buf);
+				return NULL;
+			}
+			buf = new;
+		}
+		len += fread(buf + len, 1, size - len, file);
+	}
+	if (ferror(file)) {
+		free(buf);
+		return NULL;
+	}
+	*_len = len;
+
+	return buf ? buf : strdup("");
+}
+
+/* returns false if the context handles max_inflight requests already */
+static bool ctx_admit(struct jsonrpc_ctx *ctx, bool *counted)
+{
+	unsigned int max = ctx->limits.max_inflight;
+
+	*counted = max != 0;
+	if (!max) {
+		return true;
+	}
+	if (__atomic_add_fetch(&ctx->inflight, 1, __ATOMIC_ACQUIRE) <= max) {
+		return true;
+	}
+	__atomic_sub_fetch(&ctx->inflight, 1, __ATOMIC_RELEASE);
+	*counted = false;
+
+	return false;
+}
+
+static void ctx_release(struct jsonrpc_ctx *ctx, bool counted)
+{
+	if (counted) {
+		__atomic_sub_fetch(&ctx->inflight, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static bool batch_too_large(const struct jsonrpc_ctx *ctx, size_t count)
+{
+	return ctx->limits.max_batch && count > ctx->limits.max_batch;
+}
+
+/* the whole response for a rejected request, without any encoding */
+static int reject(struct jsonrpc_ctx *ctx, enum rsp_error err,
+		jsonrpc_write_t write, void *priv)
+{
+	STATS_ERROR(ctx, err);
+
+	return write_fragment(&rejections[err], write, priv);
+}
+
+static int _jsonrpc_handle_request(struct jsonrpc_ctx *ctx, FILE* file,
+		const char *buf, size_t len, jsonrpc_write_t write, void *priv)
+{
+	int ret = 0;
+	json_t *request = NULL;
+	char *input = NULL;
+	struct response rsp = { NULL };
+	bool respond, counted;
+	jsonrpc_confflags_t config = ctx_config(ctx);
+	bool arena_scope = (config & JSONRPC_REQUEST_ARENA) && !arena.active;
+	/* parallel batches need all members at once */
+	bool stream = (config & JSONRPC_STREAM_BATCH) &&
+		!((config & JSONRPC_PARALLEL_BATCH) && ctx->executor);
+	size_t count, max_request = ctx->limits.max_request;
+
+	ctx_prepare(ctx);
+
+	if (!ctx_admit(ctx, &counted)) {
+		return reject(ctx, ERR_SERVER_BUSY, write, priv);
+	}
+
+	if (arena_scope) {
+		arena_enter();
+	}
+
+	/* the size of a file is only known once it is read */
+	if (file && (stream || max_request)) {
+		input = read_file(file, &len, max_request);
+		if (!input) {
+			rsp_error_str(ctx, &rsp, ERR_PARSE_ERROR,
+					"unable to read the request");
+			goto error;
+		}
+		buf = input;
+		file = NULL;
+	}
+	if (max_request && len > max_request) {
+		ret = reject(ctx, ERR_TOO_LARGE, write, priv);
+		goto out;
+	}
+
+	count = stream ? stream_batch_check(buf, len) : 0;
+	if (count) {
+		if (batch_too_large(ctx, count)) {
+			ret = reject(ctx, ERR_TOO_LARGE, write, priv);
+		} else {
+			ret = handle_stream_batch(ctx, buf, len, arena_scope, write, priv);
+		}
+		goto out;
+	}
+
+	if (!file && !handle_raw_request(ctx, buf, len, &rsp, &respond)) {
+		if (respond) {
+			ret = encode_response_cb(ctx, &rsp, write, priv);
+			rsp_free(&rsp);
+		}
+		goto out;
+	}
+
+	if (decode_request(ctx, file, buf, len, &request, &rsp)) {
+		goto error;
+	}
+
+	if (json_is_array(request) && json_array_size(request) == 0) {
+		json_decref(request);
+		rsp_error_str(ctx, &rsp, ERR_INVALID_REQUEST,
+				"Request must not be an empty array.");
+		goto error;
+	}
+
+	if (json_is_array(request) &&
+			batch_too_large(ctx, json_array_size(request))) {
+		json_decref(request);
+		ret = reject(ctx, ERR_TOO_LARGE, write, priv);
+		goto out;
+	}
+
+	if (!json_is_array(request)) {
+		if (_jsonrpc_handle_single_request(ctx, request, &rsp)) {
+			ret = encode_response_cb(ctx, &rsp, write, priv);
+			rsp_free(&rsp);
+		}
+	} else {
+		ret = _jsonrpc_handle_multiple_requests(ctx, request, write, priv);
+	}
+	json_decref(request);
+	goto out;
+
+error:
+	rsp.id = json_null();
+	ret = encode_response_cb(ctx, &rsp, write, priv);
+	rsp_free(&rsp);
+
+out:
+	free(input);
+	if (arena_scope) {
+		arena_leave();
+	}
+	ctx_release(ctx, counted);
+
+	return ret;
+}
+
+static char *handle_request_str(struct jsonrpc_ctx *ctx, FILE *file,
+		const char *buf, size_t len)
+{
+	struct strbuf out = { NULL, 0, 0 };
+
+	if (_jsonrpc_handle_request(ctx, file, buf, len, strbuf_write, &out)) {
+		free(out.buf);
+		return NULL;
+	}
+
+	return out.buf;
+}
+
+char *jsonrpc_ctx_handle_request(jsonrpc_ctx_t *ctx, const char *buf,
+		size_t len)
+{
+	return handle_request_str(ctx_get(ctx), NULL, buf, len);
+}
+
+char *jsonrpc_ctx_handle_request_from_file(jsonrpc_ctx_t *ctx, FILE *file)
+{
+	return handle_request_str(ctx_get(ctx), file, NULL, 0);
+}
+
+int jsonrpc_ctx_handle_request_into(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, char *buf, size_t size, size_t *len)
+{
+	struct fixedbuf out = { buf, 0, size };
+	int rc;
+
+	rc = _jsonrpc_handle_request(ctx_get(ctx), NULL, req, req_len,
+			fixedbuf_write, &out);
+	*len = out.len;
+
+	return (rc || out.len > size) ? -1 : 0;
+}
+
+int jsonrpc_ctx_handle_request_cb(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, jsonrpc_write_t write, void *priv)
+{
+	return _jsonrpc_handle_request(ctx_get(ctx), NULL, req, req_len,
+			write, priv);
+}
+
+int jsonrpc_ctx_handle_request_iov(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, jsonrpc_iov_t **iov)
+{
+	*iov = calloc(1, sizeof(**iov));
+	if (!*iov) {
+		return -1;
+	}
+
+	return iov_done(iov, _jsonrpc_handle_request(ctx_get(ctx), NULL, req,
+				req_len, iov_write, *iov));
+}
+
+char *jsonrpc_handle_request(const char *buf, size_t len)
+{
+	return handle_request_str(&default_ctx, NULL, buf, len);
+}
+
+char *jsonrpc_handle_request_from_file(FILE *file)
+{
+	return handle_request_str(&default_ctx, file, NULL, 0);
+}
+
+int jsonrpc_handle_request_into(const char *req, size_t req_len, char *buf,
+		size_t size, size_t *len)
+{
+	return jsonrpc_ctx_handle_request_into(&default_ctx, req, req_len, buf,
+			size, len);
+}
+
+int jsonrpc_handle_request_cb(const char *req, size_t req_len,
+		jsonrpc_write_t write, void *priv)
+{
+	return jsonrpc_ctx_handle_request_cb(&default_ctx, req, req_len, write,
+			priv);
+}
+
+int jsonrpc_handle_request_iov(const char *req, size_t req_len,
+		jsonrpc_iov_t **iov)
+{
+	return jsonrpc_ctx_handle_request_iov(&default_ctx, req, req_len, iov);
+}
+
+/*
+ * MessagePack requests are validated and dispatched like JSON ones, only
+ * the decoder and the encoder differ. The envelope of the response is
+ * written directly, just its values go through the encoder.
+ */
+static int decode_msgpack(struct jsonrpc_ctx *ctx, const char *buf,
+		size_t len, json_t **_request, struct response *rsp)
+{
+	json_t *request;
+	json_error_t err;
+	STATS_START(start);
+
+	request = jsonrpc_msgpack_decode(buf, len, &err);
+	STATS_PHASE(ctx, PHASE_DECODE, start);
+	if (!request) {
+		return rsp_error_str(ctx, rsp, ERR_PARSE_ERROR, err.text);
+	}
+
+	*_request = request;
+
+	return 0;
+}
+
+static int encode_msgpack(struct jsonrpc_ctx *ctx, struct response *rsp,
+		jsonrpc_write_t write, void *priv)
+{
+	struct msgpack_writer w = {
+		.write = write,
+		.priv = priv,
+	};
+	json_error_t err;
+	int ret;
+	STATS_START(start);
+
+	/* raw results, including the cached ones, are JSON */
+	if (rsp->raw.json) {
+		rsp->result = jsonrpc_codec_decode(rsp->raw.json, rsp->raw.len,
+				JSON_DECODE_ANY, &err);
+		if (rsp->raw.free) {
+			rsp->raw.free((void *)rsp->raw.json);
+		}
+		memset(&rsp->raw, 0, sizeof(rsp->raw));
+		if (!rsp->result) {
+			rsp_error(ctx, rsp, ERR_INTERNAL_ERROR, NULL);
+		}
+	}
+	assert((!rsp->result && rsp->err != ERR_NO_ERR) ||
+			(rsp->result && rsp->err == ERR_NO_ERR));
+	assert(rsp->id);
+
+	msgpack_map(&w, 3);
+	msgpack_str(&w, "jsonrpc", 7);
+	msgpack_str(&w, "2.0", 3);
+	if (rsp->result) {
+		msgpack_str(&w, "result", 6);
+		msgpack_value(&w, rsp->result);
+	} else {
+		msgpack_str(&w, "error", 5);
+		msgpack_map(&w, rsp->data ? 3 : 2);
+		msgpack_str(&w, "code", 4);
+		msgpack_int(&w, error_fragments[rsp->err].code);
+		msgpack_str(&w, "message", 7);
+		msgpack_str(&w, error_fragments[rsp->err].message.str,
+				error_fragments[rsp->err].message.len);
+		if (rsp->data) {
+			msgpack_str(&w, "data", 4);
+			msgpack_value(&w, rsp->data);
+		}
+	}
+	msgpack_str(&w, "id", 2);
+	msgpack_value(&w, rsp->id);
+	ret = msgpack_flush(&w);
+	STATS_PHASE(ctx, PHASE_ENCODE, start);
+
+	return ret;
+}
+
+static int reject_msgpack(struct jsonrpc_ctx *ctx, enum rsp_error err,
+		jsonrpc_write_t write, void *priv)
+{
+	struct response rsp = {
+		.id = json_null(),
+		.err = err,
+	};
+
+	STATS_ERROR(ctx, err);
+
+	return encode_msgpack(ctx, &rsp, write, priv);
+}
+
+/* the array header needs the number of responses, so they are collected */
+static int handle_msgpack_batch(struct jsonrpc_ctx *ctx, json_t *requests,
+		jsonrpc_write_t write, void *priv)
+{
+	struct strbuf out = { NULL, 0, 0 };
+	struct msgpack_writer w = {
+		.write = write,
+		.priv = priv,
+	};
+	struct response rsp = { NULL };
+	size_t i, count = 0;
+	int ret = 0;
+
+	for (i = 0; i < json_array_size(requests) && !ret; i++) {
+		if (_jsonrpc_handle_single_request(ctx,
+					json_array_get(requests, i), &rsp)) {
+			ret = encode_msgpack(ctx, &rsp, strbuf_write, &out);
+			rsp_free(&rsp);
+			count++;
+		}
+	}
+	if (!ret && count) {
+		msgpack_array(&w, count);
+		ret = msgpack_flush(&w) || write(out.buf, out.len, priv);
+	}
+	free(out.buf);
+
+	return ret ? -1 : 0;
+}
+
+int jsonrpc_ctx_handle_request_msgpack(jsonrpc_ctx_t *_ctx, const char *req,
+		size_t req_len, jsonrpc_write_t write, void *priv)
+{
+	struct jsonrpc_ctx *ctx = ctx_get(_ctx);
+	bool arena_scope = (ctx_config(ctx) & JSONRPC_REQUEST_ARENA) &&
+		!arena.active;
+	size_t max_request = ctx->limits.max_request;
+	struct response rsp = { NULL };
+	json_t *request = NULL;
+	bool counted;
+	int ret = 0;
+
+	ctx_prepare(ctx);
+
+	if (!ctx_admit(ctx, &counted)) {
+		return reject_msgpack(ctx, ERR_SERVER_BUSY, write, priv);
+	}
+	if (max_request && req_len > max_request) {
+		ret = reject_msgpack(ctx, ERR_TOO_LARGE, write, priv);
+		ctx_release(ctx, counted);
+		return ret;
+	}
+
+	if (arena_scope) {
+		arena_enter();
+	}
+
+	if (decode_msgpack(ctx, req, req_len, &request, &rsp)) {
+		goto error;
+	}
+
+	if (json_is_array(request) && json_array_size(request) == 0) {
+		rsp_error_str(ctx, &rsp, ERR_INVALID_REQUEST,
+				"Request must not be an empty array.");
+		goto error;
+	}
+
+	if (!json_is_array(request)) {
+		if (_jsonrpc_handle_single_request(ctx, request, &rsp)) {
+			ret = encode_msgpack(ctx, &rsp, write, priv);
+			rsp_free(&rsp);
+		}
+	} else if (batch_too_large(ctx, json_array_size(request))) {
+		ret = reject_msgpack(ctx, ERR_TOO_LARGE, write, priv);
+	} else {
+		ret = handle_msgpack_batch(ctx, request, write, priv);
+	}
+	goto out;
+
+error:
+	rsp.id = json_null();
+	ret = encode_msgpack(ctx, &rsp, write, priv);
+	rsp_free(&rsp);
+
+out:
+	json_decref(request);
+	if (arena_scope) {
+		arena_leave();
+	}
+	ctx_release(ctx, counted);
+
+	return ret;
+}
+
+int jsonrpc_ctx_handle_request_msgpack_iov(jsonrpc_ctx_t *ctx,
+		const char *req, size_t req_len, jsonrpc_iov_t **iov)
+{
+	*iov = calloc(1, sizeof(**iov));
+	if (!*iov) {
+		return -1;
+	}
+
+	return iov_done(iov, jsonrpc_ctx_handle_request_msgpack(ctx, req, req_len,
+				iov_write, *iov));
+}
+
+int jsonrpc_handle_request_msgpack(const char *req, size_t req_len,
+		jsonrpc_write_t write, void *priv)
+{
+	return jsonrpc_ctx_handle_request_msgpack(&default_ctx, req, req_len,
+			write, priv);
+}
+
+int jsonrpc_handle_request_msgpack_iov(const char *req, size_t req_len,
+		jsonrpc_iov_t **iov)
+{
+	return jsonrpc_ctx_handle_request_msgpack_iov(&default_ctx, req,
+			req_len, iov);
+}
+
+static char *async_join(struct async_request *req)
+{
+	char *ret, *pos;
+	size_t i, len = 1;
+
+	for (i = 0; i < req->count; i++) {
+		if (req->members[i].response) {
+			len += strlen(req->members[i].response) + 2;
+		}
+	}
+	if (len == 1) {
+		return NULL;
+	}
+
+	ret = malloc(len);
+	if (ret) {
+		pos = ret;
+		*pos++ = '[';
+		for (i = 0; i < req->count; i++) {
+			char *response = req->members[i].response;
+			if (!response) {
+				continue;
+			}
+			if (pos != ret + 1) {
+				*pos++ = ',';
+				*pos++ = ' ';
+			}
+			len = strlen(response);
+			memcpy(pos, response, len);
+			pos += len;
+		}
+		*pos++ = ']';
+		*pos = '\0';
+	}
+
+	for (i = 0; i < req->count; i++) {
+		free(req->members[i].response);
+	}
+
+	return ret;
+}
+
+static void async_member_done(struct async_request *req)
+{
+	jsonrpc_done_t done;
+	char *response;
+	void *priv;
+
+	if (__atomic_sub_fetch(&req->pending, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	done = req->done;
+	priv = req->priv;
+
+	if (req->batch) {
+		response = async_join(req);
+	} else {
+		response = req->members[0].response;
+	}
+	json_decref(req->request);
+	ctx_release(req->ctx, req->counted);
+	/* the caller may be gone as soon as it has its response */
+	free(req);
+	done(response, priv);
+}
+
+/* consumes the response */
+static void async_member_respond(struct jsonrpc_async *member,
+		struct response *rsp)
+{
+	struct async_request *req = member->req;
+
+	if (member->id) {
+		rsp->id = member->id;
+		member->id = NULL;
+		member->response = encode_response(req->ctx, rsp);
+	}
+	rsp_free(rsp);
+
+	async_member_done(req);
+}
+
+static void async_dispatch(void *arg, size_t index)
+{
+	struct async_request *req = arg;
+	struct jsonrpc_async *member = &req->members[index];
+	struct jsonrpc_ctx *ctx = req->ctx;
+	json_t *request;
+	json_t *method = NULL, *params = NULL, *id = NULL;
+	struct response rsp = { NULL };
+	struct rpc_callback *walk;
+
+	request = req->batch ? json_array_get(req->request, index) : req->request;
+
+	if (validate_request(ctx, request, &method, &params, &id, &rsp)) {
+		member->id = json_null();
+		async_member_respond(member, &rsp);
+		return;
+	}
+	member->id = id;
+
+	walk = find_callback(&ctx->registry, json_string_value(method),
+			json_string_length(method));
+	if (!walk) {
+		method_not_found(ctx, json_string_value(method),
+				json_string_length(method), &rsp);
+		async_member_respond(member, &rsp);
+	} else if (walk->async && !method_enter(walk)) {
+		rsp_error(ctx, &rsp, ERR_SERVER_BUSY, NULL);
+		async_member_respond(member, &rsp);
+	} else if (walk->async) {
+		struct jsonrpc_params pre = { .json = params, .decoded = true };
+		jsonrpc_ret_t ret = NULL;
+
+		/* left again by jsonrpc_complete() */
+		member->walk = walk;
+		member->params = params;
+		member->sampled = ctx->nhooks ? hooks_sample(ctx) : 0;
+		if (member->sampled) {
+			ret = hooks_pre(ctx, member->sampled, walk, id, &pre);
+			free(pre.encoded);
+		}
+		if (ret) {
+			jsonrpc_complete(member, ret);
+		} else {
+			/* only counts the call, the method completes later */
+			STATS_START(start);
+			walk->async(params, member);
+			STATS_CALL(ctx, walk, start, ERR_NO_ERR);
+		}
+	} else {
+		STATS_START(start);
+		consume_ret(ctx, call_method(ctx, walk, id, NULL, 0, params), &rsp);
+		STATS_CALL(ctx, walk, start, rsp.err);
+		async_member_respond(member, &rsp);
+	}
+
+	json_decref(method);
+	json_decref(params);
+}
+
+static void async_reject(struct jsonrpc_ctx *ctx, enum rsp_error err,
+		jsonrpc_done_t done, void *priv)
+{
+	STATS_ERROR(ctx, err);
+	done(strndup(rejections[err].str, rejections[err].len), priv);
+}
+
+void jsonrpc_ctx_handle_request_async(jsonrpc_ctx_t *ctx, const char *buf,
+		size_t len, jsonrpc_done_t done, void *priv)
+{
+	struct jsonrpc_ctx *c = ctx_get(ctx);
+	struct async_request *req;
+	json_t *request = NULL;
+	struct response rsp = { NULL };
+	size_t i, count;
+	bool counted;
+
+	ctx_prepare(c);
+
+	if (!ctx_admit(c, &counted)) {
+		async_reject(c, ERR_SERVER_BUSY, done, priv);
+		return;
+	}
+	if (c->limits.max_request && len > c->limits.max_request) {
+		ctx_release(c, counted);
+		async_reject(c, ERR_TOO_LARGE, done, priv);
+		return;
+	}
+
+	if (decode_request(c, NULL, buf, len, &request, &rsp)) {
+		goto error;
+	}
+
+	if (json_is_array(request) && json_array_size(request) == 0) {
+		json_decref(request);
+		rsp_error_str(c, &rsp, ERR_INVALID_REQUEST,
+				"Request must not be an empty array.");
+		goto error;
+	}
+
+	count = json_is_array(request) ? json_array_size(request) : 1;
+	if (json_is_array(request) && batch_too_large(c, count)) {
+		json_decref(request);
+		ctx_release(c, counted);
+		async_reject(c, ERR_TOO_LARGE, done, priv);
+		return;
+	}
+	req = calloc(1, sizeof(*req) + count * sizeof(req->members[0]));
+	if (!req) {
+		json_decref(request);
+		rsp_error(c, &rsp, ERR_INTERNAL_ERROR, NULL);
+		goto error;
+	}
+
+	req->ctx = c;
+	req->counted = counted;
+	req->done = done;
+	req->priv = priv;
+	req->request = request;
+	req->batch = json_is_array(request);
+	req->count = count;
+	req->pending = count + 1;
+	for (i = 0; i < count; i++) {
+		req->members[i].req = req;
+	}
+
+	if ((ctx_config(c) & JSONRPC_PARALLEL_BATCH) && c->executor && count > 1) {
+		c->executor(c->executor_priv, async_dispatch, req, count);
+	} else {
+		for (i = 0; i < count; i++) {
+			async_dispatch(req, i);
+		}
+	}
+	async_member_done(req);
+
+	return;
+
+error:
+	ctx_release(c, counted);
+	rsp.id = json_null();
+	done(encode_response(c, &rsp), priv);
+	rsp_free(&rsp);
+}
+
+void jsonrpc_handle_request_async(const char *buf, size_t len,
+		jsonrpc_done_t done, void *priv)
+{
+	jsonrpc_ctx_handle_request_async(&default_ctx, buf, len, done, priv);
+}
+
+void jsonrpc_complete(jsonrpc_async_t async, jsonrpc_ret_t ret)
+{
+	struct response rsp = { NULL };
+
+	if (!async->req) {
+		waiter_complete((struct async_waiter *)async, ret);
+		return;
+	}
+
+	if (async->sampled) {
+		struct jsonrpc_params params = {
+			.json = async->params,
+			.decoded = true,
+		};
+
+		hooks_post(async->req->ctx, async->sampled, async->walk, async->id,
+				&params, ret);
+		free(params.encoded);
+	}
+	if (async->walk) {
+		method_leave(async->walk);
+	}
+
+	consume_ret(async->req->ctx, ret, &rsp);
+	async_member_respond(async, &rsp);
+}
+
+jsonrpc_ret_t jsonrpc_result(json_t *result)
+{
+	jsonrpc_ret_t ret;
+
+	ret = ret_get();
+	ret->type = JSONRPC_RESULT;
+	ret->obj = result;
+	return ret;
+}
+
+jsonrpc_ret_t jsonrpc_result_raw(const char *json, size_t len,
+		void (*free_fn)(void *))
+{
+	jsonrpc_ret_t ret;
+
+	ret = ret_get();
+	ret->type = JSONRPC_RESULT_RAW;
+	ret->raw.json = json;
+	ret->raw.len = len;
+	ret->raw.free = free_fn;
+	return ret;
+}
+
+int jsonrpc_ret_is_error(jsonrpc_ret_t ret)
+{
+	return !ret || ret->type == JSONRPC_ERROR;
+}
+
+jsonrpc_ret_t jsonrpc_error_invalid_params(json_t *data)
+{
+	return _jsonrpc_error(ERR_INVALID_PARAMS, data);
+}
+
+jsonrpc_ret_t jsonrpc_error_internal_error(json_t *data)
+{
+	return _jsonrpc_error(ERR_INTERNAL_ERROR, data);
+}
+
+/* helpers of the binders generated by jsonrpc_define_typed() */
+json_t *_jsonrpc_param(json_t *params, size_t index, const char *name)
+{
+	if (json_is_array(params)) {
+		return json_array_get(params, index);
+	}
+
+	return json_object_get(params, name);
+}
+
+int _jsonrpc_params_check(json_t *params, size_t count)
+{
+	if (json_is_object(params) ||
+			(json_is_array(params) && json_array_size(params) == count)) {
+		return 0;
+	}
+
+	return -1;
+}
+
+int _jsonrpc_bind_int(json_t *value, int *out)
+{
+	json_int_t v;
+
+	if (!json_is_integer(value)) {
+		return -1;
+	}
+	v = json_integer_value(value);
+	if (v < INT_MIN || v > INT_MAX) {
+		return -1;
+	}
+	*out = v;
+
+	return 0;
+}
+
+int _jsonrpc_bind_json_int_t(json_t *value, json_int_t *out)
+{
+	if (!json_is_integer(value)) {
+		return -1;
+	}
+	*out = json_integer_value(value);
+
+	return 0;
+}
+
+int _jsonrpc_bind_double(json_t *value, double *out)
+{
+	if (!json_is_number(value)) {
+		return -1;
+	}
+	*out = json_number_value(value);
+
+	return 0;
+}
+
+int _jsonrpc_bind_bool(json_t *value, int *out)
+{
+	if (!json_is_boolean(value)) {
+		return -1;
+	}
+	*out = json_is_true(value);
+
+	return 0;
+}
+
+int _jsonrpc_bind_string(json_t *value, const char **out)
+{
+	if (!json_is_string(value)) {
+		return -1;
+	}
+	*out = json_string_value(value);
+
+	return 0;
+}
+
+int _jsonrpc_bind_json(json_t *value, json_t **out)
+{
+	if (!value) {
+		return -1;
+	}
+	*out = value;
+
+	return 0;
+}
+
+void _jsonrpc_register_method(const struct jsonrpc_method *method)
+{
+	assert(!default_ctx.registry.sealed);
+	registry_add(&default_ctx.registry, method);
+}
+
+void _jsonrpc_register(const char *name, rpc_callback cb)
+{
+	struct jsonrpc_method method = {
+		.name = name,
+		.cb = cb,
+	};
+
+	_jsonrpc_register_method(&method);
+}
+
+void jsonrpc_seal(void)
+{
+	ctx_seal(&default_ctx);
+}
+
+jsonrpc_ctx_t *jsonrpc_ctx_create(void)
+{
+	struct jsonrpc_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		return NULL;
+	}
+	pthread_mutex_init(&ctx->lock, NULL);
+#ifdef JSONRPC_STATS
+	ctx->stats_id = __atomic_add_fetch(&stats_last_id, 1, __ATOMIC_RELAXED);
+#endif
+
+	return ctx;
+}
+
+void jsonrpc_ctx_destroy(jsonrpc_ctx_t *ctx)
+{
+	if (!ctx || ctx == &default_ctx) {
+		return;
+	}
+
+	registry_free(&ctx->registry);
+#ifdef JSONRPC_STATS
+	stats_free(ctx);
+#endif
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+int jsonrpc_ctx_register_method(jsonrpc_ctx_t *ctx,
+		const struct jsonrpc_method *method)
+{
+	struct jsonrpc_ctx *c = ctx_get(ctx);
+	int rc;
+
+	pthread_mutex_lock(&c->lock);
+	rc = registry_add(&c->registry, method);
+	pthread_mutex_unlock(&c->lock);
+
+	return rc;
+}
+
+int jsonrpc_ctx_register(jsonrpc_ctx_t *ctx, const char *name, rpc_callback cb)
+{
+	struct jsonrpc_method method = {
+		.name = name,
+		.cb = cb,
+	};
+
+	return jsonrpc_ctx_register_method(ctx, &method);
+}
+
+int jsonrpc_ctx_register_async(jsonrpc_ctx_t *ctx, const char *name,
+		rpc_async_callback cb)
+{
+	struct jsonrpc_method method = {
+		.name = name,
+		.async = cb,
+	};
+
+	return jsonrpc_ctx_register_method(ctx, &method);
+}
+
+int jsonrpc_ctx_register_cached(jsonrpc_ctx_t *ctx, const char *name,
+		rpc_callback cb, unsigned int ttl, size_t size)
+{
+	struct jsonrpc_method method = {
+		.name = name,
+		.cb = cb,
+		.cache_ttl = ttl,
+		.cache_size = size,
+	};
+
+	return jsonrpc_ctx_register_method(ctx, &method);
+}
+
+int jsonrpc_ctx_register_lazy(jsonrpc_ctx_t *ctx, const char *name,
+		rpc_lazy_callback cb)
+{
+	struct jsonrpc_method method = {
+		.name = name,
+		.lazy = cb,
+	};
+
+	return jsonrpc_ctx_register_method(ctx, &method);
+}
+
+int jsonrpc_ctx_add_hook(jsonrpc_ctx_t *ctx, const struct jsonrpc_hook *hook)
+{
+	struct jsonrpc_ctx *c = ctx_get(ctx);
+	int rc = -1;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->registry.sealed && c->nhooks < JSONRPC_MAX_HOOKS) {
+		c->hooks[c->nhooks++] = *hook;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return rc;
+}
+
+int jsonrpc_add_hook(const struct jsonrpc_hook *hook)
+{
+	return jsonrpc_ctx_add_hook(&default_ctx, hook);
+}
+
+void jsonrpc_ctx_seal(jsonrpc_ctx_t *ctx)
+{
+	ctx_seal(ctx_get(ctx));
+}
+
+int jsonrpc_ctx_set_limits(jsonrpc_ctx_t *ctx,
+		const struct jsonrpc_limits *limits)
+{
+	struct jsonrpc_ctx *c = ctx_get(ctx);
+	int rc = -1;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->registry.sealed) {
+		c->limits = *limits;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return rc;
+}
+
+int jsonrpc_set_limits(const struct jsonrpc_limits *limits)
+{
+	return jsonrpc_ctx_set_limits(&default_ctx, limits);
+}
+
+int jsonrpc_ctx_set_executor(jsonrpc_ctx_t *ctx, jsonrpc_executor_t executor,
+		void *priv)
+{
+	struct jsonrpc_ctx *c = ctx_get(ctx);
+	int rc = -1;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->registry.sealed) {
+		c->executor = executor;
+		c->executor_priv = priv;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return rc;
+}
+
+void jsonrpc_ctx_config_set(jsonrpc_ctx_t *ctx, jsonrpc_confflags_t flags)
+{
+	if (flags & JSONRPC_REQUEST_ARENA) {
+		pthread_once(&arena_once, arena_install);
+	}
+	__atomic_store_n(&ctx_get(ctx)->config, flags, __ATOMIC_RELAXED);
+}
+
+static void __attribute__((destructor)) _jsonrpc_unregister_all(void)
+{
+	if (arena.base) {
+		pthread_setspecific(arena_key, NULL);
+		free(arena.base);
+		arena.base = NULL;
+	}
+	/* key destructors don't run for the thread calling exit() */
+	if (ret_pool) {
+		pthread_setspecific(ret_pool_key, NULL);
+		ret_pool_exit(ret_pool);
+		ret_pool = NULL;
+	}
+
+	registry_free(&default_ctx.registry);
+#ifdef JSONRPC_STATS
+	stats_free(&default_ctx);
+#endif
 }
 
 void jsonrpc_config_set(jsonrpc_confflags_t flags)
 {
-	config = flags;
+	jsonrpc_ctx_config_set(&default_ctx, flags);
+}
+
+json_t *jsonrpc_ctx_stats_snapshot(jsonrpc_ctx_t *ctx)
+{
+#ifdef JSONRPC_STATS
+	return stats_snapshot(ctx_get(ctx));
+#else
+	return NULL;
+#endif
+}
+
+json_t *jsonrpc_stats_snapshot(void)
+{
+	return jsonrpc_ctx_stats_snapshot(&default_ctx);
 }
@@ -1,31 +1,456 @@
 #ifndef __JSONRPC_H
 #define __JSONRPC_H
 
+struct iovec;
+
 typedef struct jsonrpc_ret *jsonrpc_ret_t;
+typedef struct jsonrpc_ctx jsonrpc_ctx_t;
+typedef struct jsonrpc_async *jsonrpc_async_t;
 typedef jsonrpc_ret_t (*rpc_callback)(json_t *root);
+typedef void (*rpc_async_callback)(json_t *root, jsonrpc_async_t async);
+typedef struct jsonrpc_params *jsonrpc_params_t;
+typedef jsonrpc_ret_t (*rpc_lazy_callback)(jsonrpc_params_t params);
+typedef void (*jsonrpc_done_t)(char *response, void *priv);
+/* returns 0 on success, like json_dump_callback_t */
+typedef int (*jsonrpc_write_t)(const char *buf, size_t len, void *priv);
+typedef struct jsonrpc_iov jsonrpc_iov_t;
 typedef enum {
 	JSONRPC_DISABLE_ERROR_TEXT = (1<<0),
 	JSONRPC_ORDERED_RESPONSE   = (1<<1),
+	/*
+	 * Allocate all jansson objects of a request from a per-thread arena
+	 * which is released at once when the request is done. Callbacks must
+	 * not keep references to their params or any other object created
+	 * while handling the request.
+	 */
+	JSONRPC_REQUEST_ARENA      = (1<<2),
+	/*
+	 * Hand the members of a batch request to the context's executor,
+	 * which may run them concurrently.
+	 */
+	JSONRPC_PARALLEL_BATCH     = (1<<3),
+	/*
+	 * Parse, handle and free the members of a batch one after another
+	 * instead of decoding the whole batch first. The input is still
+	 * checked for well-formedness up front. Has no effect on parallel
+	 * batches.
+	 */
+	JSONRPC_STREAM_BATCH       = (1<<4),
+	/*
+	 * Answer the method "rpc.stats" with jsonrpc_stats_snapshot(), unless
+	 * a method of that name is registered. Needs JSONRPC_STATS.
+	 */
+	JSONRPC_STATS_METHOD       = (1<<5),
 } jsonrpc_confflags_t;
 
+/*
+ * An executor calls task(arg, index) for every index below count, in any
+ * order and on any thread, and returns once all of them have finished.
+ */
+typedef void (*jsonrpc_task_t)(void *arg, size_t index);
+typedef void (*jsonrpc_executor_t)(void *priv, jsonrpc_task_t task, void *arg,
+		size_t count);
+typedef struct jsonrpc_pool jsonrpc_pool_t;
+
+typedef enum {
+	/* one message per line */
+	JSONRPC_FRAMING_NEWLINE,
+	/* header block with a Content-Length, like the Language Server Protocol */
+	JSONRPC_FRAMING_CONTENT_LENGTH,
+	/* HTTP/1.1 POST requests, only served by the socket server */
+	JSONRPC_FRAMING_HTTP,
+} jsonrpc_framing_t;
+
+/*
+ * Hooks run around every method call and get the method name, the id (NULL
+ * for notifications) and the params. If a pre hook returns something, the
+ * method and the remaining pre hooks are skipped, and the return value is
+ * used instead. Post hooks run in reverse order and get the return value,
+ * which still belongs to the library. A hook with a sample of N only runs
+ * for one in N calls on each thread; 0 means every call. Hooks have to be
+ * added before the first request is handled.
+ */
+#define JSONRPC_MAX_HOOKS 8
+
+struct jsonrpc_hook {
+	jsonrpc_ret_t (*pre)(const char *method, json_t *id,
+			jsonrpc_params_t params, void *priv);
+	void (*post)(const char *method, json_t *id, jsonrpc_params_t params,
+			jsonrpc_ret_t ret, void *priv);
+	void *priv;
+	unsigned int sample;
+};
+
+/*
+ * Exactly one of cb, async and lazy is set, methods with none or several of
+ * them are not registered. Results of cb methods with a cache_ttl (in
+ * milliseconds) and a cache_size are cached: repeated calls with equal
+ * params are answered with the encoded result for cache_ttl, without
+ * calling the method. At most cache_size results are kept, the
+ * least recently used are dropped first. Errors are not cached. Only for
+ * methods whose result depends on nothing but the params.
+ *
+ * Calls of cb methods with single_flight set wait for a running call with
+ * equal params instead of calling the method again, and get its result or
+ * error, each with their own id. The waiting calls block their threads.
+ * A method calling itself with equal params on the same thread isn't kept
+ * waiting, the method is called again. It deadlocks if it waits for such
+ * a call on another thread, though.
+ *
+ * With a max_concurrent, calls beyond that many running at once are
+ * answered with a "Server busy" error (-32000) right away. Asynchronous
+ * calls run until they are completed.
+ */
+struct jsonrpc_method {
+	const char *name;
+	rpc_callback cb;
+	rpc_async_callback async;
+	rpc_lazy_callback lazy;
+	unsigned int cache_ttl;
+	size_t cache_size;
+	unsigned int max_concurrent;
+	int single_flight;
+};
+
+/*
+ * Admission limits of a context, zero means no limit. Requests beyond them
+ * are answered with a preserialized error and a null id, before anything
+ * is parsed: "Server busy" (-32000) once max_inflight requests are handled
+ * at once, "Request too large" (-32001) for requests of more than
+ * max_request bytes or batches of more than max_batch members. Limits have
+ * to be set before the first request is handled.
+ */
+struct jsonrpc_limits {
+	size_t max_request;
+	size_t max_batch;
+	unsigned int max_inflight;
+};
+
 void jsonrpc_config_set(jsonrpc_confflags_t flags);
+
+/*
+ * Counters and latency histograms of the methods and of the request phases
+ * (decode, validate, dispatch and encode), summed up over all threads. Only
+ * collected if the library is built with JSONRPC_STATS, NULL otherwise.
+ * Latency percentiles are in nanoseconds, rounded up to a power of two.
+ * Built with JSONRPC_ALLOC_TRACE, the phases and methods also have the
+ * number of heap allocations ("allocs") and their bytes ("alloc_bytes")
+ * of the library and of jansson. Allocations of methods count for the
+ * dispatch phase, too.
+ */
+json_t *jsonrpc_stats_snapshot(void);
+int jsonrpc_add_hook(const struct jsonrpc_hook *hook);
+int jsonrpc_set_limits(const struct jsonrpc_limits *limits);
 char *jsonrpc_handle_request(const char *buf, size_t len);
 char *jsonrpc_handle_request_from_file(FILE *file);
+
+/*
+ * Serialize the response straight into a caller-provided buffer or through
+ * a write callback, without an intermediate string. If there is no
+ * response, nothing is written. The _into variants fail if the response
+ * doesn't fit; *len is set to the required size in that case, but the
+ * response is lost as the request won't be handled again.
+ */
+int jsonrpc_handle_request_into(const char *req, size_t req_len, char *buf,
+		size_t size, size_t *len);
+int jsonrpc_handle_request_cb(const char *req, size_t req_len,
+		jsonrpc_write_t write, void *priv);
+
+/*
+ * The response as a list of buffers for writev(). Raw results are not
+ * copied but referenced. *iov is set to NULL if there is no response, or
+ * on errors, which return -1.
+ */
+int jsonrpc_handle_request_iov(const char *req, size_t req_len,
+		jsonrpc_iov_t **iov);
+const struct iovec *jsonrpc_iov_get(jsonrpc_iov_t *iov, int *count);
+void jsonrpc_iov_free(jsonrpc_iov_t *iov);
 void _jsonrpc_register(const char *name, rpc_callback cb);
+void _jsonrpc_register_method(const struct jsonrpc_method *method);
+void jsonrpc_seal(void);
 jsonrpc_ret_t jsonrpc_result(json_t *result);
+/*
+ * A result which is encoded JSON already, it ends up in the response as is,
+ * without any checks. free_fn, if not NULL, is called on json once it isn't
+ * needed anymore.
+ */
+jsonrpc_ret_t jsonrpc_result_raw(const char *json, size_t len,
+		void (*free_fn)(void *));
 jsonrpc_ret_t jsonrpc_error_internal_error(json_t *data);
+/* non-zero for errors and NULL, which ends up as an internal error */
+int jsonrpc_ret_is_error(jsonrpc_ret_t ret);
 jsonrpc_ret_t jsonrpc_error_invalid_params(json_t *data);
 
+/*
+ * Asynchronous methods get a completion handle instead of returning a value.
+ * They may return right away and call jsonrpc_complete() exactly once later,
+ * from any thread. The params stay valid until then. The return value may
+ * have been created on another thread than the one which completes.
+ *
+ * jsonrpc_handle_request_async() calls done with the encoded response, or
+ * NULL if there is none, once every member of the request has completed.
+ * This may happen on any thread, even before the function returns. done has
+ * to free the response. If an asynchronous method is called through one of
+ * the synchronous functions, the calling thread waits for its completion.
+ */
+void jsonrpc_complete(jsonrpc_async_t async, jsonrpc_ret_t ret);
+
+/*
+ * Params of lazy methods, which are only decoded if the method asks for
+ * them. The returned value is borrowed and only valid during the call. The
+ * raw bytes are the ones of the request, unless it had to be decoded as a
+ * whole; then they are encoded again. Both return NULL if there are no params
+ * or if they can't be decoded.
+ */
+json_t *jsonrpc_params_get(jsonrpc_params_t params);
+const char *jsonrpc_params_raw(jsonrpc_params_t params, size_t *len);
+void jsonrpc_handle_request_async(const char *buf, size_t len,
+		jsonrpc_done_t done, void *priv);
+
+/*
+ * Handle messages from a persistent stream until it ends, writing each
+ * response right after its request. Returns 0 at the end of the input and
+ * -1 on I/O or framing errors.
+ */
+int jsonrpc_handle_stream(FILE *in, FILE *out, jsonrpc_framing_t framing);
+
+/*
+ * Requests and responses in MessagePack instead of JSON, for the same
+ * methods. Requests are decoded into the same jansson values, so methods
+ * can't tell the difference. Only types with a JSON counterpart work, and
+ * strings have to be valid UTF-8. Raw and cached results are still JSON and
+ * are converted, and batch members are always handled one after another.
+ * The encoder and decoder are also available on their own, e.g. for
+ * clients.
+ */
+int jsonrpc_handle_request_msgpack(const char *req, size_t req_len,
+		jsonrpc_write_t write, void *priv);
+int jsonrpc_handle_request_msgpack_iov(const char *req, size_t req_len,
+		jsonrpc_iov_t **iov);
+json_t *jsonrpc_msgpack_decode(const char *buf, size_t len,
+		json_error_t *error);
+int jsonrpc_msgpack_encode(const json_t *value, jsonrpc_write_t write,
+		void *priv);
+
+/*
+ * Independent server contexts. Methods and configuration are set up first;
+ * the first request seals the context, after which it can be shared by any
+ * number of threads without locking. Registering methods on a sealed context
+ * fails. Method names are not copied. A NULL context refers to the default
+ * context used by the functions above.
+ */
+jsonrpc_ctx_t *jsonrpc_ctx_create(void);
+void jsonrpc_ctx_destroy(jsonrpc_ctx_t *ctx);
+int jsonrpc_ctx_register(jsonrpc_ctx_t *ctx, const char *name, rpc_callback cb);
+int jsonrpc_ctx_register_async(jsonrpc_ctx_t *ctx, const char *name,
+		rpc_async_callback cb);
+int jsonrpc_ctx_register_lazy(jsonrpc_ctx_t *ctx, const char *name,
+		rpc_lazy_callback cb);
+int jsonrpc_ctx_register_cached(jsonrpc_ctx_t *ctx, const char *name,
+		rpc_callback cb, unsigned int ttl, size_t size);
+int jsonrpc_ctx_register_method(jsonrpc_ctx_t *ctx,
+		const struct jsonrpc_method *method);
+void jsonrpc_ctx_config_set(jsonrpc_ctx_t *ctx, jsonrpc_confflags_t flags);
+int jsonrpc_ctx_add_hook(jsonrpc_ctx_t *ctx, const struct jsonrpc_hook *hook);
+int jsonrpc_ctx_set_limits(jsonrpc_ctx_t *ctx,
+		const struct jsonrpc_limits *limits);
+json_t *jsonrpc_ctx_stats_snapshot(jsonrpc_ctx_t *ctx);
+void jsonrpc_ctx_seal(jsonrpc_ctx_t *ctx);
+char *jsonrpc_ctx_handle_request(jsonrpc_ctx_t *ctx, const char *buf,
+		size_t len);
+char *jsonrpc_ctx_handle_request_from_file(jsonrpc_ctx_t *ctx, FILE *file);
+int jsonrpc_ctx_handle_request_into(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, char *buf, size_t size, size_t *len);
+int jsonrpc_ctx_handle_request_cb(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, jsonrpc_write_t write, void *priv);
+int jsonrpc_ctx_handle_request_iov(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, jsonrpc_iov_t **iov);
+void jsonrpc_ctx_handle_request_async(jsonrpc_ctx_t *ctx, const char *buf,
+		size_t len, jsonrpc_done_t done, void *priv);
+int jsonrpc_ctx_handle_stream(jsonrpc_ctx_t *ctx, FILE *in, FILE *out,
+		jsonrpc_framing_t framing);
+int jsonrpc_ctx_handle_request_msgpack(jsonrpc_ctx_t *ctx, const char *req,
+		size_t req_len, jsonrpc_write_t write, void *priv);
+int jsonrpc_ctx_handle_request_msgpack_iov(jsonrpc_ctx_t *ctx,
+		const char *req, size_t req_len, jsonrpc_iov_t **iov);
+
+/*
+ * The executor is used for batch requests if JSONRPC_PARALLEL_BATCH is set.
+ * Without one, the members are handled one after another. The built-in
+ * thread pool can be used with jsonrpc_pool_execute and the pool as priv.
+ * Like methods, it can't be set on a sealed context.
+ */
+int jsonrpc_ctx_set_executor(jsonrpc_ctx_t *ctx, jsonrpc_executor_t executor,
+		void *priv);
+jsonrpc_pool_t *jsonrpc_pool_create(unsigned int threads);
+void jsonrpc_pool_destroy(jsonrpc_pool_t *pool);
+void jsonrpc_pool_execute(void *pool, jsonrpc_task_t task, void *arg,
+		size_t count);
+
 #define glue_(x, y) x##y
 #define glue(x, y) glue_(x, y)
 
-#define jsonrpc_register_name(name, func) \
+/*
+ * If JSONRPC_SEALED is defined, methods are not registered by constructors.
+ * Instead, they are placed in the jsonrpc_methods linker section and indexed
+ * once by jsonrpc_seal() or by the first request. No methods can be
+ * registered after the registry is sealed.
+ */
+#ifdef JSONRPC_SEALED
+#define _jsonrpc_method_(id, ...) \
+	static const struct jsonrpc_method \
+	__attribute__((used, section("jsonrpc_methods"), aligned(sizeof(void *)))) \
+	glue(__jsonrpc_method_, id) = { __VA_ARGS__ }
+#else
+#define _jsonrpc_method_(id, ...) \
+	static const struct jsonrpc_method \
+	glue(__jsonrpc_method_, id) = { __VA_ARGS__ }; \
 	static void __attribute__((constructor)) \
-	glue(__jsonrpc_register_init_, __COUNTER__) (void) { \
-		_jsonrpc_register(name, func); \
+	glue(__jsonrpc_register_init_, id) (void) { \
+		_jsonrpc_register_method(&glue(__jsonrpc_method_, id)); \
 	}
+#endif
+
+#define _jsonrpc_method(...) \
+	_jsonrpc_method_(__COUNTER__, __VA_ARGS__)
+
+#define jsonrpc_register_name(_name, _func) \
+	_jsonrpc_method(.name = _name, .cb = _func)
 
 #define jsonrpc_register(func) \
 	jsonrpc_register_name(#func, func)
 
+#define jsonrpc_register_cached_name(_name, _func, _ttl, _size) \
+	_jsonrpc_method(.name = _name, .cb = _func, .cache_ttl = _ttl, \
+			.cache_size = _size)
+
+#define jsonrpc_register_cached(func, ttl, size) \
+	jsonrpc_register_cached_name(#func, func, ttl, size)
+
+#define jsonrpc_register_single_flight_name(_name, _func) \
+	_jsonrpc_method(.name = _name, .cb = _func, .single_flight = 1)
+
+#define jsonrpc_register_single_flight(func) \
+	jsonrpc_register_single_flight_name(#func, func)
+
+#define jsonrpc_register_limited_name(_name, _func, _max) \
+	_jsonrpc_method(.name = _name, .cb = _func, .max_concurrent = _max)
+
+#define jsonrpc_register_limited(func, max) \
+	jsonrpc_register_limited_name(#func, func, max)
+
+#define jsonrpc_register_async_name(_name, _func) \
+	_jsonrpc_method(.name = _name, .async = _func)
+
+#define jsonrpc_register_async(func) \
+	jsonrpc_register_async_name(#func, func)
+
+#define jsonrpc_register_lazy_name(_name, _func) \
+	_jsonrpc_method(.name = _name, .lazy = _func)
+
+#define jsonrpc_register_lazy(func) \
+	jsonrpc_register_lazy_name(#func, func)
+
+/*
+ * Typed methods take their params as C arguments. The params are declared
+ * as (type, name) pairs, with one of these types:
+ *
+ *   int, json_int_t, double   numbers, int and json_int_t take integers only
+ *   bool                      true or false, passed as an int
+ *   string                    a const char *, valid during the call
+ *   json                      any value, a borrowed json_t *
+ *
+ * For example:
+ *
+ *   static jsonrpc_ret_t add(int a, int b)
+ *   {
+ *           return jsonrpc_result(json_integer(a + b));
+ *   }
+ *   jsonrpc_register_typed(add, (int, a), (int, b));
+ *
+ * registers a binder which accepts [1, 2] as well as {"a": 1, "b": 2}. It
+ * picks every param by its position or its name in one step, checks its
+ * type and calls add() directly. Positional params have to match in
+ * number, named ones may come with others, which are ignored. Otherwise
+ * the call fails with invalid params, with the name of the first bad param
+ * as data. There are one to eight params. jsonrpc_define_typed() only
+ * defines the binder, func_binder, e.g. for jsonrpc_ctx_register().
+ */
+json_t *_jsonrpc_param(json_t *params, size_t index, const char *name);
+int _jsonrpc_params_check(json_t *params, size_t count);
+int _jsonrpc_bind_int(json_t *value, int *out);
+int _jsonrpc_bind_json_int_t(json_t *value, json_int_t *out);
+int _jsonrpc_bind_double(json_t *value, double *out);
+int _jsonrpc_bind_bool(json_t *value, int *out);
+int _jsonrpc_bind_string(json_t *value, const char **out);
+int _jsonrpc_bind_json(json_t *value, json_t **out);
+
+#define _jsonrpc_ctype_int int
+#define _jsonrpc_ctype_json_int_t json_int_t
+#define _jsonrpc_ctype_double double
+#define _jsonrpc_ctype_bool int
+#define _jsonrpc_ctype_string const char *
+#define _jsonrpc_ctype_json json_t *
+/* bool may be a macro already */
+#define _jsonrpc_ctype__Bool int
+#define _jsonrpc_bind__Bool _jsonrpc_bind_bool
+
+#define _jsonrpc_nargs(...) _jsonrpc_nargs_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1)
+#define _jsonrpc_nargs_(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+/* m(index, pair) for every pair, and m(pair) separated by commas */
+#define _jsonrpc_each(m, ...) \
+	glue(_jsonrpc_each_, _jsonrpc_nargs(__VA_ARGS__))(m, 0, __VA_ARGS__)
+#define _jsonrpc_each_1(m, i, p) m(i, p)
+#define _jsonrpc_each_2(m, i, p, ...) m(i, p) _jsonrpc_each_1(m, i + 1, __VA_ARGS__)
+#define _jsonrpc_each_3(m, i, p, ...) m(i, p) _jsonrpc_each_2(m, i + 1, __VA_ARGS__)
+#define _jsonrpc_each_4(m, i, p, ...) m(i, p) _jsonrpc_each_3(m, i + 1, __VA_ARGS__)
+#define _jsonrpc_each_5(m, i, p, ...) m(i, p) _jsonrpc_each_4(m, i + 1, __VA_ARGS__)
+#define _jsonrpc_each_6(m, i, p, ...) m(i, p) _jsonrpc_each_5(m, i + 1, __VA_ARGS__)
+#define _jsonrpc_each_7(m, i, p, ...) m(i, p) _jsonrpc_each_6(m, i + 1, __VA_ARGS__)
+#define _jsonrpc_each_8(m, i, p, ...) m(i, p) _jsonrpc_each_7(m, i + 1, __VA_ARGS__)
+
+#define _jsonrpc_list(m, ...) \
+	glue(_jsonrpc_list_, _jsonrpc_nargs(__VA_ARGS__))(m, __VA_ARGS__)
+#define _jsonrpc_list_1(m, p) m(p)
+#define _jsonrpc_list_2(m, p, ...) m(p), _jsonrpc_list_1(m, __VA_ARGS__)
+#define _jsonrpc_list_3(m, p, ...) m(p), _jsonrpc_list_2(m, __VA_ARGS__)
+#define _jsonrpc_list_4(m, p, ...) m(p), _jsonrpc_list_3(m, __VA_ARGS__)
+#define _jsonrpc_list_5(m, p, ...) m(p), _jsonrpc_list_4(m, __VA_ARGS__)
+#define _jsonrpc_list_6(m, p, ...) m(p), _jsonrpc_list_5(m, __VA_ARGS__)
+#define _jsonrpc_list_7(m, p, ...) m(p), _jsonrpc_list_6(m, __VA_ARGS__)
+#define _jsonrpc_list_8(m, p, ...) m(p), _jsonrpc_list_7(m, __VA_ARGS__)
+
+#define _jsonrpc_pair(type, name) type, name
+#define _jsonrpc_apply(m, ...) m(__VA_ARGS__)
+
+#define _jsonrpc_bind_decl(i, p) _jsonrpc_apply(_jsonrpc_bind_decl_, _jsonrpc_pair p)
+#define _jsonrpc_bind_decl_(type, name) glue(_jsonrpc_ctype_, type) name;
+
+#define _jsonrpc_bind_get(i, p) \
+	_jsonrpc_apply(_jsonrpc_bind_get_, i, _jsonrpc_pair p)
+#define _jsonrpc_bind_get_(i, type, name) \
+	if (glue(_jsonrpc_bind_, type)(_jsonrpc_param(params, i, #name), &name)) \
+		return jsonrpc_error_invalid_params(json_string(#name));
+
+#define _jsonrpc_bind_arg(p) _jsonrpc_apply(_jsonrpc_bind_arg_, _jsonrpc_pair p)
+#define _jsonrpc_bind_arg_(type, name) name
+
+#define jsonrpc_define_typed(func, ...) \
+	static jsonrpc_ret_t glue(func, _binder)(json_t *params) \
+	{ \
+		_jsonrpc_each(_jsonrpc_bind_decl, __VA_ARGS__) \
+		if (_jsonrpc_params_check(params, _jsonrpc_nargs(__VA_ARGS__))) \
+			return jsonrpc_error_invalid_params(NULL); \
+		_jsonrpc_each(_jsonrpc_bind_get, __VA_ARGS__) \
+		return func(_jsonrpc_list(_jsonrpc_bind_arg, __VA_ARGS__)); \
+	}
+
+#define jsonrpc_register_typed_name(_name, _func, ...) \
+	jsonrpc_define_typed(_func, __VA_ARGS__) \
+	jsonrpc_register_name(_name, glue(_func, _binder))
+
+#define jsonrpc_register_typed(func, ...) \
+	jsonrpc_register_typed_name(#func, func, __VA_ARGS__)
+
 #endif /* __JSONRPC_H */
@@ -0,0 +1,72 @@
+/*
+ * Internal interface of the allocation tracing.
+ *
+ * With JSONRPC_ALLOC_TRACE, the heap allocations of the library and those
+ * jansson does through its allocation functions are counted per thread. The
+ * stats take the difference of the counters around each phase and method
+ * call. This header has to be included after the system headers, as it
+ * replaces malloc(), calloc(), realloc(), strdup() and strndup().
+ */
+
+#ifndef __JSONRPC_ALLOC_H
+#define __JSONRPC_ALLOC_H
+
+#ifdef JSONRPC_ALLOC_TRACE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct jsonrpc_alloc_trace {
+	uint64_t count;
+	uint64_t bytes;
+};
+
+extern __thread struct jsonrpc_alloc_trace jsonrpc_alloc_trace;
+
+static inline void jsonrpc_alloc_note(size_t size)
+{
+	jsonrpc_alloc_trace.count++;
+	jsonrpc_alloc_trace.bytes += size;
+}
+
+static inline void *jsonrpc_trace_malloc(size_t size)
+{
+	jsonrpc_alloc_note(size);
+	return malloc(size);
+}
+
+static inline void *jsonrpc_trace_calloc(size_t nmemb, size_t size)
+{
+	jsonrpc_alloc_note(nmemb * size);
+	return calloc(nmemb, size);
+}
+
+static inline void *jsonrpc_trace_realloc(void *ptr, size_t size)
+{
+	jsonrpc_alloc_note(size);
+	return realloc(ptr, size);
+}
+
+static inline char *jsonrpc_trace_strdup(const char *s)
+{
+	jsonrpc_alloc_note(strlen(s) + 1);
+	return strdup(s);
+}
+
+static inline char *jsonrpc_trace_strndup(const char *s, size_t n)
+{
+	jsonrpc_alloc_note(strnlen(s, n) + 1);
+	return strndup(s, n);
+}
+
+#define malloc(size) jsonrpc_trace_malloc(size)
+#define calloc(nmemb, size) jsonrpc_trace_calloc(nmemb, size)
+#define realloc(ptr, size) jsonrpc_trace_realloc(ptr, size)
+/* the C library may have macros of its own for these */
+#undef strdup
+#undef strndup
+#define strdup(s) jsonrpc_trace_strdup(s)
+#define strndup(s, n) jsonrpc_trace_strndup(s, n)
+#endif
+
+#endif /* __JSONRPC_ALLOC_H */
@@ -0,0 +1,280 @@
+/*
+ * Sharded LRU cache of encoded method results.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "jsonrpc_cache.h"
+#include "jsonrpc_hash.h"
+#include "jsonrpc_alloc.h"
+
+#define CACHE_MAX_SHARDS 16
+
+/* shared by the cache and the responses which are written from it */
+struct cache_value {
+	unsigned int refs;
+	size_t len;
+	char data[];
+};
+
+struct cache_entry {
+	/* the hash chain, and the LRU list with the most recently used first */
+	struct cache_entry *next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+	uint64_t hash;
+	uint64_t expires;
+	struct cache_value *value;
+	size_t key_len;
+	char key[];
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry **buckets;
+	size_t mask;
+	struct cache_entry *lru_head;
+	struct cache_entry *lru_tail;
+	size_t count;
+	size_t max;
+};
+
+struct jsonrpc_cache {
+	unsigned int ttl;
+	unsigned int nshards;
+	struct cache_shard shards[];
+};
+
+static uint64_t cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void value_put(struct cache_value *value)
+{
+	if (!__atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(value);
+	}
+}
+
+void jsonrpc_cache_release(void *data)
+{
+	value_put((struct cache_value *)((char *)data -
+				offsetof(struct cache_value, data)));
+}
+
+static struct cache_shard *cache_shard(struct jsonrpc_cache *cache,
+		uint64_t hash)
+{
+	return &cache->shards[(hash >> 32) & (cache->nshards - 1)];
+}
+
+static struct cache_entry **entry_find(struct cache_shard *shard,
+		uint64_t hash, const char *key, size_t key_len)
+{
+	struct cache_entry **walk;
+
+	for (walk = &shard->buckets[hash & shard->mask]; *walk;
+			walk = &(*walk)->next) {
+		if ((*walk)->hash == hash && (*walk)->key_len == key_len &&
+				!memcmp((*walk)->key, key, key_len)) {
+			break;
+		}
+	}
+
+	return walk;
+}
+
+static void lru_unlink(struct cache_shard *shard, struct cache_entry *entry)
+{
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		shard->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		shard->lru_tail = entry->lru_prev;
+	}
+}
+
+static void lru_push(struct cache_shard *shard, struct cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = shard->lru_head;
+	if (shard->lru_head) {
+		shard->lru_head->lru_prev = entry;
+	} else {
+		shard->lru_tail = entry;
+	}
+	shard->lru_head = entry;
+}
+
+/* walk points to the chain link of the entry */
+static void entry_drop(struct cache_shard *shard, struct cache_entry **walk)
+{
+	struct cache_entry *entry = *walk;
+
+	*walk = entry->next;
+	lru_unlink(shard, entry);
+	value_put(entry->value);
+	free(entry);
+	shard->count--;
+}
+
+struct jsonrpc_cache *jsonrpc_cache_create(unsigned int ttl, size_t size)
+{
+	struct jsonrpc_cache *cache;
+	unsigned int nshards = 1, i;
+	size_t buckets = 2;
+
+	if (!size) {
+		return NULL;
+	}
+
+	/* every shard holds at least one entry, and all of them at most size */
+	while (nshards * 2 <= CACHE_MAX_SHARDS && nshards * 2 <= size) {
+		nshards *= 2;
+	}
+	while (buckets < (size / nshards) * 2) {
+		buckets *= 2;
+	}
+
+	cache = calloc(1, sizeof(*cache) + nshards * sizeof(cache->shards[0]));
+	if (!cache) {
+		return NULL;
+	}
+	cache->ttl = ttl;
+	cache->nshards = nshards;
+
+	for (i = 0; i < nshards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->max = size / nshards;
+		shard->mask = buckets - 1;
+		shard->buckets = calloc(buckets, sizeof(*shard->buckets));
+		if (!shard->buckets) {
+			cache->nshards = i + 1;
+			jsonrpc_cache_destroy(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+void jsonrpc_cache_destroy(struct jsonrpc_cache *cache)
+{
+	struct cache_entry *entry, *next;
+	unsigned int i;
+
+	if (!cache) {
+		return;
+	}
+
+	for (i = 0; i < cache->nshards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		for (entry = shard->lru_head; entry; entry = next) {
+			next = entry->lru_next;
+			value_put(entry->value);
+			free(entry);
+		}
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
+
+const char *jsonrpc_cache_get(struct jsonrpc_cache *cache, const char *key,
+		size_t key_len, size_t *len)
+{
+	uint64_t hash = jsonrpc_hash(key, key_len);
+	struct cache_shard *shard = cache_shard(cache, hash);
+	struct cache_entry **walk, *entry;
+	struct cache_value *value = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	walk = entry_find(shard, hash, key, key_len);
+	entry = *walk;
+	if (entry && entry->expires <= cache_now()) {
+		entry_drop(shard, walk);
+	} else if (entry) {
+		lru_unlink(shard, entry);
+		lru_push(shard, entry);
+		value = entry->value;
+		__atomic_add_fetch(&value->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (!value) {
+		return NULL;
+	}
+	*len = value->len;
+
+	return value->data;
+}
+
+const char *jsonrpc_cache_set(struct jsonrpc_cache *cache, const char *key,
+		size_t key_len, const char *data, size_t len)
+{
+	uint64_t hash = jsonrpc_hash(key, key_len);
+	struct cache_shard *shard = cache_shard(cache, hash);
+	struct cache_entry **walk, *entry;
+	struct cache_value *value;
+
+	value = malloc(sizeof(*value) + len);
+	entry = malloc(sizeof(*entry) + key_len);
+	if (!value || !entry) {
+		free(value);
+		free(entry);
+		return NULL;
+	}
+
+	/* one reference for the cache and one for the caller */
+	value->refs = 2;
+	value->len = len;
+	memcpy(value->data, data, len);
+
+	entry->hash = hash;
+	entry->expires = cache_now() + cache->ttl;
+	entry->value = value;
+	entry->key_len = key_len;
+	memcpy(entry->key, key, key_len);
+
+	pthread_mutex_lock(&shard->lock);
+	/* a concurrent miss of the same key may have been faster */
+	walk = entry_find(shard, hash, key, key_len);
+	if (*walk) {
+		entry_drop(shard, walk);
+	}
+	if (shard->count == shard->max) {
+		struct cache_entry *oldest = shard->lru_tail;
+
+		entry_drop(shard, entry_find(shard, oldest->hash, oldest->key,
+					oldest->key_len));
+	}
+	walk = &shard->buckets[hash & shard->mask];
+	entry->next = *walk;
+	*walk = entry;
+	lru_push(shard, entry);
+	shard->count++;
+	pthread_mutex_unlock(&shard->lock);
+
+	return value->data;
+}
@@ -0,0 +1,30 @@
+/*
+ * Internal interface of the result cache.
+ *
+ * Every cached method has a cache of its own. Keys are the canonical
+ * encoding of the params, values the encoded results.
+ */
+
+#ifndef __JSONRPC_CACHE_H
+#define __JSONRPC_CACHE_H
+
+#include <stddef.h>
+
+struct jsonrpc_cache;
+
+/* ttl in milliseconds, size is the maximum number of entries */
+struct jsonrpc_cache *jsonrpc_cache_create(unsigned int ttl, size_t size);
+void jsonrpc_cache_destroy(struct jsonrpc_cache *cache);
+
+/*
+ * Both return the value with a reference held, or NULL. The reference is
+ * dropped with jsonrpc_cache_release(), even if the entry was dropped from
+ * the cache in the meantime. jsonrpc_cache_set() copies the value.
+ */
+const char *jsonrpc_cache_get(struct jsonrpc_cache *cache, const char *key,
+		size_t key_len, size_t *len);
+const char *jsonrpc_cache_set(struct jsonrpc_cache *cache, const char *key,
+		size_t key_len, const char *value, size_t len);
+void jsonrpc_cache_release(void *value);
+
+#endif /* __JSONRPC_CACHE_H */
@@ -0,0 +1,65 @@
+/*
+ * Internal interface of the JSON codec.
+ *
+ * The codec is selected at build time, see JSONRPC_CODEC in the Makefile.
+ * Every implementation in codec/ produces and consumes jansson values, as
+ * these are what the methods get to see. The flags are jansson's JSON_*
+ * decoding and encoding flags.
+ */
+
+#ifndef __JSONRPC_CODEC_H
+#define __JSONRPC_CODEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <jansson.h>
+#include "jsonrpc.h"
+
+json_t *jsonrpc_codec_decode(const char *buf, size_t len, size_t flags,
+		json_error_t *error);
+json_t *jsonrpc_codec_decode_file(FILE *file, size_t flags,
+		json_error_t *error);
+int jsonrpc_codec_encode(const json_t *value, jsonrpc_write_t write,
+		void *priv, size_t flags);
+
+/* returns the length of a valid UTF-8 sequence at p, or 0 */
+static inline size_t jsonrpc_utf8_check(const unsigned char *p, const unsigned char *end)
+{
+	uint32_t cp;
+	size_t i, len;
+
+	if (*p < 0x80) {
+		return 1;
+	} else if (*p >= 0xc2 && *p <= 0xdf) {
+		len = 2;
+		cp = *p & 0x1f;
+	} else if (*p >= 0xe0 && *p <= 0xef) {
+		len = 3;
+		cp = *p & 0x0f;
+	} else if (*p >= 0xf0 && *p <= 0xf4) {
+		len = 4;
+		cp = *p & 0x07;
+	} else {
+		return 0;
+	}
+
+	if ((size_t)(end - p) < len) {
+		return 0;
+	}
+	for (i = 1; i < len; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (p[i] & 0x3f);
+	}
+
+	/* overlong encodings, surrogates and values beyond unicode */
+	if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+			(cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+		return 0;
+	}
+
+	return len;
+}
+
+#endif /* __JSONRPC_CODEC_H */
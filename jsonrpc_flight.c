@@ -0,0 +1,200 @@
+/*
+ * Single-flight table, which lets concurrent identical calls share one.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "jsonrpc_flight.h"
+#include "jsonrpc_hash.h"
+#include "jsonrpc_alloc.h"
+
+/* only calls which are running are kept, so there are never many */
+#define FLIGHT_BUCKETS 64
+
+/* shared by the waiting calls, which write their responses from it */
+struct flight_value {
+	unsigned int refs;
+	size_t len;
+	char data[];
+};
+
+struct jsonrpc_flight_call {
+	struct jsonrpc_flight_call *next;
+	uint64_t hash;
+	/* the running call and the waiting ones, protected by the table lock */
+	unsigned int refs;
+	bool ended;
+	/* the thread making the call */
+	pthread_t leader;
+	pthread_cond_t cond;
+	struct flight_value *value;
+	int code;
+	size_t key_len;
+	char key[];
+};
+
+struct jsonrpc_flight {
+	pthread_mutex_t lock;
+	struct jsonrpc_flight_call *buckets[FLIGHT_BUCKETS];
+};
+
+static void value_put(struct flight_value *value)
+{
+	if (value && !__atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(value);
+	}
+}
+
+void jsonrpc_flight_release(void *data)
+{
+	value_put((struct flight_value *)((char *)data -
+				offsetof(struct flight_value, data)));
+}
+
+/* with the table lock held, returns true if the call has to be freed */
+static bool call_put(struct jsonrpc_flight_call *call)
+{
+	return !--call->refs;
+}
+
+static void call_free(struct jsonrpc_flight_call *call)
+{
+	pthread_cond_destroy(&call->cond);
+	value_put(call->value);
+	free(call);
+}
+
+struct jsonrpc_flight *jsonrpc_flight_create(void)
+{
+	struct jsonrpc_flight *flight;
+
+	flight = calloc(1, sizeof(*flight));
+	if (!flight) {
+		return NULL;
+	}
+	pthread_mutex_init(&flight->lock, NULL);
+
+	return flight;
+}
+
+void jsonrpc_flight_destroy(struct jsonrpc_flight *flight)
+{
+	if (!flight) {
+		return;
+	}
+
+	/* there are no calls left once the methods are gone */
+	pthread_mutex_destroy(&flight->lock);
+	free(flight);
+}
+
+struct jsonrpc_flight_call *jsonrpc_flight_begin(struct jsonrpc_flight *flight,
+		const char *key, size_t key_len, const char **value, size_t *len,
+		int *code)
+{
+	uint64_t hash = jsonrpc_hash(key, key_len);
+	struct jsonrpc_flight_call **walk, *call;
+	struct flight_value *shared;
+	bool last;
+
+	pthread_mutex_lock(&flight->lock);
+	for (walk = &flight->buckets[hash % FLIGHT_BUCKETS]; *walk;
+			walk = &(*walk)->next) {
+		if ((*walk)->hash == hash && (*walk)->key_len == key_len &&
+				!memcmp((*walk)->key, key, key_len)) {
+			break;
+		}
+	}
+
+	call = *walk;
+	if (call && pthread_equal(call->leader, pthread_self())) {
+		/* a recursive call would wait for itself */
+		pthread_mutex_unlock(&flight->lock);
+		*value = NULL;
+		return NULL;
+	} else if (!call) {
+		call = malloc(sizeof(*call) + key_len);
+		if (call) {
+			call->next = NULL;
+			call->hash = hash;
+			call->refs = 1;
+			call->ended = false;
+			call->leader = pthread_self();
+			pthread_cond_init(&call->cond, NULL);
+			call->value = NULL;
+			call->code = 0;
+			call->key_len = key_len;
+			memcpy(call->key, key, key_len);
+			*walk = call;
+		}
+		pthread_mutex_unlock(&flight->lock);
+		*value = NULL;
+		return call;
+	}
+
+	call->refs++;
+	while (!call->ended) {
+		pthread_cond_wait(&call->cond, &flight->lock);
+	}
+	shared = call->value;
+	if (shared) {
+		__atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+		*len = shared->len;
+		*code = call->code;
+	}
+	last = call_put(call);
+	pthread_mutex_unlock(&flight->lock);
+
+	if (last) {
+		call_free(call);
+	}
+	*value = shared ? shared->data : NULL;
+
+	return NULL;
+}
+
+const char *jsonrpc_flight_end(struct jsonrpc_flight *flight,
+		struct jsonrpc_flight_call *call, const char *data, size_t len,
+		int code)
+{
+	struct jsonrpc_flight_call **walk;
+	struct flight_value *value = NULL;
+	bool last;
+
+	if (data) {
+		value = malloc(sizeof(*value) + len);
+		if (value) {
+			/* one reference for the call and one for the caller */
+			value->refs = 2;
+			value->len = len;
+			memcpy(value->data, data, len);
+		}
+	}
+
+	pthread_mutex_lock(&flight->lock);
+	walk = &flight->buckets[call->hash % FLIGHT_BUCKETS];
+	while (*walk != call) {
+		walk = &(*walk)->next;
+	}
+	*walk = call->next;
+	call->value = value;
+	call->code = code;
+	call->ended = true;
+	pthread_cond_broadcast(&call->cond);
+	last = call_put(call);
+	pthread_mutex_unlock(&flight->lock);
+
+	if (last) {
+		call_free(call);
+	}
+
+	return value ? value->data : NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ * Internal interface of the single-flight table.
+ *
+ * Every single-flight method has a table of the calls which are running
+ * right now. Keys are the canonical encoding of the params, like the ones
+ * of the result cache. Concurrent calls with the same key wait for the
+ * first one and get its encoded outcome.
+ */
+
+#ifndef __JSONRPC_FLIGHT_H
+#define __JSONRPC_FLIGHT_H
+
+#include <stddef.h>
+
+struct jsonrpc_flight;
+struct jsonrpc_flight_call;
+
+struct jsonrpc_flight *jsonrpc_flight_create(void);
+void jsonrpc_flight_destroy(struct jsonrpc_flight *flight);
+
+/*
+ * Returns a handle if no call with the key is running. The caller then
+ * makes the call and has to pass its outcome to jsonrpc_flight_end().
+ * Otherwise, NULL is returned once the running call has ended, with its
+ * value and code. The value is NULL if the outcome couldn't be shared, and
+ * the caller has to make the call itself. That is also the case right away
+ * if the running call is made by the calling thread, which would wait
+ * forever.
+ */
+struct jsonrpc_flight_call *jsonrpc_flight_begin(struct jsonrpc_flight *flight,
+		const char *key, size_t key_len, const char **value, size_t *len,
+		int *code);
+
+/*
+ * The value is copied, NULL wakes up the waiting calls without an outcome.
+ * Returns the copy with a reference held, or NULL.
+ */
+const char *jsonrpc_flight_end(struct jsonrpc_flight *flight,
+		struct jsonrpc_flight_call *call, const char *value, size_t len,
+		int code);
+
+/* drops a reference returned by the functions above */
+void jsonrpc_flight_release(void *value);
+
+#endif /* __JSONRPC_FLIGHT_H */
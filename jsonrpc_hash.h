@@ -0,0 +1,26 @@
+/*
+ * Internal hash function, shared by the method registry, the result cache
+ * and the single-flight table.
+ */
+
+#ifndef __JSONRPC_HASH_H
+#define __JSONRPC_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit FNV-1a */
+static inline uint64_t jsonrpc_hash(const char *key, size_t len)
+{
+	uint64_t hash = 14695981039346656037ull;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+#endif /* __JSONRPC_HASH_H */
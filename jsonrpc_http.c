@@ -0,0 +1,311 @@
+/*
+ * Minimal HTTP/1.1 request parser.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "jsonrpc_http.h"
+#include "jsonrpc_alloc.h"
+
+/* returns the start of the next line and the length without the newline */
+static char *next_line(char *p, char *end, size_t *n)
+{
+	char *nl = memchr(p, '\n', end - p);
+
+	if (!nl) {
+		return NULL;
+	}
+	*n = nl - p;
+	if (*n && p[*n - 1] == '\r') {
+		(*n)--;
+	}
+
+	return nl + 1;
+}
+
+static void trim(const char **p, size_t *n)
+{
+	while (*n && (**p == ' ' || **p == '\t')) {
+		(*p)++;
+		(*n)--;
+	}
+	while (*n && ((*p)[*n - 1] == ' ' || (*p)[*n - 1] == '\t')) {
+		(*n)--;
+	}
+}
+
+static bool token_eq(const char *p, size_t n, const char *token)
+{
+	return n == strlen(token) && !strncasecmp(p, token, n);
+}
+
+/* looks for the token in a comma separated list */
+static bool has_token(const char *p, size_t n, const char *token)
+{
+	const char *comma;
+	size_t len;
+
+	while (n) {
+		comma = memchr(p, ',', n);
+		len = comma ? (size_t)(comma - p) : n;
+		if (len) {
+			const char *item = p;
+			size_t item_len = len;
+
+			trim(&item, &item_len);
+			if (token_eq(item, item_len, token)) {
+				return true;
+			}
+		}
+		if (!comma) {
+			break;
+		}
+		p += len + 1;
+		n -= len + 1;
+	}
+
+	return false;
+}
+
+/* the media type of a Content-Type, without its parameters */
+static bool is_msgpack(const char *p, size_t n)
+{
+	const char *semicolon = memchr(p, ';', n);
+
+	if (semicolon) {
+		n = semicolon - p;
+	}
+	trim(&p, &n);
+
+	return token_eq(p, n, "application/msgpack") ||
+		token_eq(p, n, "application/x-msgpack") ||
+		token_eq(p, n, "application/vnd.msgpack");
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+/*
+ * Walks the chunks of a body starting at p. If dst is set the data of the
+ * chunks is moved there, which may be p itself. Returns the length of the
+ * encoded body, 0 if it is incomplete, or the negated status code.
+ */
+static ssize_t chunked_body(char *p, char *end, size_t max_body, char *dst,
+		size_t *size)
+{
+	char *start = p, *next;
+	unsigned long long chunk;
+	size_t n, i, total = 0, newline;
+	int digit;
+
+	for (;;) {
+		next = next_line(p, end, &n);
+		if (!next) {
+			return 0;
+		}
+		chunk = 0;
+		for (i = 0; i < n && (digit = hex_value(p[i])) >= 0; i++) {
+			if (chunk >> 60) {
+				return -413;
+			}
+			chunk = chunk * 16 + digit;
+		}
+		/* chunk extensions are ignored */
+		if (!i || (i < n && p[i] != ';' && p[i] != ' ' && p[i] != '\t')) {
+			return -400;
+		}
+		p = next;
+		if (!chunk) {
+			break;
+		}
+		if (chunk > max_body - total) {
+			return -413;
+		}
+
+		if ((size_t)(end - p) <= chunk) {
+			return 0;
+		}
+		if (p[chunk] == '\n') {
+			newline = 1;
+		} else if (p[chunk] != '\r') {
+			return -400;
+		} else if ((size_t)(end - p) <= chunk + 1) {
+			return 0;
+		} else if (p[chunk + 1] != '\n') {
+			return -400;
+		} else {
+			newline = 2;
+		}
+
+		if (dst) {
+			memmove(dst + total, p, chunk);
+		}
+		total += chunk;
+		p += chunk + newline;
+	}
+
+	/* trailer fields, up to an empty line */
+	do {
+		next = next_line(p, end, &n);
+		if (!next) {
+			return 0;
+		}
+		p = next;
+	} while (n);
+
+	*size = total;
+
+	return p - start;
+}
+
+ssize_t http_parse_request(char *buf, size_t len, size_t max_body,
+		struct http_request *req)
+{
+	char *p = buf, *end = buf + len, *next, *sp, *version;
+	unsigned long long length = 0;
+	bool post, chunked = false, has_length = false;
+	bool close = false, keep_alive = false, expect = false, msgpack = false;
+	size_t n, body_len;
+	ssize_t body;
+
+	/* nothing is told about an incomplete header block */
+	memset(req, 0, sizeof(*req));
+
+	/* empty lines in front of the request line are ignored */
+	while (p < end && (*p == '\r' || *p == '\n')) {
+		p++;
+	}
+
+	/* method SP target SP version */
+	next = next_line(p, end, &n);
+	if (!next) {
+		return 0;
+	}
+	sp = memchr(p, ' ', n);
+	version = memrchr(p, ' ', n);
+	if (!sp || sp == p || version == sp) {
+		return -400;
+	}
+	post = sp - p == 4 && !memcmp(p, "POST", 4);
+	version++;
+	n -= version - p;
+	if (n != 8 || memcmp(version, "HTTP/1.", 7)) {
+		return n > 5 && !memcmp(version, "HTTP/", 5) ? -505 : -400;
+	} else if (version[7] == '0') {
+		req->http10 = true;
+	} else if (version[7] == '1') {
+		req->http10 = false;
+	} else {
+		return -505;
+	}
+
+	for (p = next; ; p = next) {
+		const char *name = p, *value, *colon;
+		size_t value_len;
+
+		next = next_line(p, end, &n);
+		if (!next) {
+			return 0;
+		}
+		if (!n) {
+			break;
+		}
+		colon = memchr(p, ':', n);
+		if (!colon || colon == p) {
+			return -400;
+		}
+		value = colon + 1;
+		value_len = (p + n) - value;
+		trim(&value, &value_len);
+		n = colon - name;
+
+		if (token_eq(name, n, "Content-Length")) {
+			unsigned long long v = 0;
+			size_t i;
+
+			if (!value_len) {
+				return -400;
+			}
+			for (i = 0; i < value_len; i++) {
+				if (value[i] < '0' || value[i] > '9') {
+					return -400;
+				}
+				if (v > max_body || v > ULLONG_MAX / 10) {
+					return -413;
+				}
+				v = v * 10 + value[i] - '0';
+			}
+			if (has_length && v != length) {
+				return -400;
+			}
+			length = v;
+			has_length = true;
+		} else if (token_eq(name, n, "Transfer-Encoding")) {
+			if (!token_eq(value, value_len, "chunked")) {
+				return -501;
+			}
+			chunked = true;
+		} else if (token_eq(name, n, "Connection")) {
+			close |= has_token(value, value_len, "close");
+			keep_alive |= has_token(value, value_len, "keep-alive");
+		} else if (token_eq(name, n, "Content-Type")) {
+			msgpack = is_msgpack(value, value_len);
+		} else if (token_eq(name, n, "Expect")) {
+			expect = token_eq(value, value_len, "100-continue");
+		}
+	}
+	p = next;
+
+	if (!post) {
+		return -405;
+	}
+	/* a body with two lengths could be read differently by a proxy */
+	if (chunked && has_length) {
+		return -400;
+	}
+	if (length > max_body) {
+		return -413;
+	}
+	req->keep_alive = req->http10 ? keep_alive && !close : !close;
+	req->msgpack = msgpack;
+
+	if (chunked) {
+		body = chunked_body(p, end, max_body, NULL, &body_len);
+		if (body > 0) {
+			chunked_body(p, end, max_body, p, &body_len);
+		}
+	} else {
+		body_len = length;
+		body = (size_t)(end - p) >= length ? length : 0;
+	}
+	if (body < 0) {
+		return body;
+	} else if (!body && (chunked || length)) {
+		req->expect_continue = expect;
+		return 0;
+	}
+
+	req->body = p;
+	req->body_len = body_len;
+
+	return (p + body) - buf;
+}
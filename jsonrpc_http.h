@@ -0,0 +1,39 @@
+/*
+ * Internal interface of the HTTP/1.1 front end of the socket server.
+ *
+ * Only what JSON-RPC over HTTP needs is parsed: the request method, the
+ * body length, either from a Content-Length or a chunked body, whether the
+ * connection is kept open and whether the body is MessagePack. Everything
+ * else is skipped.
+ */
+
+#ifndef __JSONRPC_HTTP_H
+#define __JSONRPC_HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct http_request {
+	/* points into the parsed buffer, a chunked body is decoded in place */
+	char *body;
+	size_t body_len;
+	/* the connection stays open after the response */
+	bool keep_alive;
+	/* an HTTP/1.0 client needs to be told about the keep-alive */
+	bool http10;
+	/* the header block is complete and the client waits for 100 Continue */
+	bool expect_continue;
+	/* the body is MessagePack, as told by the Content-Type */
+	bool msgpack;
+};
+
+/*
+ * Parses the request at the start of buf. Returns the number of bytes it
+ * takes up, 0 if it is incomplete, or the negated HTTP status code to be
+ * sent before the connection is closed.
+ */
+ssize_t http_parse_request(char *buf, size_t len, size_t max_body,
+		struct http_request *req);
+
+#endif /* __JSONRPC_HTTP_H */
@@ -0,0 +1,533 @@
+/*
+ * MessagePack decoder and encoder for jansson values.
+ *
+ * Only the types with a JSON counterpart are supported: nil, booleans,
+ * integers, floats, strings, arrays and maps with string keys. Binary and
+ * extension types fail to decode. Strings have to be valid UTF-8 without
+ * NUL bytes, just like in JSON requests.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "jsonrpc.h"
+#include "jsonrpc_codec.h"
+#include "jsonrpc_msgpack.h"
+#include "jsonrpc_alloc.h"
+
+/* the same limit jansson uses */
+#define MAX_DEPTH 2048
+
+#define JSON_INT_MAX ((json_int_t)(((uint64_t)1 << (sizeof(json_int_t) * 8 - 1)) - 1))
+
+static void put(struct msgpack_writer *w, const void *data, size_t len)
+{
+	if (w->failed) {
+		return;
+	}
+	if (w->len + len > sizeof(w->buf)) {
+		msgpack_flush(w);
+	}
+	if (len >= sizeof(w->buf)) {
+		if (w->write(data, len, w->priv)) {
+			w->failed = -1;
+		}
+		return;
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+/* a type byte followed by n bytes of v, big endian */
+static void put_head(struct msgpack_writer *w, uint8_t type, uint64_t v,
+		int n)
+{
+	uint8_t buf[9];
+	int i;
+
+	buf[0] = type;
+	for (i = n; i > 0; i--) {
+		buf[i] = v;
+		v >>= 8;
+	}
+	put(w, buf, n + 1);
+}
+
+int msgpack_flush(struct msgpack_writer *w)
+{
+	if (!w->failed && w->len && w->write(w->buf, w->len, w->priv)) {
+		w->failed = -1;
+	}
+	w->len = 0;
+
+	return w->failed;
+}
+
+void msgpack_nil(struct msgpack_writer *w)
+{
+	put_head(w, 0xc0, 0, 0);
+}
+
+void msgpack_int(struct msgpack_writer *w, int64_t v)
+{
+	if (v >= 0 && v < 0x80) {
+		put_head(w, v, 0, 0);
+	} else if (v >= 0 && v <= UINT8_MAX) {
+		put_head(w, 0xcc, v, 1);
+	} else if (v >= 0 && v <= UINT16_MAX) {
+		put_head(w, 0xcd, v, 2);
+	} else if (v >= 0 && v <= UINT32_MAX) {
+		put_head(w, 0xce, v, 4);
+	} else if (v >= 0) {
+		put_head(w, 0xcf, v, 8);
+	} else if (v >= -32) {
+		put_head(w, (uint8_t)v, 0, 0);
+	} else if (v >= INT8_MIN) {
+		put_head(w, 0xd0, (uint8_t)v, 1);
+	} else if (v >= INT16_MIN) {
+		put_head(w, 0xd1, (uint16_t)v, 2);
+	} else if (v >= INT32_MIN) {
+		put_head(w, 0xd2, (uint32_t)v, 4);
+	} else {
+		put_head(w, 0xd3, (uint64_t)v, 8);
+	}
+}
+
+void msgpack_str(struct msgpack_writer *w, const char *str, size_t len)
+{
+	if (len < 32) {
+		put_head(w, 0xa0 | len, 0, 0);
+	} else if (len <= UINT8_MAX) {
+		put_head(w, 0xd9, len, 1);
+	} else if (len <= UINT16_MAX) {
+		put_head(w, 0xda, len, 2);
+	} else {
+		put_head(w, 0xdb, len, 4);
+	}
+	put(w, str, len);
+}
+
+void msgpack_array(struct msgpack_writer *w, size_t count)
+{
+	if (count < 16) {
+		put_head(w, 0x90 | count, 0, 0);
+	} else if (count <= UINT16_MAX) {
+		put_head(w, 0xdc, count, 2);
+	} else {
+		put_head(w, 0xdd, count, 4);
+	}
+}
+
+void msgpack_map(struct msgpack_writer *w, size_t count)
+{
+	if (count < 16) {
+		put_head(w, 0x80 | count, 0, 0);
+	} else if (count <= UINT16_MAX) {
+		put_head(w, 0xde, count, 2);
+	} else {
+		put_head(w, 0xdf, count, 4);
+	}
+}
+
+void msgpack_value(struct msgpack_writer *w, const json_t *value)
+{
+	union {
+		double d;
+		uint64_t u;
+	} real;
+	const char *key;
+	json_t *member;
+	size_t i;
+
+	switch (json_typeof(value)) {
+	case JSON_OBJECT:
+		msgpack_map(w, json_object_size(value));
+		json_object_foreach((json_t *)value, key, member) {
+			msgpack_str(w, key, strlen(key));
+			msgpack_value(w, member);
+		}
+		break;
+	case JSON_ARRAY:
+		msgpack_array(w, json_array_size(value));
+		for (i = 0; i < json_array_size(value); i++) {
+			msgpack_value(w, json_array_get(value, i));
+		}
+		break;
+	case JSON_STRING:
+		msgpack_str(w, json_string_value(value), json_string_length(value));
+		break;
+	case JSON_INTEGER:
+		msgpack_int(w, json_integer_value(value));
+		break;
+	case JSON_REAL:
+		real.d = json_real_value(value);
+		put_head(w, 0xcb, real.u, 8);
+		break;
+	case JSON_TRUE:
+		put_head(w, 0xc3, 0, 0);
+		break;
+	case JSON_FALSE:
+		put_head(w, 0xc2, 0, 0);
+		break;
+	case JSON_NULL:
+		msgpack_nil(w);
+		break;
+	}
+}
+
+int jsonrpc_msgpack_encode(const json_t *value, jsonrpc_write_t write,
+		void *priv)
+{
+	struct msgpack_writer w = {
+		.write = write,
+		.priv = priv,
+	};
+
+	msgpack_value(&w, value);
+
+	return msgpack_flush(&w);
+}
+
+struct reader {
+	const unsigned char *start;
+	const unsigned char *p;
+	const unsigned char *end;
+	json_error_t *error;
+	int depth;
+};
+
+static void *reader_error(struct reader *r, const char *msg)
+{
+	json_error_t *error = r->error;
+
+	if (!error || error->text[0]) {
+		return NULL;
+	}
+
+	error->line = -1;
+	error->column = -1;
+	error->position = r->p - r->start;
+	snprintf(error->source, sizeof(error->source), "<buffer>");
+	snprintf(error->text, sizeof(error->text), "%s at byte %zu", msg,
+			(size_t)(r->p - r->start));
+
+	return NULL;
+}
+
+/* reads an n byte big endian number */
+static int read_uint(struct reader *r, int n, uint64_t *v)
+{
+	int i;
+
+	if (r->end - r->p < n) {
+		reader_error(r, "unexpected end of input");
+		return -1;
+	}
+	*v = 0;
+	for (i = 0; i < n; i++) {
+		*v = (*v << 8) | *r->p++;
+	}
+
+	return 0;
+}
+
+/* the length of a string, array or map, n bytes of it after the type */
+static int read_count(struct reader *r, int n, size_t *count)
+{
+	uint64_t v;
+
+	if (read_uint(r, n, &v)) {
+		return -1;
+	}
+	/* every item takes at least one byte */
+	if (v > (uint64_t)(r->end - r->p)) {
+		reader_error(r, "unexpected end of input");
+		return -1;
+	}
+	*count = v;
+
+	return 0;
+}
+
+/* returns the start of a string of len bytes, which is also checked */
+static const char *read_str(struct reader *r, size_t len)
+{
+	const unsigned char *p = r->p, *end = r->p + len;
+	size_t n;
+
+	if (len > (size_t)(r->end - r->p)) {
+		reader_error(r, "unexpected end of input");
+		return NULL;
+	}
+	while (p < end) {
+		n = *p ? jsonrpc_utf8_check(p, end) : 0;
+		if (!n) {
+			r->p = p;
+			reader_error(r, *p ? "invalid UTF-8 in string" :
+					"NUL byte in string not supported");
+			return NULL;
+		}
+		p += n;
+	}
+	p = r->p;
+	r->p = end;
+
+	return (const char *)p;
+}
+
+/* the length of a string which starts at the current byte */
+static int read_str_len(struct reader *r, size_t *len)
+{
+	uint8_t type;
+
+	if (r->p == r->end) {
+		reader_error(r, "unexpected end of input");
+		return -1;
+	}
+	type = *r->p++;
+	if ((type & 0xe0) == 0xa0) {
+		*len = type & 0x1f;
+		return 0;
+	} else if (type >= 0xd9 && type <= 0xdb) {
+		return read_count(r, 1 << (type - 0xd9), len);
+	}
+	r->p--;
+	reader_error(r, "object key must be a string");
+
+	return -1;
+}
+
+static json_t *read_value(struct reader *r);
+
+static json_t *read_array(struct reader *r, size_t count)
+{
+	json_t *array = json_array(), *value;
+	size_t i;
+
+	if (!array) {
+		return reader_error(r, "out of memory");
+	}
+	for (i = 0; i < count; i++) {
+		value = read_value(r);
+		if (!value) {
+			json_decref(array);
+			return NULL;
+		}
+		if (json_array_append_new(array, value)) {
+			json_decref(array);
+			return reader_error(r, "out of memory");
+		}
+	}
+
+	return array;
+}
+
+static json_t *read_map(struct reader *r, size_t count)
+{
+	json_t *object = json_object(), *value;
+	char tmp[64], *key = NULL;
+	const char *str;
+	size_t i, len;
+
+	if (!object) {
+		return reader_error(r, "out of memory");
+	}
+	for (i = 0; i < count; i++) {
+		if (read_str_len(r, &len)) {
+			goto error;
+		}
+		str = read_str(r, len);
+		if (!str) {
+			goto error;
+		}
+
+		key = len < sizeof(tmp) ? tmp : malloc(len + 1);
+		if (!key) {
+			reader_error(r, "out of memory");
+			goto error;
+		}
+		memcpy(key, str, len);
+		key[len] = '\0';
+
+		value = read_value(r);
+		if (!value) {
+			goto error;
+		}
+		if (json_object_set_new_nocheck(object, key, value)) {
+			reader_error(r, "out of memory");
+			goto error;
+		}
+		if (key != tmp) {
+			free(key);
+		}
+		key = NULL;
+	}
+
+	return object;
+
+error:
+	if (key != tmp) {
+		free(key);
+	}
+	json_decref(object);
+	return NULL;
+}
+
+static json_t *read_container(struct reader *r, bool map, size_t count)
+{
+	json_t *value;
+
+	if (++r->depth > MAX_DEPTH) {
+		return reader_error(r, "maximum parsing depth reached");
+	}
+	value = map ? read_map(r, count) : read_array(r, count);
+	r->depth--;
+
+	return value;
+}
+
+static json_t *read_number(struct reader *r, uint8_t type)
+{
+	union {
+		float f;
+		uint32_t u;
+	} f32;
+	union {
+		double d;
+		uint64_t u;
+	} f64;
+	json_t *value;
+	uint64_t v;
+
+	if (type == 0xca) {
+		if (read_uint(r, 4, &v)) {
+			return NULL;
+		}
+		f32.u = v;
+		f64.d = f32.f;
+	} else if (type == 0xcb) {
+		if (read_uint(r, 8, &f64.u)) {
+			return NULL;
+		}
+	} else if (type <= 0xcf) {
+		if (read_uint(r, 1 << (type - 0xcc), &v)) {
+			return NULL;
+		}
+		if (v > (uint64_t)JSON_INT_MAX) {
+			/* only a uint64 can be that large, point at its type */
+			r->p -= 9;
+			return reader_error(r, "too big integer");
+		}
+		return json_integer(v);
+	} else {
+		int n = 1 << (type - 0xd0);
+
+		if (read_uint(r, n, &v)) {
+			return NULL;
+		}
+		/* sign extension */
+		if (n < 8 && (v >> (n * 8 - 1))) {
+			v |= ~(uint64_t)0 << (n * 8);
+		}
+		return json_integer((int64_t)v);
+	}
+
+	/* jansson has no value for NaN and the infinities */
+	value = json_real(f64.d);
+
+	return value ? value : reader_error(r, "real number overflow");
+}
+
+static json_t *read_value(struct reader *r)
+{
+	const char *str;
+	json_t *value;
+	size_t len;
+	uint8_t type;
+
+	if (r->p == r->end) {
+		return reader_error(r, "unexpected end of input");
+	}
+	type = *r->p++;
+
+	if (type < 0x80) {
+		return json_integer(type);
+	} else if (type >= 0xe0) {
+		return json_integer((int8_t)type);
+	} else if (type < 0x90) {
+		return read_container(r, true, type & 0x0f);
+	} else if (type < 0xa0) {
+		return read_container(r, false, type & 0x0f);
+	}
+
+	switch (type) {
+	case 0xc0:
+		return json_null();
+	case 0xc2:
+		return json_false();
+	case 0xc3:
+		return json_true();
+	case 0xca ... 0xd3:
+		return read_number(r, type);
+	case 0xa0 ... 0xbf:
+	case 0xd9 ... 0xdb:
+		r->p--;
+		if (read_str_len(r, &len)) {
+			return NULL;
+		}
+		str = read_str(r, len);
+		if (!str) {
+			return NULL;
+		}
+		value = json_stringn_nocheck(str, len);
+		return value ? value : reader_error(r, "out of memory");
+	case 0xdc:
+	case 0xdd:
+		if (read_count(r, type == 0xdc ? 2 : 4, &len)) {
+			return NULL;
+		}
+		return read_container(r, false, len);
+	case 0xde:
+	case 0xdf:
+		if (read_count(r, type == 0xde ? 2 : 4, &len)) {
+			return NULL;
+		}
+		return read_container(r, true, len);
+	}
+
+	r->p--;
+
+	return reader_error(r, "unsupported type");
+}
+
+json_t *jsonrpc_msgpack_decode(const char *buf, size_t len,
+		json_error_t *error)
+{
+	struct reader r = {
+		.start = (const unsigned char *)buf,
+		.p = (const unsigned char *)buf,
+		.end = (const unsigned char *)buf + len,
+		.error = error,
+	};
+	json_t *value;
+
+	if (error) {
+		memset(error, 0, sizeof(*error));
+	}
+
+	value = read_value(&r);
+	if (value && r.p != r.end) {
+		reader_error(&r, "end of input expected");
+		json_decref(value);
+		return NULL;
+	}
+
+	return value;
+}
@@ -0,0 +1,33 @@
+/*
+ * Internal interface of the MessagePack encoder.
+ *
+ * Values are written through a small buffer, so that the many short items
+ * of a message don't each end up in a call of the write callback. The
+ * writer has to be flushed at the end.
+ */
+
+#ifndef __JSONRPC_MSGPACK_H
+#define __JSONRPC_MSGPACK_H
+
+#include <stdint.h>
+#include <jansson.h>
+#include "jsonrpc.h"
+
+struct msgpack_writer {
+	jsonrpc_write_t write;
+	void *priv;
+	int failed;
+	size_t len;
+	char buf[256];
+};
+
+void msgpack_nil(struct msgpack_writer *w);
+void msgpack_int(struct msgpack_writer *w, int64_t v);
+void msgpack_str(struct msgpack_writer *w, const char *str, size_t len);
+void msgpack_array(struct msgpack_writer *w, size_t count);
+void msgpack_map(struct msgpack_writer *w, size_t count);
+void msgpack_value(struct msgpack_writer *w, const json_t *value);
+/* returns -1 if anything couldn't be written */
+int msgpack_flush(struct msgpack_writer *w);
+
+#endif /* __JSONRPC_MSGPACK_H */
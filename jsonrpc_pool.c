@@ -0,0 +1,175 @@
+/*
+ * Thread pool executor for batch requests.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#include "jsonrpc.h"
+#include "jsonrpc_alloc.h"
+
+struct pool_job {
+	jsonrpc_task_t task;
+	void *arg;
+	size_t count;
+	/* the next task to hand out and the number of finished tasks */
+	size_t next;
+	size_t done;
+	struct pool_job *next_job;
+};
+
+struct jsonrpc_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	/* jobs which still have tasks to hand out, oldest first */
+	struct pool_job *jobs;
+	bool shutdown;
+	unsigned int nthreads;
+	pthread_t threads[];
+};
+
+/* called with the lock held, returns false if there is nothing left */
+static bool pool_claim(struct jsonrpc_pool *pool, struct pool_job *job,
+		size_t *index)
+{
+	struct pool_job **walk;
+
+	if (job->next == job->count) {
+		return false;
+	}
+
+	*index = job->next++;
+	if (job->next == job->count) {
+		for (walk = &pool->jobs; *walk != job; walk = &(*walk)->next_job)
+			;
+		*walk = job->next_job;
+	}
+
+	return true;
+}
+
+/* called with the lock held */
+static void pool_run(struct jsonrpc_pool *pool, struct pool_job *job,
+		size_t index)
+{
+	pthread_mutex_unlock(&pool->lock);
+	job->task(job->arg, index);
+	pthread_mutex_lock(&pool->lock);
+
+	if (++job->done == job->count) {
+		pthread_cond_broadcast(&pool->done);
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	struct jsonrpc_pool *pool = arg;
+	struct pool_job *job;
+	size_t index;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->jobs && !pool->shutdown) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (!pool->jobs) {
+			break;
+		}
+
+		job = pool->jobs;
+		if (pool_claim(pool, job, &index)) {
+			pool_run(pool, job, index);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+jsonrpc_pool_t *jsonrpc_pool_create(unsigned int threads)
+{
+	struct jsonrpc_pool *pool;
+
+	pool = calloc(1, sizeof(*pool) + threads * sizeof(pool->threads[0]));
+	if (!pool) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (pool->nthreads = 0; pool->nthreads < threads; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+					pool_worker, pool)) {
+			jsonrpc_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void jsonrpc_pool_destroy(jsonrpc_pool_t *pool)
+{
+	unsigned int i;
+
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/*
+ * Queue the tasks and help running them on the calling thread, so a batch
+ * makes progress even if all workers are busy.
+ */
+void jsonrpc_pool_execute(void *priv, jsonrpc_task_t task, void *arg,
+		size_t count)
+{
+	struct jsonrpc_pool *pool = priv;
+	struct pool_job job = {
+		.task = task,
+		.arg = arg,
+		.count = count,
+	};
+	struct pool_job **walk;
+	size_t index;
+
+	if (!count) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (walk = &pool->jobs; *walk; walk = &(*walk)->next_job)
+		;
+	*walk = &job;
+	pthread_cond_broadcast(&pool->work);
+
+	while (pool_claim(pool, &job, &index)) {
+		pool_run(pool, &job, index);
+	}
+	while (job.done != job.count) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
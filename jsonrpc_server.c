@@ -0,0 +1,953 @@
+/*
+ * Non-blocking socket server with one epoll event loop per thread.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <jansson.h>
+
+#include "jsonrpc.h"
+#include "jsonrpc_server.h"
+#include "jsonrpc_http.h"
+#include "jsonrpc_alloc.h"
+
+#define CONTENT_LENGTH "Content-Length:"
+#define DEFAULT_MAX_MESSAGE (16 * 1024 * 1024)
+#define DEFAULT_IDLE_TIMEOUT 60000
+#define READ_SIZE (64 * 1024)
+/* stop reading from a connection while this much output is pending */
+#define OUT_HIGH_WATER (1024 * 1024)
+#define FLUSH_IOV 64
+#define MAX_EVENTS 64
+
+/* the constant parts of the HTTP responses */
+#define HTTP_OK "HTTP/1.1 200 OK\r\nContent-Type: "
+#define HTTP_NO_CONTENT "HTTP/1.1 204 No Content\r\n"
+#define HTTP_CLOSE "Connection: close\r\n"
+#define HTTP_KEEP_ALIVE "Connection: keep-alive\r\n"
+#define HTTP_ERROR(status) \
+	"HTTP/1.1 " status "\r\n" HTTP_CLOSE "Content-Length: 0\r\n\r\n"
+
+enum {
+	HTTP_PERSISTENT,
+	HTTP_LAST,
+	/* persistent HTTP/1.0 connection */
+	HTTP_PERSISTENT_10,
+};
+
+/* the headers following the Content-Type of a 200 OK */
+static const char *const http_ok[] = {
+	[HTTP_PERSISTENT] = "",
+	[HTTP_LAST] = HTTP_CLOSE,
+	[HTTP_PERSISTENT_10] = HTTP_KEEP_ALIVE,
+};
+
+static const char *const http_no_content[] = {
+	[HTTP_PERSISTENT] = HTTP_NO_CONTENT "\r\n",
+	[HTTP_LAST] = HTTP_NO_CONTENT HTTP_CLOSE "\r\n",
+	[HTTP_PERSISTENT_10] = HTTP_NO_CONTENT HTTP_KEEP_ALIVE "\r\n",
+};
+
+static const char http_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* a response, with its framing */
+struct out_msg {
+	struct out_msg *next;
+	jsonrpc_iov_t *iov;
+	const struct iovec *vec;
+	int count;
+	char header[128];
+	size_t header_len;
+	const char *trailer;
+	size_t trailer_len;
+	size_t len;
+};
+
+struct conn {
+	enum {
+		CONN_LISTEN,
+		CONN_STOP,
+		CONN_CLIENT,
+	} kind;
+	int fd;
+	/* connections of the loop, the most recently active first */
+	struct conn *prev;
+	struct conn *next;
+	/* time of the last event, in ms */
+	uint64_t active;
+	char *in;
+	size_t in_len;
+	size_t in_size;
+	struct out_msg *out;
+	struct out_msg **out_tail;
+	/* bytes of the first message which already went out */
+	size_t out_off;
+	size_t out_bytes;
+	uint32_t events;
+	bool eof;
+	/* no more requests are handled, the connection closes once flushed */
+	bool closing;
+	bool shut;
+	/* a 100 Continue was sent for the pending HTTP request */
+	bool continued;
+};
+
+struct worker {
+	struct jsonrpc_server *server;
+	pthread_t thread;
+	int epfd;
+	struct conn listen;
+	struct conn stop;
+	struct conn *conns;
+	struct conn *oldest;
+	int ret;
+};
+
+struct jsonrpc_server {
+	jsonrpc_ctx_t *ctx;
+	jsonrpc_framing_t framing;
+	size_t max_message;
+	unsigned int idle_timeout;
+	int stop_fd;
+	unsigned int nworkers;
+	struct worker workers[];
+};
+
+static int parse_address(const char *address, struct sockaddr_storage *ss,
+		socklen_t *len)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE | AI_NUMERICSERV,
+	};
+	struct addrinfo *res;
+	char *host, *port;
+	int rc;
+
+	if (!strncmp(address, "unix:", 5)) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+
+		if (strlen(address + 5) >= sizeof(sun->sun_path)) {
+			return -1;
+		}
+		memset(sun, 0, sizeof(*sun));
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, address + 5);
+		*len = sizeof(*sun);
+		return 0;
+	}
+
+	host = strdup(address);
+	if (!host) {
+		return -1;
+	}
+	port = strrchr(host, ':');
+	if (!port) {
+		free(host);
+		return -1;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	rc = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	free(host);
+	if (rc) {
+		return -1;
+	}
+	memcpy(ss, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+static int open_listener(struct sockaddr_storage *ss, socklen_t len)
+{
+	int fd, on = 1;
+
+	fd = socket(ss->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ss->ss_family != AF_UNIX &&
+			(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+			 setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))) {
+		close(fd);
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)ss, len) || listen(fd, SOMAXCONN)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void conn_unlink(struct worker *w, struct conn *c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		w->conns = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	} else {
+		w->oldest = c->prev;
+	}
+}
+
+static void conn_link(struct worker *w, struct conn *c, uint64_t now)
+{
+	c->active = now;
+	c->prev = NULL;
+	c->next = w->conns;
+	if (c->next) {
+		c->next->prev = c;
+	} else {
+		w->oldest = c;
+	}
+	w->conns = c;
+}
+
+/* keeps the list ordered, so the idle connections are at its end */
+static void conn_touch(struct worker *w, struct conn *c, uint64_t now)
+{
+	if (w->conns == c) {
+		c->active = now;
+		return;
+	}
+	conn_unlink(w, c);
+	conn_link(w, c, now);
+}
+
+static void conn_close(struct worker *w, struct conn *c)
+{
+	struct out_msg *msg, *next;
+
+	conn_unlink(w, c);
+
+	for (msg = c->out; msg; msg = next) {
+		next = msg->next;
+		jsonrpc_iov_free(msg->iov);
+		free(msg);
+	}
+	close(c->fd);
+	free(c->in);
+	free(c);
+}
+
+static void conn_queue(struct conn *c, struct out_msg *msg, size_t body)
+{
+	msg->len = msg->header_len + body + msg->trailer_len;
+
+	*c->out_tail = msg;
+	c->out_tail = &msg->next;
+	c->out_bytes += msg->len;
+}
+
+/* queues a constant message, like an HTTP error */
+static int conn_send(struct conn *c, const char *data)
+{
+	struct out_msg *msg;
+
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		return -1;
+	}
+	msg->trailer = data;
+	msg->trailer_len = strlen(data);
+	conn_queue(c, msg, 0);
+
+	return 0;
+}
+
+/*
+ * http is one of HTTP_PERSISTENT and friends, ignored by the other framings,
+ * just like msgpack, which selects MessagePack instead of JSON.
+ */
+static int conn_respond(struct worker *w, struct conn *c, const char *buf,
+		size_t len, int http, bool msgpack)
+{
+	struct jsonrpc_server *server = w->server;
+	struct out_msg *msg;
+	size_t body = 0;
+	int i, rc;
+
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		return -1;
+	}
+	if (msgpack) {
+		rc = jsonrpc_ctx_handle_request_msgpack_iov(server->ctx, buf, len,
+				&msg->iov);
+	} else {
+		rc = jsonrpc_ctx_handle_request_iov(server->ctx, buf, len,
+				&msg->iov);
+	}
+	if (rc && server->framing == JSONRPC_FRAMING_HTTP) {
+		/* the response is lost, which the client has to learn */
+		free(msg);
+		c->closing = true;
+		return conn_send(c, HTTP_ERROR("500 Internal Server Error"));
+	} else if (rc) {
+		/* a stream can't tell which response is missing */
+		free(msg);
+		return -1;
+	} else if (!msg->iov && server->framing == JSONRPC_FRAMING_HTTP) {
+		/* HTTP answers notifications without a body */
+		free(msg);
+		return conn_send(c, http_no_content[http]);
+	} else if (!msg->iov) {
+		/* notifications don't get a response */
+		free(msg);
+		return 0;
+	}
+	msg->vec = jsonrpc_iov_get(msg->iov, &msg->count);
+	for (i = 0; i < msg->count; i++) {
+		body += msg->vec[i].iov_len;
+	}
+
+	switch (server->framing) {
+	case JSONRPC_FRAMING_NEWLINE:
+		msg->trailer = "\n";
+		msg->trailer_len = 1;
+		break;
+	case JSONRPC_FRAMING_CONTENT_LENGTH:
+		msg->header_len = snprintf(msg->header, sizeof(msg->header),
+				CONTENT_LENGTH " %zu\r\n\r\n", body);
+		break;
+	case JSONRPC_FRAMING_HTTP:
+		msg->header_len = snprintf(msg->header, sizeof(msg->header),
+				HTTP_OK "%s\r\n%s" CONTENT_LENGTH " %zu\r\n\r\n",
+				msgpack ? "application/msgpack" : "application/json",
+				http_ok[http], body);
+		break;
+	}
+	conn_queue(c, msg, body);
+
+	return 0;
+}
+
+static bool is_blank(const char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != ' ' && p[i] != '\t' && p[i] != '\r' && p[i] != '\n') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Newline-delimited messages. Blank lines are skipped, and a last line
+ * without a newline counts once the peer has closed its side.
+ */
+static ssize_t parse_newline(struct worker *w, struct conn *c,
+		const char *p, size_t len)
+{
+	const char *nl;
+	size_t n;
+
+	nl = memchr(p, '\n', len);
+	if (!nl && !c->eof) {
+		return 0;
+	}
+	n = nl ? (size_t)(nl - p) + 1 : len;
+
+	if (!is_blank(p, n) && conn_respond(w, c, p, n, 0, false)) {
+		return -1;
+	}
+
+	return n;
+}
+
+/* a header block with a Content-Length, and the body */
+static ssize_t parse_content_length(struct worker *w, struct conn *c,
+		const char *p, size_t len)
+{
+	const char *line = p, *end = p + len, *nl;
+	unsigned long long body = 0;
+	bool found = false, started = false;
+
+	while ((nl = memchr(line, '\n', end - line))) {
+		size_t n = nl - line;
+		char *num_end;
+
+		if (n && line[n - 1] == '\r') {
+			n--;
+		}
+		if (!n) {
+			line = nl + 1;
+			if (!started) {
+				continue;
+			}
+			if (!found) {
+				return -1;
+			}
+			if (body > (size_t)(end - line)) {
+				return 0;
+			}
+			if (conn_respond(w, c, line, body, 0, false)) {
+				return -1;
+			}
+			return (line + body) - p;
+		}
+		started = true;
+
+		if (n > strlen(CONTENT_LENGTH) &&
+				!strncasecmp(line, CONTENT_LENGTH, strlen(CONTENT_LENGTH))) {
+			body = strtoull(line + strlen(CONTENT_LENGTH), &num_end, 10);
+			if (num_end == line + strlen(CONTENT_LENGTH) ||
+					num_end != line + n ||
+					body > w->server->max_message) {
+				return -1;
+			}
+			found = true;
+		}
+		line = nl + 1;
+	}
+
+	/* blank lines in front of the headers are consumed */
+	return started ? 0 : line - p;
+}
+
+static const char *http_error(ssize_t status)
+{
+	switch (status) {
+	case 405:
+		return "HTTP/1.1 405 Method Not Allowed\r\nAllow: POST\r\n"
+			HTTP_CLOSE "Content-Length: 0\r\n\r\n";
+	case 413:
+		return HTTP_ERROR("413 Content Too Large");
+	case 501:
+		return HTTP_ERROR("501 Not Implemented");
+	case 505:
+		return HTTP_ERROR("505 HTTP Version Not Supported");
+	}
+
+	return HTTP_ERROR("400 Bad Request");
+}
+
+/*
+ * One HTTP request. The body is handled right from the input buffer, and
+ * errors are answered before the connection is closed.
+ */
+static ssize_t parse_http(struct worker *w, struct conn *c, char *p,
+		size_t len)
+{
+	struct http_request req;
+	ssize_t n;
+	int http;
+
+	n = http_parse_request(p, len, w->server->max_message, &req);
+	if (n < 0) {
+		c->closing = true;
+		return conn_send(c, http_error(-n)) ? -1 : len;
+	} else if (!n) {
+		if (req.expect_continue && !c->continued) {
+			c->continued = true;
+			return conn_send(c, http_continue);
+		}
+		return 0;
+	}
+	c->continued = false;
+
+	if (!req.keep_alive) {
+		http = HTTP_LAST;
+		c->closing = true;
+	} else {
+		http = req.http10 ? HTTP_PERSISTENT_10 : HTTP_PERSISTENT;
+	}
+	if (conn_respond(w, c, req.body, req.body_len, http, req.msgpack)) {
+		return -1;
+	}
+
+	return n;
+}
+
+/* returns -1 if the connection has to be closed */
+static int conn_parse(struct worker *w, struct conn *c)
+{
+	size_t start = 0;
+	ssize_t n;
+
+	while (start < c->in_len && !c->closing) {
+		switch (w->server->framing) {
+		case JSONRPC_FRAMING_CONTENT_LENGTH:
+			n = parse_content_length(w, c, c->in + start, c->in_len - start);
+			break;
+		case JSONRPC_FRAMING_HTTP:
+			n = parse_http(w, c, c->in + start, c->in_len - start);
+			break;
+		default:
+			n = parse_newline(w, c, c->in + start, c->in_len - start);
+			break;
+		}
+		if (n < 0) {
+			return -1;
+		} else if (!n) {
+			break;
+		}
+		start += n;
+	}
+
+	c->in_len -= start;
+	memmove(c->in, c->in + start, c->in_len);
+	if (c->in_len > w->server->max_message) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int conn_read(struct worker *w, struct conn *c)
+{
+	ssize_t n;
+
+	/* whatever comes after the last request is dropped */
+	if (c->closing) {
+		c->in_len = 0;
+	}
+
+	if (c->in_size - c->in_len < READ_SIZE) {
+		size_t size = c->in_size ? c->in_size * 2 : READ_SIZE;
+		char *in;
+
+		while (size - c->in_len < READ_SIZE) {
+			size *= 2;
+		}
+		in = realloc(c->in, size);
+		if (!in) {
+			return -1;
+		}
+		c->in = in;
+		c->in_size = size;
+	}
+
+	do {
+		n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return errno == EAGAIN ? 0 : -1;
+	}
+	if (!n) {
+		c->eof = true;
+	}
+	c->in_len += n;
+
+	return conn_parse(w, c);
+}
+
+static int vec_add(struct iovec *vec, int n, const void *base, size_t len,
+		size_t *skip)
+{
+	if (*skip >= len) {
+		*skip -= len;
+		return n;
+	}
+	vec[n].iov_base = (char *)base + *skip;
+	vec[n].iov_len = len - *skip;
+	*skip = 0;
+
+	return n + 1;
+}
+
+static void conn_consume(struct conn *c, size_t written)
+{
+	struct out_msg *msg;
+
+	c->out_bytes -= written;
+	while (written) {
+		msg = c->out;
+		if (written < msg->len - c->out_off) {
+			c->out_off += written;
+			return;
+		}
+		written -= msg->len - c->out_off;
+		c->out_off = 0;
+		c->out = msg->next;
+		if (!c->out) {
+			c->out_tail = &c->out;
+		}
+		jsonrpc_iov_free(msg->iov);
+		free(msg);
+	}
+}
+
+/* writes as much as the socket takes, with as few syscalls as possible */
+static int conn_flush(struct conn *c)
+{
+	struct iovec vec[FLUSH_IOV];
+	struct out_msg *msg;
+	size_t skip, total;
+	ssize_t written;
+	int n, i;
+
+	while (c->out) {
+		n = 0;
+		skip = c->out_off;
+		for (msg = c->out; msg && n < FLUSH_IOV; msg = msg->next) {
+			if (msg->header_len) {
+				n = vec_add(vec, n, msg->header, msg->header_len, &skip);
+			}
+			for (i = 0; i < msg->count && n < FLUSH_IOV; i++) {
+				n = vec_add(vec, n, msg->vec[i].iov_base,
+						msg->vec[i].iov_len, &skip);
+			}
+			if (msg->trailer_len && n < FLUSH_IOV) {
+				n = vec_add(vec, n, msg->trailer, msg->trailer_len, &skip);
+			}
+		}
+
+		total = 0;
+		for (i = 0; i < n; i++) {
+			total += vec[i].iov_len;
+		}
+
+		do {
+			written = writev(c->fd, vec, n);
+		} while (written < 0 && errno == EINTR);
+		if (written < 0) {
+			return errno == EAGAIN ? 0 : -1;
+		}
+		conn_consume(c, written);
+		if ((size_t)written < total) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/* returns -1 if the connection is done */
+static int conn_update(struct worker *w, struct conn *c)
+{
+	struct epoll_event ev = { .data.ptr = c };
+	uint32_t events = 0;
+
+	if (!c->eof && !c->closing && c->out_bytes < OUT_HIGH_WATER) {
+		events |= EPOLLIN;
+	} else if (!c->eof && c->closing && !c->out) {
+		/*
+		 * Closing with unread input would reset the connection, maybe
+		 * before the peer got the last response. Wait for its end.
+		 */
+		if (!c->shut && shutdown(c->fd, SHUT_WR)) {
+			return -1;
+		}
+		c->shut = true;
+		events |= EPOLLIN;
+	}
+	if (c->out) {
+		events |= EPOLLOUT;
+	}
+	if (!events) {
+		return -1;
+	}
+	if (events != c->events) {
+		ev.events = events;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+			return -1;
+		}
+		c->events = events;
+	}
+
+	return 0;
+}
+
+static void conn_event(struct worker *w, struct conn *c, uint32_t events,
+		uint64_t now)
+{
+	int rc = 0;
+
+	conn_touch(w, c, now);
+	if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+		rc = -1;
+	}
+	if (!rc && (events & EPOLLIN)) {
+		rc = conn_read(w, c);
+	}
+	if (!rc && c->out) {
+		rc = conn_flush(c);
+	}
+	if (rc || conn_update(w, c)) {
+		conn_close(w, c);
+	}
+}
+
+static void worker_accept(struct worker *w, uint64_t now)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct conn *c;
+	int fd, on = 1;
+
+	while ((fd = accept4(w->listen.fd, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->kind = CONN_CLIENT;
+		c->fd = fd;
+		c->out_tail = &c->out;
+		c->events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		conn_link(w, c, now);
+	}
+}
+
+/* closes the idle connections, returns the ms until the next one is due */
+static int worker_expire(struct worker *w, uint64_t now)
+{
+	unsigned int timeout = w->server->idle_timeout;
+
+	while (w->oldest && now - w->oldest->active >= timeout) {
+		conn_close(w, w->oldest);
+	}
+
+	return w->oldest ? (int)(w->oldest->active + timeout - now) : -1;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct conn *c;
+	bool stop = false;
+	uint64_t now;
+	int i, n, timeout = -1;
+
+	while (!stop) {
+		n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			w->ret = -1;
+			break;
+		}
+
+		now = now_ms();
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (c->kind == CONN_STOP) {
+				stop = true;
+			} else if (c->kind == CONN_LISTEN) {
+				worker_accept(w, now);
+			} else {
+				conn_event(w, c, events[i].events, now);
+			}
+		}
+		timeout = worker_expire(w, now);
+	}
+
+	while (w->conns) {
+		conn_close(w, w->conns);
+	}
+
+	return NULL;
+}
+
+static int worker_init(struct jsonrpc_server *server, struct worker *w,
+		int listen_fd, bool shared)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	w->server = server;
+	w->listen.kind = CONN_LISTEN;
+	w->listen.fd = listen_fd;
+	w->stop.kind = CONN_STOP;
+	w->stop.fd = server->stop_fd;
+
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd < 0) {
+		return -1;
+	}
+
+	/* only one of the loops is woken up for a shared listener */
+	ev.events = shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+	ev.data.ptr = &w->listen;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+		return -1;
+	}
+
+	/* never read, so it wakes every loop */
+	ev.events = EPOLLIN;
+	ev.data.ptr = &w->stop;
+
+	return epoll_ctl(w->epfd, EPOLL_CTL_ADD, server->stop_fd, &ev);
+}
+
+jsonrpc_server_t *jsonrpc_server_create(jsonrpc_ctx_t *ctx,
+		const struct jsonrpc_server_config *config)
+{
+	struct jsonrpc_server *server;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	unsigned int i, threads = config->threads;
+	bool shared;
+	int fd = -1;
+
+	if (parse_address(config->address, &ss, &len)) {
+		return NULL;
+	}
+	if (!threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	shared = ss.ss_family == AF_UNIX;
+
+	server = calloc(1, sizeof(*server) + threads * sizeof(server->workers[0]));
+	if (!server) {
+		return NULL;
+	}
+	server->ctx = ctx;
+	server->framing = config->framing;
+	server->max_message = config->max_message ? config->max_message :
+		DEFAULT_MAX_MESSAGE;
+	server->idle_timeout = config->idle_timeout ? config->idle_timeout :
+		DEFAULT_IDLE_TIMEOUT;
+	for (i = 0; i < threads; i++) {
+		server->workers[i].epfd = -1;
+		server->workers[i].listen.fd = -1;
+	}
+
+	server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (server->stop_fd < 0) {
+		goto error;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (!shared || !i) {
+			fd = open_listener(&ss, len);
+			if (fd < 0) {
+				goto error;
+			}
+		}
+		/* the first listener may have picked the port */
+		if (!i && !shared && getsockname(fd, (struct sockaddr *)&ss, &len)) {
+			close(fd);
+			goto error;
+		}
+		server->nworkers++;
+		if (worker_init(server, &server->workers[i], fd, shared)) {
+			goto error;
+		}
+	}
+
+	return server;
+
+error:
+	jsonrpc_server_destroy(server);
+	return NULL;
+}
+
+int jsonrpc_server_run(jsonrpc_server_t *server)
+{
+	unsigned int i, started;
+	int ret = 0;
+
+	/* the calling thread runs the first loop */
+	for (started = 1; started < server->nworkers; started++) {
+		struct worker *w = &server->workers[started];
+
+		if (pthread_create(&w->thread, NULL, worker_run, w)) {
+			jsonrpc_server_stop(server);
+			break;
+		}
+	}
+	worker_run(&server->workers[0]);
+
+	for (i = 0; i < started; i++) {
+		struct worker *w = &server->workers[i];
+
+		if (i) {
+			pthread_join(w->thread, NULL);
+		}
+		if (w->ret) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+void jsonrpc_server_stop(jsonrpc_server_t *server)
+{
+	uint64_t one = 1;
+
+	if (write(server->stop_fd, &one, sizeof(one)) < 0) {
+		/* the counter is set already */
+	}
+}
+
+void jsonrpc_server_destroy(jsonrpc_server_t *server)
+{
+	unsigned int i;
+
+	if (!server) {
+		return;
+	}
+
+	for (i = 0; i < server->nworkers; i++) {
+		struct worker *w = &server->workers[i];
+
+		if (w->epfd >= 0) {
+			close(w->epfd);
+		}
+		/* a shared listener belongs to the first loop */
+		if (w->listen.fd >= 0 && (!i || w->listen.fd !=
+					server->workers[0].listen.fd)) {
+			close(w->listen.fd);
+		}
+	}
+	if (server->stop_fd >= 0) {
+		close(server->stop_fd);
+	}
+	free(server);
+}
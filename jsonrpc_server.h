@@ -0,0 +1,52 @@
+/*
+ * Optional socket server, built as libjsonrpc_server.a.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef __JSONRPC_SERVER_H
+#define __JSONRPC_SERVER_H
+
+typedef struct jsonrpc_server jsonrpc_server_t;
+
+struct jsonrpc_server_config {
+	/* "unix:/path/to/socket", or "host:port" for TCP ("[::1]:port") */
+	const char *address;
+	/* number of event loops, 0 for one per online CPU */
+	unsigned int threads;
+	jsonrpc_framing_t framing;
+	/* connections sending larger messages are closed, 0 for 16 MiB */
+	size_t max_message;
+	/* connections idle for this long are closed, in ms, 0 for 60 s */
+	unsigned int idle_timeout;
+};
+
+/*
+ * Every event loop runs on a thread of its own and serves any number of
+ * connections. TCP listeners are opened once per loop with SO_REUSEPORT,
+ * so the kernel spreads the connections. All loops share the listener of
+ * a Unix socket. Messages are handled in order as soon as they are
+ * complete, even if earlier responses couldn't be sent yet. Methods are
+ * called on the event loop, a blocking method stalls the other connections
+ * of its loop. A connection is idle while there is nothing to read from
+ * it and it doesn't take any of its pending output.
+ *
+ * With JSONRPC_FRAMING_HTTP every connection is an HTTP/1.1 connection,
+ * which is kept alive unless the client asks otherwise. Only POST requests
+ * are accepted, on any path. Notifications are answered with 204 No Content,
+ * and malformed requests with an error status before the connection is
+ * closed. So are requests which couldn't be handled, e.g. for lack of
+ * memory, with 500 Internal Server Error. With the other framings, such
+ * a failure closes the connection, as its response would be missing.
+ *
+ * jsonrpc_server_run() blocks until jsonrpc_server_stop() is called, which
+ * may be done from any thread.
+ */
+jsonrpc_server_t *jsonrpc_server_create(jsonrpc_ctx_t *ctx,
+		const struct jsonrpc_server_config *config);
+int jsonrpc_server_run(jsonrpc_server_t *server);
+void jsonrpc_server_stop(jsonrpc_server_t *server);
+void jsonrpc_server_destroy(jsonrpc_server_t *server);
+
+#endif /* __JSONRPC_SERVER_H */
@@ -0,0 +1,611 @@
+/*
+ * Shared-memory rings for clients on the same host.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <jansson.h>
+
+#include "jsonrpc.h"
+#include "jsonrpc_shm.h"
+#include "jsonrpc_alloc.h"
+
+#define SHM_MAGIC 0x4d48534a /* "JSHM" */
+#define SHM_VERSION 1
+#define DEFAULT_SIZE (1024 * 1024)
+#define MIN_SIZE 4096
+#define MAX_SIZE (1024 * 1024 * 1024)
+/* polls of the other end before going to sleep */
+#define SPINS 1024
+
+#define RECORD_MORE 1
+/* fills up the end of the ring, the next record starts at its beginning */
+#define RECORD_PAD 2
+
+/* records are 8 byte aligned and never wrap around */
+struct record {
+	uint32_t len;
+	uint32_t flags;
+};
+
+#define RECORD_SIZE(len) (sizeof(struct record) + (((len) + 7) & ~(size_t)7))
+
+/*
+ * A record of the other end, whose header was read exactly once. The other
+ * end can still change it in the ring, so only these copies are used.
+ */
+struct record_view {
+	const char *data;
+	size_t len;
+	uint32_t flags;
+};
+
+/* of a message put together from several records, unless set otherwise */
+#define DEFAULT_MAX_MESSAGE (64 * 1024 * 1024)
+
+/*
+ * head and tail count the bytes written into and read from the ring. The
+ * seq counters are bumped after them, so the other end can sleep on them.
+ */
+struct ring {
+	/* written by the producer */
+	uint64_t head __attribute__((aligned(64)));
+	uint32_t head_seq;
+	uint32_t space_waiters;
+	/* written by the consumer */
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t tail_seq;
+	uint32_t data_waiters;
+};
+
+enum {
+	RING_REQUESTS,
+	RING_RESPONSES,
+};
+
+/* the start of the file, the data of the rings follows at DATA_OFFSET */
+struct region {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint32_t closed;
+	struct ring rings[2];
+};
+
+#define DATA_OFFSET ((sizeof(struct region) + 63) & ~(size_t)63)
+
+struct channel {
+	struct ring *ring;
+	char *data;
+	/* the own end of the ring */
+	uint64_t pos;
+	/* the record being written */
+	size_t len;
+	size_t room;
+};
+
+struct jsonrpc_shm {
+	struct region *region;
+	size_t map_size;
+	size_t size;
+	/* set on the end that created the file */
+	char *path;
+	struct channel in;
+	struct channel out;
+	/* the other end wrote garbage */
+	bool broken;
+	/* messages of several records are put together here */
+	char *buf;
+	size_t buf_len;
+	size_t buf_size;
+	size_t max_message;
+};
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static bool is_closed(struct jsonrpc_shm *shm)
+{
+	return __atomic_load_n(&shm->region->closed, __ATOMIC_SEQ_CST);
+}
+
+/* bumps seq and wakes up the other end if it sleeps on it */
+static void notify(uint32_t *seq, uint32_t *waiters)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+		futex_wake(seq);
+	}
+}
+
+static bool has_data(struct jsonrpc_shm *shm, size_t need)
+{
+	return __atomic_load_n(&shm->in.ring->head, __ATOMIC_ACQUIRE) !=
+		shm->in.pos;
+}
+
+static bool has_space(struct jsonrpc_shm *shm, size_t need)
+{
+	uint64_t tail = __atomic_load_n(&shm->out.ring->tail, __ATOMIC_ACQUIRE);
+
+	return shm->size - (shm->out.pos - tail) >= need;
+}
+
+/*
+ * Waits until ready() holds, returns -1 once the channel is closed and it
+ * still doesn't. Records which were published before the channel was
+ * closed can still be read.
+ */
+static int wait_for(struct jsonrpc_shm *shm,
+		bool (*ready)(struct jsonrpc_shm *, size_t), size_t need,
+		uint32_t *seq, uint32_t *waiters)
+{
+	uint32_t s;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < SPINS; i++) {
+			if (ready(shm, need)) {
+				return 0;
+			} else if (is_closed(shm)) {
+				return -1;
+			}
+			cpu_relax();
+		}
+
+		s = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+		if (!ready(shm, need) && !is_closed(shm)) {
+			futex_wait(seq, s);
+		}
+		__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void publish(struct jsonrpc_shm *shm, size_t size)
+{
+	struct channel *out = &shm->out;
+
+	out->pos += size;
+	__atomic_store_n(&out->ring->head, out->pos, __ATOMIC_RELEASE);
+	notify(&out->ring->head_seq, &out->ring->data_waiters);
+}
+
+/* starts a record with room for at least need bytes */
+static int record_open(struct jsonrpc_shm *shm, size_t need)
+{
+	struct channel *out = &shm->out;
+	struct record *rec;
+	size_t off, end, avail;
+
+	if (is_closed(shm)) {
+		return -1;
+	}
+	for (;;) {
+		off = out->pos & (shm->size - 1);
+		rec = (struct record *)(out->data + off);
+		end = shm->size - off;
+		if (end >= RECORD_SIZE(need)) {
+			break;
+		}
+		if (wait_for(shm, has_space, end, &out->ring->tail_seq,
+					&out->ring->space_waiters)) {
+			return -1;
+		}
+		rec->len = end - sizeof(*rec);
+		rec->flags = RECORD_PAD;
+		publish(shm, end);
+	}
+
+	if (wait_for(shm, has_space, RECORD_SIZE(need), &out->ring->tail_seq,
+				&out->ring->space_waiters)) {
+		return -1;
+	}
+	avail = shm->size - (out->pos -
+			__atomic_load_n(&out->ring->tail, __ATOMIC_ACQUIRE));
+	if (avail > end) {
+		avail = end;
+	}
+	out->len = 0;
+	out->room = avail - sizeof(*rec);
+	if (out->room > shm->size / 4) {
+		out->room = shm->size / 4;
+	}
+
+	return 0;
+}
+
+static void record_close(struct jsonrpc_shm *shm, uint32_t flags)
+{
+	struct channel *out = &shm->out;
+	struct record *rec;
+
+	rec = (struct record *)(out->data + (out->pos & (shm->size - 1)));
+	rec->len = out->len;
+	rec->flags = flags;
+	publish(shm, RECORD_SIZE(out->len));
+}
+
+/* appends to the open record, continuing in new ones as they fill up */
+static int shm_write(const char *buf, size_t len, void *priv)
+{
+	struct jsonrpc_shm *shm = priv;
+	struct channel *out = &shm->out;
+	char *data;
+	size_t n;
+
+	while (len) {
+		if (out->len == out->room) {
+			record_close(shm, RECORD_MORE);
+			if (record_open(shm, 1)) {
+				return -1;
+			}
+		}
+		n = out->room - out->len;
+		if (n > len) {
+			n = len;
+		}
+		data = out->data + (out->pos & (shm->size - 1)) +
+			sizeof(struct record);
+		memcpy(data + out->len, buf, n);
+		out->len += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void consume(struct jsonrpc_shm *shm, size_t len)
+{
+	struct channel *in = &shm->in;
+
+	in->pos += RECORD_SIZE(len);
+	__atomic_store_n(&in->ring->tail, in->pos, __ATOMIC_RELEASE);
+	notify(&in->ring->tail_seq, &in->ring->space_waiters);
+}
+
+/* the next record which isn't padding, -1 once the channel is closed */
+static int record_next(struct jsonrpc_shm *shm, struct record_view *view)
+{
+	struct channel *in = &shm->in;
+	struct record *rec;
+	uint64_t head;
+	size_t off;
+
+	for (;;) {
+		if (wait_for(shm, has_data, 0, &in->ring->head_seq,
+					&in->ring->data_waiters)) {
+			return -1;
+		}
+		head = __atomic_load_n(&in->ring->head, __ATOMIC_ACQUIRE);
+		off = in->pos & (shm->size - 1);
+		rec = (struct record *)(in->data + off);
+		view->data = (const char *)(rec + 1);
+		view->len = __atomic_load_n(&rec->len, __ATOMIC_RELAXED);
+		view->flags = __atomic_load_n(&rec->flags, __ATOMIC_RELAXED);
+		/* the other end may be anything, don't trust the lengths */
+		if (head - in->pos > shm->size ||
+				view->len > shm->size - off - sizeof(*rec) ||
+				RECORD_SIZE(view->len) > head - in->pos) {
+			shm->broken = true;
+			jsonrpc_shm_stop(shm);
+			return -1;
+		}
+		if (!(view->flags & RECORD_PAD)) {
+			return 0;
+		}
+		consume(shm, view->len);
+	}
+}
+
+static int buf_append(struct jsonrpc_shm *shm, const char *data, size_t len)
+{
+	size_t size = shm->buf_size ? shm->buf_size : 4096;
+	char *buf;
+
+	if (len > shm->max_message - shm->buf_len) {
+		shm->broken = true;
+		return -1;
+	}
+
+	while (size < shm->buf_len + len + 1) {
+		size *= 2;
+	}
+	if (size != shm->buf_size) {
+		buf = realloc(shm->buf, size);
+		if (!buf) {
+			return -1;
+		}
+		shm->buf = buf;
+		shm->buf_size = size;
+	}
+	memcpy(shm->buf + shm->buf_len, data, len);
+	shm->buf_len += len;
+
+	return 0;
+}
+
+/*
+ * Reads the next message. A message of a single record is returned in place,
+ * and *in_place is set: the record has to be consumed with consume(shm,
+ * *len) once the message isn't needed anymore. Longer ones are put together
+ * in the buffer, up to max_message bytes.
+ */
+static const char *message_read(struct jsonrpc_shm *shm, size_t *len,
+		bool *in_place)
+{
+	struct record_view r;
+
+	if (record_next(shm, &r)) {
+		return NULL;
+	} else if (!(r.flags & RECORD_MORE)) {
+		*len = r.len;
+		*in_place = true;
+		return r.data;
+	}
+
+	shm->buf_len = 0;
+	for (;;) {
+		if (buf_append(shm, r.data, r.len)) {
+			jsonrpc_shm_stop(shm);
+			return NULL;
+		}
+		consume(shm, r.len);
+		if (!(r.flags & RECORD_MORE)) {
+			break;
+		}
+		if (record_next(shm, &r)) {
+			return NULL;
+		}
+	}
+	*len = shm->buf_len;
+	*in_place = false;
+
+	return shm->buf;
+}
+
+static jsonrpc_shm_t *shm_init(void *map, size_t map_size, size_t size,
+		int in, int out)
+{
+	struct jsonrpc_shm *shm;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm) {
+		munmap(map, map_size);
+		return NULL;
+	}
+	shm->region = map;
+	shm->map_size = map_size;
+	shm->size = size;
+	shm->max_message = DEFAULT_MAX_MESSAGE;
+	shm->in.ring = &shm->region->rings[in];
+	shm->in.data = (char *)map + DATA_OFFSET + in * size;
+	shm->in.pos = shm->in.ring->tail;
+	shm->out.ring = &shm->region->rings[out];
+	shm->out.data = (char *)map + DATA_OFFSET + out * size;
+	shm->out.pos = shm->out.ring->head;
+
+	return shm;
+}
+
+jsonrpc_shm_t *jsonrpc_shm_create(const char *path, size_t size)
+{
+	struct jsonrpc_shm *shm;
+	struct region *region;
+	size_t ring_size = MIN_SIZE, map_size;
+	int fd;
+
+	if (!size) {
+		size = DEFAULT_SIZE;
+	}
+	if (size > MAX_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (ring_size < size) {
+		ring_size *= 2;
+	}
+	map_size = DATA_OFFSET + 2 * ring_size;
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, map_size)) {
+		goto err;
+	}
+	region = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED) {
+		goto err;
+	}
+	close(fd);
+
+	region->version = SHM_VERSION;
+	region->size = ring_size;
+	__atomic_store_n(&region->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm = shm_init(region, map_size, ring_size, RING_REQUESTS,
+			RING_RESPONSES);
+	if (shm) {
+		shm->path = strdup(path);
+	}
+	if (!shm || !shm->path) {
+		jsonrpc_shm_destroy(shm);
+		unlink(path);
+		return NULL;
+	}
+
+	return shm;
+
+err:
+	close(fd);
+	unlink(path);
+	return NULL;
+}
+
+jsonrpc_shm_t *jsonrpc_shm_open(const char *path)
+{
+	struct region *region;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < DATA_OFFSET) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (region == MAP_FAILED) {
+		return NULL;
+	}
+
+	size = region->size;
+	if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+			region->version != SHM_VERSION ||
+			size < MIN_SIZE || size > MAX_SIZE || (size & (size - 1)) ||
+			(size_t)st.st_size != DATA_OFFSET + 2 * size) {
+		munmap(region, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return shm_init(region, st.st_size, size, RING_RESPONSES,
+			RING_REQUESTS);
+}
+
+int jsonrpc_shm_serve(jsonrpc_ctx_t *ctx, jsonrpc_shm_t *shm)
+{
+	const char *req;
+	bool in_place;
+	size_t len;
+	int rc;
+
+	for (;;) {
+		req = message_read(shm, &len, &in_place);
+		if (!req) {
+			break;
+		}
+		if (record_open(shm, 1)) {
+			break;
+		}
+		rc = jsonrpc_ctx_handle_request_cb(ctx, req, len, shm_write, shm);
+		if (in_place) {
+			consume(shm, len);
+		}
+		if (rc) {
+			/* a partial response can't be taken back */
+			jsonrpc_shm_stop(shm);
+			break;
+		}
+		record_close(shm, 0);
+	}
+
+	return shm->broken ? -1 : 0;
+}
+
+int jsonrpc_shm_send(jsonrpc_shm_t *shm, const char *req, size_t len)
+{
+	/* a message which fits into one record is handled in place */
+	if (record_open(shm, len < shm->size / 4 ? len : shm->size / 4) ||
+			shm_write(req, len, shm)) {
+		return -1;
+	}
+	record_close(shm, 0);
+
+	return 0;
+}
+
+int jsonrpc_shm_receive(jsonrpc_shm_t *shm, char **rsp, size_t *len)
+{
+	const char *msg;
+	bool in_place;
+
+	msg = message_read(shm, len, &in_place);
+	if (!msg) {
+		return -1;
+	}
+
+	*rsp = NULL;
+	if (*len) {
+		*rsp = malloc(*len + 1);
+		if (*rsp) {
+			memcpy(*rsp, msg, *len);
+			(*rsp)[*len] = '\0';
+		}
+	}
+	if (in_place) {
+		consume(shm, *len);
+	}
+
+	return *len && !*rsp ? -1 : 0;
+}
+
+void jsonrpc_shm_set_max_message(jsonrpc_shm_t *shm, size_t max)
+{
+	shm->max_message = max ? max : DEFAULT_MAX_MESSAGE;
+}
+
+void jsonrpc_shm_stop(jsonrpc_shm_t *shm)
+{
+	struct region *region = shm->region;
+	int i;
+
+	__atomic_store_n(&region->closed, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < 2; i++) {
+		__atomic_add_fetch(&region->rings[i].head_seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&region->rings[i].head_seq);
+		__atomic_add_fetch(&region->rings[i].tail_seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&region->rings[i].tail_seq);
+	}
+}
+
+void jsonrpc_shm_destroy(jsonrpc_shm_t *shm)
+{
+	if (!shm) {
+		return;
+	}
+
+	munmap(shm->region, shm->map_size);
+	if (shm->path) {
+		unlink(shm->path);
+		free(shm->path);
+	}
+	free(shm->buf);
+	free(shm);
+}
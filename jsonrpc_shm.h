@@ -0,0 +1,50 @@
+/*
+ * Optional shared-memory transport for clients on the same host, built into
+ * libjsonrpc_server.a.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef __JSONRPC_SHM_H
+#define __JSONRPC_SHM_H
+
+typedef struct jsonrpc_shm jsonrpc_shm_t;
+
+/*
+ * A channel is a file, preferably on a tmpfs such as /dev/shm, which both
+ * ends map. It holds two rings of the given size, 0 for 1 MiB: one for the
+ * requests and one for the responses. Messages are written into the rings
+ * as records, and the other end is woken up with a futex only when it is
+ * asleep. The server parses requests in place from the ring and encodes the
+ * responses straight into the other one. Messages larger than a quarter of
+ * a ring are split up and put together again by the receiving end.
+ *
+ * Every request gets exactly one response, with a length of 0 for
+ * notifications, in the order of the requests. A channel connects one
+ * client to one server: on each end, one thread may send and another one
+ * may receive at the same time.
+ *
+ * jsonrpc_shm_create() creates the file, which must not exist yet, and
+ * removes it again in jsonrpc_shm_destroy(). jsonrpc_shm_serve() handles
+ * requests until jsonrpc_shm_stop() is called on either end, by any thread.
+ * After that, the functions of both ends fail, except that responses which
+ * were sent before can still be received.
+ *
+ * The other end isn't trusted: a record that doesn't fit the ring stops the
+ * channel, and so does a message that is put together from several records
+ * and grows beyond the maximum set with jsonrpc_shm_set_max_message(),
+ * 0 for the default of 64 MiB. The server should use the max_request limit
+ * of its context here.
+ */
+jsonrpc_shm_t *jsonrpc_shm_create(const char *path, size_t size);
+int jsonrpc_shm_serve(jsonrpc_ctx_t *ctx, jsonrpc_shm_t *shm);
+jsonrpc_shm_t *jsonrpc_shm_open(const char *path);
+int jsonrpc_shm_send(jsonrpc_shm_t *shm, const char *req, size_t len);
+/* the response is NUL-terminated and has to be freed, NULL if it is empty */
+int jsonrpc_shm_receive(jsonrpc_shm_t *shm, char **rsp, size_t *len);
+void jsonrpc_shm_set_max_message(jsonrpc_shm_t *shm, size_t max);
+void jsonrpc_shm_stop(jsonrpc_shm_t *shm);
+void jsonrpc_shm_destroy(jsonrpc_shm_t *shm);
+
+#endif /* __JSONRPC_SHM_H */
@@ -0,0 +1,242 @@
+/*
+ * Message framing for persistent streams.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <jansson.h>
+
+#include "jsonrpc.h"
+#include "jsonrpc_alloc.h"
+
+#define CONTENT_LENGTH "Content-Length:"
+
+/* responses go straight into the stdio buffer of the output stream */
+struct file_out {
+	FILE *file;
+	size_t len;
+};
+
+static int file_write(const char *buf, size_t len, void *priv)
+{
+	struct file_out *out = priv;
+
+	if (fwrite(buf, 1, len, out->file) != len) {
+		return -1;
+	}
+	out->len += len;
+
+	return 0;
+}
+
+/*
+ * The Content-Length has to be known before the body is written, so the
+ * response is collected in a buffer which is reused for every message.
+ */
+struct rsp_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int rsp_buf_write(const char *buf, size_t len, void *priv)
+{
+	struct rsp_buf *rsp = priv;
+
+	if (rsp->len + len > rsp->size) {
+		size_t size = rsp->size ? rsp->size : 4096;
+		char *new;
+
+		while (rsp->len + len > size) {
+			size *= 2;
+		}
+		new = realloc(rsp->buf, size);
+		if (!new) {
+			return -1;
+		}
+		rsp->buf = new;
+		rsp->size = size;
+	}
+
+	memcpy(rsp->buf + rsp->len, buf, len);
+	rsp->len += len;
+
+	return 0;
+}
+
+/*
+ * Read the header block of a message. Returns 0 on a clean end of the
+ * stream, -1 on errors and 1 if the length of the following body was found.
+ */
+static int read_headers(FILE *in, char **line, size_t *size, size_t *_len)
+{
+	ssize_t n;
+	bool found = false;
+	bool started = false;
+
+	while ((n = getline(line, size, in)) > 0) {
+		char *end;
+		unsigned long long len;
+
+		/* strip the line terminator */
+		while (n && ((*line)[n - 1] == '\n' || (*line)[n - 1] == '\r')) {
+			(*line)[--n] = '\0';
+		}
+		if (!n) {
+			if (!started) {
+				continue;
+			}
+			if (!found) {
+				return -1;
+			}
+			return 1;
+		}
+		started = true;
+
+		if (strncasecmp(*line, CONTENT_LENGTH, strlen(CONTENT_LENGTH))) {
+			/* other headers, like Content-Type, are ignored */
+			continue;
+		}
+
+		len = strtoull(*line + strlen(CONTENT_LENGTH), &end, 10);
+		if (end == *line + strlen(CONTENT_LENGTH) || *end != '\0') {
+			return -1;
+		}
+		*_len = len;
+		found = true;
+	}
+
+	return (started || ferror(in)) ? -1 : 0;
+}
+
+/*
+ * The body buffer only grows with the bytes which actually arrive, so that
+ * a bogus Content-Length doesn't allocate more than the peer sends.
+ */
+#define BODY_CHUNK 65536
+
+static int read_body(FILE *in, char **body, size_t *size, size_t len)
+{
+	size_t got = 0, want;
+
+	while (got < len || !*size) {
+		want = len - got < BODY_CHUNK ? len - got : BODY_CHUNK;
+		if (got + want + 1 > *size) {
+			size_t new_size = *size * 2 > got + want + 1 ?
+					*size * 2 : got + want + 1;
+			char *new;
+
+			if (new_size > len + 1) {
+				new_size = len + 1;
+			}
+			new = realloc(*body, new_size);
+			if (!new) {
+				return -1;
+			}
+			*body = new;
+			*size = new_size;
+		}
+		if (fread(*body + got, 1, want, in) != want) {
+			return -1;
+		}
+		got += want;
+	}
+
+	return 0;
+}
+
+static int serve_content_length(jsonrpc_ctx_t *ctx, FILE *in, FILE *out)
+{
+	char *line = NULL, *body = NULL;
+	size_t line_size = 0, body_size = 0, len = 0;
+	struct rsp_buf rsp = { NULL, 0, 0 };
+	int rc;
+
+	while ((rc = read_headers(in, &line, &line_size, &len)) > 0) {
+		if (read_body(in, &body, &body_size, len)) {
+			rc = -1;
+			break;
+		}
+
+		rsp.len = 0;
+		rc = jsonrpc_ctx_handle_request_cb(ctx, body, len, rsp_buf_write, &rsp);
+		if (rc) {
+			break;
+		}
+		if (rsp.len) {
+			if (fprintf(out, CONTENT_LENGTH " %zu\r\n\r\n", rsp.len) < 0 ||
+					fwrite(rsp.buf, 1, rsp.len, out) != rsp.len ||
+					fflush(out)) {
+				rc = -1;
+				break;
+			}
+		}
+	}
+
+	free(rsp.buf);
+	free(body);
+	free(line);
+
+	return rc;
+}
+
+/* newline-delimited JSON, every line carries exactly one message */
+static int serve_newline(jsonrpc_ctx_t *ctx, FILE *in, FILE *out)
+{
+	struct file_out rsp = { out, 0 };
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	int rc = 0;
+
+	while ((n = getline(&line, &size, in)) > 0) {
+		if (strspn(line, " \t\r\n") == (size_t)n) {
+			continue;
+		}
+
+		rsp.len = 0;
+		rc = jsonrpc_ctx_handle_request_cb(ctx, line, n, file_write, &rsp);
+		if (!rc && rsp.len) {
+			if (putc('\n', out) == EOF || fflush(out)) {
+				rc = -1;
+			}
+		}
+		if (rc) {
+			break;
+		}
+	}
+	if (!rc && ferror(in)) {
+		rc = -1;
+	}
+	free(line);
+
+	return rc;
+}
+
+int jsonrpc_ctx_handle_stream(jsonrpc_ctx_t *ctx, FILE *in, FILE *out,
+		jsonrpc_framing_t framing)
+{
+	switch (framing) {
+	case JSONRPC_FRAMING_NEWLINE:
+		return serve_newline(ctx, in, out);
+	case JSONRPC_FRAMING_CONTENT_LENGTH:
+		return serve_content_length(ctx, in, out);
+	case JSONRPC_FRAMING_HTTP:
+		/* needs the socket server */
+		break;
+	}
+
+	return -1;
+}
+
+int jsonrpc_handle_stream(FILE *in, FILE *out, jsonrpc_framing_t framing)
+{
+	return jsonrpc_ctx_handle_stream(NULL, in, out, framing);
+}
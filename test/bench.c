@@ -0,0 +1,461 @@
+/*
+ * In-process benchmark of the request parse, dispatch and encode path.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <jansson.h>
+#include "jsonrpc.h"
+
+/*
+ * Every heap allocation of the process is counted, including the ones done
+ * by jansson. This relies on glibc's __libc_* entry points.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static jsonrpc_ret_t subtract(json_t *params)
+{
+	json_int_t a, b;
+
+	if (json_unpack(params, "[II]", &a, &b) &&
+			json_unpack(params, "{s:I,s:I}", "minuend", &a,
+				"subtrahend", &b)) {
+		return jsonrpc_error_invalid_params(NULL);
+	}
+	return jsonrpc_result(json_integer(a - b));
+}
+jsonrpc_register(subtract);
+
+static jsonrpc_ret_t typed_subtract(json_int_t minuend, json_int_t subtrahend)
+{
+	return jsonrpc_result(json_integer(minuend - subtrahend));
+}
+jsonrpc_register_typed(typed_subtract, (json_int_t, minuend),
+		(json_int_t, subtrahend));
+
+static jsonrpc_ret_t sum(json_t *params)
+{
+	json_int_t sum = 0;
+	size_t i;
+
+	if (!json_is_array(params)) {
+		return jsonrpc_error_invalid_params(NULL);
+	}
+	for (i = 0; i < json_array_size(params); i++) {
+		sum += json_integer_value(json_array_get(params, i));
+	}
+	return jsonrpc_result(json_integer(sum));
+}
+jsonrpc_register(sum);
+
+static jsonrpc_ret_t echo(json_t *params)
+{
+	return jsonrpc_result(json_incref(params));
+}
+jsonrpc_register(echo);
+
+static jsonrpc_ret_t fail(json_t *params)
+{
+	return jsonrpc_error_invalid_params(NULL);
+}
+jsonrpc_register(fail);
+
+struct bench {
+	const char *name;
+	char *request;
+	/* number of requests in one message */
+	unsigned int requests;
+};
+
+static char *batch(const char *fmt, unsigned int count)
+{
+	size_t len = 0, size = 64;
+	char *buf = malloc(size);
+	unsigned int i;
+
+	buf[len++] = '[';
+	for (i = 0; i < count; i++) {
+		int n = snprintf(NULL, 0, fmt, i + 1);
+		if (len + n + 3 > size) {
+			size = (len + n + 3) * 2;
+			buf = realloc(buf, size);
+		}
+		if (i) {
+			buf[len++] = ',';
+		}
+		len += sprintf(buf + len, fmt, i + 1);
+	}
+	buf[len++] = ']';
+	buf[len] = '\0';
+
+	return buf;
+}
+
+static char *big_params(const char *method, unsigned int count)
+{
+	size_t len, size = 64 + count * 12;
+	char *buf = malloc(size);
+	unsigned int i;
+
+	len = sprintf(buf, "{\"jsonrpc\": \"2.0\", \"method\": \"%s\", "
+			"\"params\": [", method);
+	for (i = 0; i < count; i++) {
+		len += sprintf(buf + len, "%s%u", i ? ", " : "", i);
+	}
+	sprintf(buf + len, "], \"id\": 1}");
+
+	return buf;
+}
+
+static struct bench benches[] = {
+	{ "single-positional", "{\"jsonrpc\": \"2.0\", \"method\": \"subtract\", "
+		"\"params\": [42, 23], \"id\": 1}", 1 },
+	{ "single-named", "{\"jsonrpc\": \"2.0\", \"method\": \"subtract\", "
+		"\"params\": {\"subtrahend\": 23, \"minuend\": 42}, \"id\": 3}", 1 },
+	{ "notification", "{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+		"\"params\": [1, 2, 3]}", 1 },
+	{ "batch-100", NULL, 100 },
+	{ "batch-100-notifications", NULL, 100 },
+	{ "params-1000", NULL, 1 },
+	{ "echo-1000", NULL, 1 },
+	{ "not-found-params-1000", NULL, 1 },
+	{ "error-method-not-found", "{\"jsonrpc\": \"2.0\", \"method\": "
+		"\"foobar\", \"id\": \"1\"}", 1 },
+	{ "error-invalid-params", "{\"jsonrpc\": \"2.0\", \"method\": \"fail\", "
+		"\"params\": [1], \"id\": 1}", 1 },
+	{ "error-invalid-request", "{\"jsonrpc\": \"2.0\", \"method\": 1, "
+		"\"params\": \"bar\"}", 1 },
+	{ "error-invalid-json", "{\"jsonrpc\": \"2.0\", \"method\": \"foobar, "
+		"\"params\": \"bar\", \"baz]", 1 },
+	{ "typed-positional", "{\"jsonrpc\": \"2.0\", \"method\": "
+		"\"typed_subtract\", \"params\": [42, 23], \"id\": 1}", 1 },
+	{ "typed-named", "{\"jsonrpc\": \"2.0\", \"method\": \"typed_subtract\", "
+		"\"params\": {\"subtrahend\": 23, \"minuend\": 42}, \"id\": 3}", 1 },
+};
+
+static void setup(void)
+{
+	benches[3].request = batch("{\"jsonrpc\": \"2.0\", \"method\": "
+			"\"subtract\", \"params\": [42, 23], \"id\": %u}", 100);
+	benches[4].request = batch("{\"jsonrpc\": \"2.0\", \"method\": "
+			"\"sum\", \"params\": [%u, 2]}", 100);
+	benches[5].request = big_params("sum", 1000);
+	benches[6].request = big_params("echo", 1000);
+	benches[7].request = big_params("foobar", 1000);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct buffer {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int buffer_write(const char *data, size_t len, void *priv)
+{
+	struct buffer *b = priv;
+
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->buf = realloc(b->buf, b->size);
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+
+	return 0;
+}
+
+static const char *const phase_names[] = {
+	"decode", "validate", "dispatch", "encode",
+};
+
+#define PHASES (sizeof(phase_names) / sizeof(phase_names[0]))
+
+/* false unless the library counts allocations, see JSONRPC_ALLOC_TRACE */
+static bool phase_allocs(double *allocs)
+{
+	json_t *snapshot = jsonrpc_stats_snapshot(), *count;
+	unsigned int i;
+	bool found = false;
+
+	for (i = 0; i < PHASES; i++) {
+		count = json_object_get(json_object_get(json_object_get(snapshot,
+						"phases"), phase_names[i]), "allocs");
+		allocs[i] = json_integer_value(count);
+		found |= count != NULL;
+	}
+	json_decref(snapshot);
+
+	return found;
+}
+
+/* the response ends up in a string of its own, just like a JSON one */
+static void handle_msgpack(const char *req, size_t len)
+{
+	struct buffer rsp = { NULL, 0, 0 };
+
+	jsonrpc_handle_request_msgpack(req, len, buffer_write, &rsp);
+	free(rsp.buf);
+}
+
+static void print_phases(const double *before, double requests)
+{
+	double after[PHASES];
+	unsigned int i;
+
+	if (!phase_allocs(after)) {
+		return;
+	}
+	printf("  allocs/op by phase:");
+	for (i = 0; i < PHASES; i++) {
+		printf(" %s %.2f", phase_names[i], (after[i] - before[i]) / requests);
+	}
+	printf("\n");
+}
+
+static void run(const struct bench *bench, unsigned long iterations,
+		bool msgpack, bool phases)
+{
+	struct buffer req = { NULL, 0, 0 };
+	size_t len = strlen(bench->request);
+	unsigned long i, start_allocs, end_allocs;
+	double start, elapsed, requests, before[PHASES];
+	json_t *value;
+
+	/* requests which aren't valid JSON are sent as they are */
+	if (msgpack) {
+		value = json_loadb(bench->request, len, 0, NULL);
+		if (value) {
+			jsonrpc_msgpack_encode(value, buffer_write, &req);
+			json_decref(value);
+		} else {
+			buffer_write(bench->request, len, &req);
+		}
+		len = req.len;
+	}
+
+	/* warm up */
+	for (i = 0; i < iterations / 10 + 1; i++) {
+		if (msgpack) {
+			handle_msgpack(req.buf, len);
+		} else {
+			free(jsonrpc_handle_request(bench->request, len));
+		}
+	}
+
+	if (phases) {
+		phase_allocs(before);
+	}
+	start_allocs = allocs;
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (msgpack) {
+			handle_msgpack(req.buf, len);
+		} else {
+			free(jsonrpc_handle_request(bench->request, len));
+		}
+	}
+	elapsed = now() - start;
+	end_allocs = allocs;
+	free(req.buf);
+
+	requests = (double)iterations * bench->requests;
+	printf("%-26s %12.0f %10.1f %12.2f\n", bench->name,
+			requests / elapsed, elapsed * 1e9 / requests,
+			(end_allocs - start_allocs) / requests);
+	if (phases) {
+		print_phases(before, requests);
+	}
+}
+
+static char *load(const char *path, size_t *len)
+{
+	FILE *file = fopen(path, "rb");
+	char *buf;
+
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	fseek(file, 0, SEEK_END);
+	*len = ftell(file);
+	rewind(file);
+	buf = malloc(*len + 1);
+	if (fread(buf, 1, *len, file) != *len) {
+		perror(path);
+		exit(1);
+	}
+	buf[*len] = '\0';
+	fclose(file);
+
+	return buf;
+}
+
+/*
+ * Replays the given files, one request each, as one benchmark. Every
+ * iteration handles all of them once.
+ */
+static void run_corpus(char **files, int count, unsigned long iterations,
+		bool phases)
+{
+	struct buffer *reqs = calloc(count, sizeof(*reqs));
+	unsigned long i, start_allocs, end_allocs;
+	double start, elapsed, requests, before[PHASES];
+	int j;
+
+	for (j = 0; j < count; j++) {
+		reqs[j].buf = load(files[j], &reqs[j].len);
+	}
+
+	/* warm up, this also fills the caches */
+	for (i = 0; i < iterations / 10 + 1; i++) {
+		for (j = 0; j < count; j++) {
+			free(jsonrpc_handle_request(reqs[j].buf, reqs[j].len));
+		}
+	}
+
+	if (phases) {
+		phase_allocs(before);
+	}
+	start_allocs = allocs;
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < count; j++) {
+			free(jsonrpc_handle_request(reqs[j].buf, reqs[j].len));
+		}
+	}
+	elapsed = now() - start;
+	end_allocs = allocs;
+
+	requests = (double)iterations * count;
+	printf("%-26s %12.0f %10.1f %12.2f\n", "corpus",
+			requests / elapsed, elapsed * 1e9 / requests,
+			(end_allocs - start_allocs) / requests);
+	if (phases) {
+		print_phases(before, requests);
+	}
+
+	for (j = 0; j < count; j++) {
+		free(reqs[j].buf);
+	}
+	free(reqs);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [--arena] "
+			"[--stream-batch] [--no-error-text] [--stats] [--phases] "
+			"[--msgpack] [benchmark...]\n"
+			"       %s [-n iterations] [--arena] [--stream-batch] "
+			"[--no-error-text] [--stats] [--phases] --corpus file...\n",
+			prog, prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	jsonrpc_confflags_t flags = 0;
+	unsigned long iterations = 20000;
+	int i, j, filters = 0;
+	bool stats = false, msgpack = false, corpus = false, phases = false;
+	json_t *snapshot;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			iterations = strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "--arena")) {
+			flags |= JSONRPC_REQUEST_ARENA;
+		} else if (!strcmp(argv[i], "--stream-batch")) {
+			flags |= JSONRPC_STREAM_BATCH;
+		} else if (!strcmp(argv[i], "--no-error-text")) {
+			flags |= JSONRPC_DISABLE_ERROR_TEXT;
+		} else if (!strcmp(argv[i], "--stats")) {
+			stats = true;
+		} else if (!strcmp(argv[i], "--msgpack")) {
+			msgpack = true;
+		} else if (!strcmp(argv[i], "--phases")) {
+			phases = true;
+		} else if (!strcmp(argv[i], "--corpus")) {
+			corpus = true;
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+		} else {
+			argv[++filters] = argv[i];
+		}
+	}
+	if (!iterations || (corpus && (!filters || msgpack))) {
+		usage(argv[0]);
+	}
+
+	jsonrpc_config_set(flags);
+	setup();
+
+	printf("%-26s %12s %10s %12s\n", "benchmark", "requests/s", "ns/op",
+			"allocs/op");
+	if (corpus) {
+		run_corpus(&argv[1], filters, iterations, phases);
+	}
+	for (i = 0; !corpus && i < sizeof(benches) / sizeof(benches[0]); i++) {
+		bool selected = !filters;
+
+		for (j = 1; j <= filters; j++) {
+			if (!strcmp(argv[j], benches[i].name)) {
+				selected = true;
+			}
+		}
+		if (selected) {
+			run(&benches[i], iterations / benches[i].requests + 1, msgpack,
+					phases);
+		}
+	}
+
+	/* only available with JSONRPC_STATS */
+	snapshot = stats ? jsonrpc_stats_snapshot() : NULL;
+	if (snapshot) {
+		json_dumpf(snapshot, stdout, JSON_INDENT(2) | JSON_SORT_KEYS);
+		printf("\n");
+		json_decref(snapshot);
+	}
+
+	for (i = 3; i <= 7; i++) {
+		free(benches[i].request);
+	}
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Fuzz target of the request handling, for libFuzzer and AFL++. Every input
+ * goes through the JSON and the MessagePack entry points and through the
+ * stream framings.
+ *
+ * Built with FUZZ_MAIN, it is a plain program instead, which runs the files
+ * given as its arguments once. This replays a corpus, or a crash, without
+ * a fuzzer.
+ *
+ * Copyright (c) 2015, Michael Walle <michael@walle.cc>
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+#include "jsonrpc.h"
+
+static jsonrpc_ret_t echo(json_t *params)
+{
+	return jsonrpc_result(json_incref(params));
+}
+jsonrpc_register(echo);
+jsonrpc_register_cached_name("cached_echo", echo, 60000, 16);
+
+static jsonrpc_ret_t fail(json_t *params)
+{
+	return jsonrpc_error_invalid_params(json_incref(params));
+}
+jsonrpc_register(fail);
+
+static jsonrpc_ret_t raw_echo(jsonrpc_params_t params)
+{
+	size_t len;
+	const char *raw = jsonrpc_params_raw(params, &len);
+
+	if (!raw) {
+		return jsonrpc_result(json_null());
+	}
+
+	return jsonrpc_result(json_stringn(raw, len));
+}
+jsonrpc_register_lazy(raw_echo);
+
+static jsonrpc_ret_t typed(int n, const char *s, json_t *any)
+{
+	return jsonrpc_result(json_integer(n + strlen(s) + json_is_null(any)));
+}
+jsonrpc_register_typed(typed, (int, n), (string, s), (json, any));
+
+static int discard(const char *buf, size_t len, void *priv)
+{
+	return 0;
+}
+
+static void handle_stream(const uint8_t *data, size_t size,
+		jsonrpc_framing_t framing)
+{
+	FILE *in, *out;
+
+	in = fmemopen((void *)data, size, "r");
+	out = fopen("/dev/null", "w");
+	if (in && out) {
+		jsonrpc_handle_stream(in, out, framing);
+	}
+	if (in) {
+		fclose(in);
+	}
+	if (out) {
+		fclose(out);
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const char *buf = (const char *)data;
+
+	free(jsonrpc_handle_request(buf, size));
+	jsonrpc_handle_request_msgpack(buf, size, discard, NULL);
+
+	/* fmemopen() doesn't take empty buffers */
+	if (size) {
+		handle_stream(data, size, JSONRPC_FRAMING_NEWLINE);
+		handle_stream(data, size, JSONRPC_FRAMING_CONTENT_LENGTH);
+	}
+
+	return 0;
+}
+
+#ifdef FUZZ_MAIN
+int main(int argc, char **argv)
+{
+	char *buf;
+	size_t len;
+	FILE *file;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		file = fopen(argv[i], "rb");
+		if (!file) {
+			perror(argv[i]);
+			return 1;
+		}
+		fseek(file, 0, SEEK_END);
+		len = ftell(file);
+		rewind(file);
+		buf = malloc(len ? len : 1);
+		if (fread(buf, 1, len, file) != len) {
+			perror(argv[i]);
+			return 1;
+		}
+		fclose(file);
+
+		LLVMFuzzerTestOneInput((const uint8_t *)buf, len);
+		free(buf);
+	}
+
+	return 0;
+}
+#endif
@@ -1,5 +1,15 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <jansson.h>
 #include "jsonrpc.h"
+#include "jsonrpc_server.h"
+#include "jsonrpc_shm.h"
 
 static jsonrpc_ret_t internal_error(json_t *params)
 {
@@ -50,6 +60,29 @@ static jsonrpc_ret_t add(json_t *params)
 }
 jsonrpc_register(add);
 
+static jsonrpc_ret_t typed_add(int a, int b)
+{
+	return jsonrpc_result(json_integer(a + b));
+}
+jsonrpc_register_typed(typed_add, (int, a), (int, b));
+
+/* echoes its params in order, for every type there is */
+static jsonrpc_ret_t typed_echo(const char *s, bool flag, double x,
+		json_int_t n, json_t *any)
+{
+	json_t *result = json_array();
+
+	json_array_append_new(result, json_string(s));
+	json_array_append_new(result, json_boolean(flag));
+	json_array_append_new(result, json_real(x));
+	json_array_append_new(result, json_integer(n));
+	json_array_append(result, any);
+
+	return jsonrpc_result(result);
+}
+jsonrpc_register_typed(typed_echo, (string, s), (bool, flag), (double, x),
+		(json_int_t, n), (json, any));
+
 static jsonrpc_ret_t sum(json_t *params)
 {
 	int i, sum = 0;
@@ -83,19 +116,752 @@ static jsonrpc_ret_t subtract(json_t *params)
 }
 jsonrpc_register(subtract);
 
-int main()
+static void *complete_later(void *arg)
+{
+	jsonrpc_complete(arg, jsonrpc_result(json_string("later")));
+
+	return NULL;
+}
+
+/* completes from another thread */
+static void later(json_t *params, jsonrpc_async_t async)
+{
+	pthread_t thread;
+
+	pthread_create(&thread, NULL, complete_later, async);
+	pthread_detach(thread);
+}
+jsonrpc_register_async(later);
+
+struct foreign_ret {
+	jsonrpc_async_t async;
+	jsonrpc_ret_t ret;
+};
+
+static void *complete_foreign(void *arg)
+{
+	struct foreign_ret *foreign = arg;
+
+	jsonrpc_complete(foreign->async, foreign->ret);
+	free(foreign);
+
+	return NULL;
+}
+
+/* the result is created here, but completed from another thread */
+static void later_ret(json_t *params, jsonrpc_async_t async)
+{
+	struct foreign_ret *foreign = malloc(sizeof(*foreign));
+	pthread_t thread;
+
+	foreign->async = async;
+	foreign->ret = jsonrpc_result(json_string("foreign"));
+	pthread_create(&thread, NULL, complete_foreign, foreign);
+	pthread_detach(thread);
+}
+jsonrpc_register_async(later_ret);
+
+/* params are decoded on demand */
+static jsonrpc_ret_t lazy_sum(jsonrpc_params_t params)
+{
+	json_t *array = jsonrpc_params_get(params);
+
+	return sum(array);
+}
+jsonrpc_register_lazy(lazy_sum);
+
+/* returns the params as they were sent */
+static jsonrpc_ret_t raw_params(jsonrpc_params_t params)
+{
+	size_t len;
+	const char *raw = jsonrpc_params_raw(params, &len);
+
+	if (!raw) {
+		return jsonrpc_error_invalid_params(NULL);
+	}
+
+	return jsonrpc_result(json_stringn(raw, len));
+}
+jsonrpc_register_lazy(raw_params);
+
+/* returns the given string as encoded JSON, or a fixed one */
+static jsonrpc_ret_t raw_result(json_t *params)
+{
+	static const char fixed[] = "{\"raw\": [1, 2, 3]}";
+	const char *json;
+
+	if (json_unpack(params, "[s]", &json)) {
+		return jsonrpc_result_raw(fixed, strlen(fixed), NULL);
+	}
+
+	return jsonrpc_result_raw(strdup(json), strlen(json), free);
+}
+jsonrpc_register(raw_result);
+
+/* counts its calls, so cache hits can be told from calls */
+static jsonrpc_ret_t counted(json_t *params)
 {
+	static int calls;
+
+	calls++;
+	if (json_is_array(params) && json_is_string(json_array_get(params, 0))) {
+		return jsonrpc_error_invalid_params(NULL);
+	}
+
+	return jsonrpc_result(json_integer(calls));
+}
+jsonrpc_register_cached(counted, 60000, 64);
+
+/* slow enough for the calls of a parallel batch to overlap */
+static unsigned int flight_calls;
+
+static jsonrpc_ret_t flight(json_t *params)
+{
+	__atomic_add_fetch(&flight_calls, 1, __ATOMIC_RELAXED);
+	usleep(100000);
+	if (json_is_array(params) && json_is_string(json_array_get(params, 0))) {
+		return jsonrpc_error_invalid_params(json_incref(params));
+	}
+
+	return jsonrpc_result(json_incref(params));
+}
+jsonrpc_register_single_flight(flight);
+
+static jsonrpc_ret_t flight_count(json_t *params)
+{
+	return jsonrpc_result(json_integer(
+				__atomic_load_n(&flight_calls, __ATOMIC_RELAXED)));
+}
+jsonrpc_register(flight_count);
+
+/* the context the methods below call into */
+static jsonrpc_ctx_t *self_ctx;
+
+static jsonrpc_ret_t call_self(const char *req)
+{
+	char *rsp = jsonrpc_ctx_handle_request(self_ctx, req, strlen(req));
+
+	if (!rsp) {
+		return NULL;
+	}
+
+	return jsonrpc_result_raw(rsp, strlen(rsp), free);
+}
+
+/* calls itself, which is more than its limit allows */
+static jsonrpc_ret_t reentrant(json_t *params)
+{
+	return call_self("{\"jsonrpc\": \"2.0\", \"method\": \"reentrant\", "
+			"\"id\": 0}");
+}
+jsonrpc_register_limited(reentrant, 1);
+
+/* nests the given number of requests into this one */
+static jsonrpc_ret_t nested(json_t *params)
+{
+	char req[128];
+	int depth;
+
+	if (json_unpack(params, "[i]", &depth)) {
+		return jsonrpc_error_invalid_params(NULL);
+	}
+	if (depth <= 0) {
+		return jsonrpc_result(json_integer(0));
+	}
+	snprintf(req, sizeof(req), "{\"jsonrpc\": \"2.0\", \"method\": "
+			"\"nested\", \"params\": [%d], \"id\": %d}", depth - 1,
+			depth - 1);
+
+	return call_self(req);
+}
+jsonrpc_register(nested);
+
+/* calls itself once with the same params, while its flight is running */
+static jsonrpc_ret_t flight_self(json_t *params)
+{
+	static __thread bool inner;
+	jsonrpc_ret_t ret;
+
+	if (inner) {
+		return jsonrpc_result(json_incref(params));
+	}
+	inner = true;
+	ret = call_self("{\"jsonrpc\": \"2.0\", \"method\": \"flight_self\", "
+			"\"params\": [1], \"id\": 0}");
+	inner = false;
+
+	return ret;
+}
+jsonrpc_register_single_flight(flight_self);
+
+static const struct jsonrpc_limits limits = {
+	.max_request = 512,
+	.max_batch = 3,
+	.max_inflight = 2,
+};
+
+/* hooks print what they see, before the response is printed */
+static jsonrpc_ret_t trace_pre(const char *method, json_t *id,
+		jsonrpc_params_t params, void *priv)
+{
+	char id_str[64] = "-";
+	const char *raw;
+	size_t len;
+
+	/* not json_dumps(), the string could be in the request arena */
+	if (id) {
+		len = json_dumpb(id, id_str, sizeof(id_str) - 1, JSON_ENCODE_ANY);
+		id_str[len < sizeof(id_str) ? len : 0] = '\0';
+	}
+	raw = jsonrpc_params_raw(params, &len);
+	printf("pre %s %s %.*s\n", method, id_str, raw ? (int)len : 1,
+			raw ? raw : "-");
+
+	return NULL;
+}
+
+static void trace_post(const char *method, json_t *id,
+		jsonrpc_params_t params, jsonrpc_ret_t ret, void *priv)
+{
+	printf("post %s %s\n", method,
+			jsonrpc_ret_is_error(ret) ? "error" : "result");
+}
+
+/* get_data is not allowed */
+static jsonrpc_ret_t deny_pre(const char *method, json_t *id,
+		jsonrpc_params_t params, void *priv)
+{
+	if (!strcmp(method, "get_data")) {
+		return jsonrpc_error_invalid_params(json_string("denied"));
+	}
+
+	return NULL;
+}
+
+static jsonrpc_ret_t sampled_pre(const char *method, json_t *id,
+		jsonrpc_params_t params, void *priv)
+{
+	printf("sampled %s\n", method);
+
+	return NULL;
+}
+
+static const struct jsonrpc_hook hooks[] = {
+	{ .pre = trace_pre, .post = trace_post },
+	{ .pre = deny_pre },
+	{ .pre = sampled_pre, .sample = 2 },
+};
+
+/* the same methods on a separate context */
+static jsonrpc_ctx_t *create_ctx(void)
+{
+	jsonrpc_ctx_t *ctx = jsonrpc_ctx_create();
+
+	jsonrpc_ctx_register(ctx, "internal_error", internal_error);
+	jsonrpc_ctx_register(ctx, "invalid_params", invalid_params);
+	jsonrpc_ctx_register(ctx, "noop", noop);
+	jsonrpc_ctx_register(ctx, "update", noop);
+	jsonrpc_ctx_register(ctx, "notify_hello", noop);
+	jsonrpc_ctx_register(ctx, "get_data", get_data);
+	jsonrpc_ctx_register(ctx, "add", add);
+	jsonrpc_ctx_register(ctx, "typed_add", typed_add_binder);
+	jsonrpc_ctx_register(ctx, "typed_echo", typed_echo_binder);
+	jsonrpc_ctx_register(ctx, "sum", sum);
+	jsonrpc_ctx_register(ctx, "subtract", subtract);
+	jsonrpc_ctx_register_async(ctx, "later", later);
+	jsonrpc_ctx_register_async(ctx, "later_ret", later_ret);
+	jsonrpc_ctx_register_lazy(ctx, "lazy_sum", lazy_sum);
+	jsonrpc_ctx_register_lazy(ctx, "raw_params", raw_params);
+	jsonrpc_ctx_register(ctx, "raw_result", raw_result);
+	jsonrpc_ctx_register_cached(ctx, "counted", counted, 60000, 64);
+	jsonrpc_ctx_register_method(ctx, &(struct jsonrpc_method){
+			.name = "reentrant",
+			.cb = reentrant,
+			.max_concurrent = 1,
+		});
+	jsonrpc_ctx_register(ctx, "nested", nested);
+	jsonrpc_ctx_register_method(ctx, &(struct jsonrpc_method){
+			.name = "flight",
+			.cb = flight,
+			.single_flight = 1,
+		});
+	jsonrpc_ctx_register(ctx, "flight_count", flight_count);
+	jsonrpc_ctx_register_method(ctx, &(struct jsonrpc_method){
+			.name = "flight_self",
+			.cb = flight_self,
+			.single_flight = 1,
+		});
+
+	return ctx;
+}
+
+/* neither of them is registered */
+static const struct jsonrpc_method invalid_methods[] = {
+	{ .name = "no_callback" },
+	{ .name = "two_callbacks", .cb = noop, .lazy = lazy_sum },
+};
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static bool finished;
+
+static void print_response(char *response, void *priv)
+{
+	if (response) {
+		printf("%s\n", response);
+	}
+	free(response);
+
+	pthread_mutex_lock(&done_lock);
+	finished = true;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_lock);
+}
+
+static char *read_stdin(size_t *_len)
+{
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+
+	while (!feof(stdin) && !ferror(stdin)) {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+		}
+		len += fread(buf + len, 1, size - len, stdin);
+	}
+	*_len = len;
+
+	return buf;
+}
+
+static void handle_async(jsonrpc_ctx_t *ctx)
+{
+	size_t len;
+	char *buf = read_stdin(&len);
+
+	jsonrpc_ctx_handle_request_async(ctx, buf, len, print_response, NULL);
+
+	pthread_mutex_lock(&done_lock);
+	while (!finished) {
+		pthread_cond_wait(&done_cond, &done_lock);
+	}
+	pthread_mutex_unlock(&done_lock);
+	free(buf);
+}
+
+static void handle_into(jsonrpc_ctx_t *ctx)
+{
+	char out[4096];
+	size_t len, rsp_len;
+	char *buf = read_stdin(&len);
+
+	if (!jsonrpc_ctx_handle_request_into(ctx, buf, len, out, sizeof(out),
+				&rsp_len) && rsp_len) {
+		printf("%.*s\n", (int)rsp_len, out);
+	}
+	free(buf);
+}
+
+static int write_stdout(const char *buf, size_t len, void *priv)
+{
+	size_t *written = priv;
+
+	*written += len;
+
+	return fwrite(buf, 1, len, stdout) == len ? 0 : -1;
+}
+
+static void handle_cb(jsonrpc_ctx_t *ctx)
+{
+	size_t len, written = 0;
+	char *buf = read_stdin(&len);
+
+	jsonrpc_ctx_handle_request_cb(ctx, buf, len, write_stdout, &written);
+	if (written) {
+		printf("\n");
+	}
+	free(buf);
+}
+
+static void handle_iov(jsonrpc_ctx_t *ctx)
+{
+	size_t len;
+	char *buf = read_stdin(&len);
+	jsonrpc_iov_t *iov;
+	const struct iovec *vec;
+	int count;
+
+	if (jsonrpc_ctx_handle_request_iov(ctx, buf, len, &iov)) {
+		fprintf(stderr, "handling the request failed\n");
+	} else if (iov) {
+		vec = jsonrpc_iov_get(iov, &count);
+		fflush(stdout);
+		if (writev(fileno(stdout), vec, count) >= 0) {
+			printf("\n");
+		}
+	}
+	jsonrpc_iov_free(iov);
+	free(buf);
+}
+
+struct buffer {
 	char *buf;
+	size_t len;
+};
 
-	jsonrpc_config_set(
-			  JSONRPC_DISABLE_ERROR_TEXT
-			| JSONRPC_ORDERED_RESPONSE);
+static int buffer_write(const char *data, size_t len, void *priv)
+{
+	struct buffer *b = priv;
 
-	buf = jsonrpc_handle_request_from_file(stdin);
-	if (buf) {
-		printf("%s\n", buf);
+	b->buf = realloc(b->buf, b->len + len);
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+
+	return 0;
+}
+
+/*
+ * Converts the JSON input to MessagePack and the response back to JSON.
+ * Input which isn't valid JSON is passed on as it is.
+ */
+static void handle_msgpack(jsonrpc_ctx_t *ctx)
+{
+	struct buffer req = { NULL, 0 }, rsp = { NULL, 0 };
+	json_t *value;
+	size_t len;
+	char *buf = read_stdin(&len), *out;
+
+	value = json_loadb(buf, len, 0, NULL);
+	if (value) {
+		jsonrpc_msgpack_encode(value, buffer_write, &req);
+		json_decref(value);
+	} else {
+		buffer_write(buf, len, &req);
 	}
+
+	jsonrpc_ctx_handle_request_msgpack(ctx, req.buf, req.len, buffer_write,
+			&rsp);
+	if (rsp.len) {
+		value = jsonrpc_msgpack_decode(rsp.buf, rsp.len, NULL);
+		out = value ? json_dumps(value, JSON_PRESERVE_ORDER) : NULL;
+		printf("%s\n", out ? out : "invalid response");
+		free(out);
+		json_decref(value);
+	}
+	free(req.buf);
+	free(rsp.buf);
 	free(buf);
+}
+
+static void *server_thread(void *arg)
+{
+	jsonrpc_server_run(arg);
+
+	return NULL;
+}
+
+struct client_input {
+	int fd;
+	char *buf;
+	size_t len;
+	/* leave the connection to the idle timeout */
+	bool keep_open;
+	/* write one line at a time, so requests arrive in pieces */
+	bool split;
+};
+
+/* the server stops reading while responses are pending, write concurrently */
+static void *client_writer(void *arg)
+{
+	struct client_input *input = arg;
+	size_t off, len;
+	const char *nl;
+	ssize_t n;
+
+	for (off = 0; off < input->len; off += n) {
+		len = input->len - off;
+		nl = input->split ? memchr(input->buf + off, '\n', len) : NULL;
+		if (nl) {
+			len = nl - (input->buf + off) + 1;
+			usleep(10000);
+		}
+		n = write(input->fd, input->buf + off, len);
+		if (n <= 0) {
+			break;
+		}
+	}
+	if (!input->keep_open) {
+		shutdown(input->fd, SHUT_WR);
+	}
+
+	return NULL;
+}
+
+/*
+ * Sends stdin through a server on a Unix socket and copies back the output.
+ * With limits, the server closes the connection once it is idle.
+ */
+static void handle_server(jsonrpc_ctx_t *ctx, jsonrpc_framing_t framing,
+		bool limit, bool split)
+{
+	char dir[] = "/tmp/jsonrpc-XXXXXX";
+	char address[128], out[4096];
+	struct jsonrpc_server_config config = {
+		.address = address,
+		.threads = 2,
+		.framing = framing,
+		.idle_timeout = limit ? 100 : 0,
+	};
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct client_input input;
+	jsonrpc_server_t *server;
+	pthread_t thread, writer;
+	ssize_t n;
+
+	if (!mkdtemp(dir)) {
+		return;
+	}
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/sock", dir);
+	snprintf(address, sizeof(address), "unix:%s", sun.sun_path);
+
+	server = jsonrpc_server_create(ctx, &config);
+	if (!server) {
+		rmdir(dir);
+		return;
+	}
+	pthread_create(&thread, NULL, server_thread, server);
+
+	input.buf = read_stdin(&input.len);
+	input.keep_open = limit;
+	input.split = split;
+	input.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (input.fd >= 0 && !connect(input.fd, (struct sockaddr *)&sun,
+				sizeof(sun))) {
+		pthread_create(&writer, NULL, client_writer, &input);
+		fflush(stdout);
+		while ((n = read(input.fd, out, sizeof(out))) > 0) {
+			if (write(fileno(stdout), out, n) != n) {
+				break;
+			}
+		}
+		pthread_join(writer, NULL);
+	}
+	if (input.fd >= 0) {
+		close(input.fd);
+	}
+	free(input.buf);
+
+	jsonrpc_server_stop(server);
+	pthread_join(thread, NULL);
+	jsonrpc_server_destroy(server);
+	unlink(sun.sun_path);
+	rmdir(dir);
+}
+
+static void *shm_thread(void *arg)
+{
+	jsonrpc_shm_serve(self_ctx, arg);
+
+	return NULL;
+}
+
+struct shm_input {
+	jsonrpc_shm_t *shm;
+	char *buf;
+	size_t len;
+	/* one message per line instead of all of the input */
+	bool lines;
+};
+
+/* the next non-empty message of the input, NULL at its end */
+static char *shm_message(struct shm_input *input, char *p, size_t *len)
+{
+	char *end = input->buf + input->len, *nl;
+
+	while (p < end) {
+		nl = input->lines ? memchr(p, '\n', end - p) : NULL;
+		if (!nl) {
+			nl = end;
+		}
+		if (nl > p) {
+			*len = nl - p;
+			return p;
+		}
+		p = nl + 1;
+	}
+
+	return NULL;
+}
+
+static void *shm_writer(void *arg)
+{
+	struct shm_input *input = arg;
+	size_t len;
+	char *p;
+
+	for (p = shm_message(input, input->buf, &len); p;
+			p = shm_message(input, p + len, &len)) {
+		if (jsonrpc_shm_send(input->shm, p, len)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* sends stdin through a small shared-memory channel and prints the responses */
+static void handle_shm(bool lines, bool limit)
+{
+	char dir[] = "/tmp/jsonrpc-XXXXXX";
+	char path[128];
+	struct shm_input input = { .lines = lines };
+	jsonrpc_shm_t *server, *client;
+	pthread_t thread, writer;
+	size_t len, rsp_len;
+	char *p, *rsp;
+
+	if (!mkdtemp(dir)) {
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/shm", dir);
+
+	server = jsonrpc_shm_create(path, 4096);
+	client = server ? jsonrpc_shm_open(path) : NULL;
+	if (!client) {
+		jsonrpc_shm_destroy(server);
+		rmdir(dir);
+		return;
+	}
+	if (limit) {
+		jsonrpc_shm_set_max_message(server, limits.max_request);
+	}
+	pthread_create(&thread, NULL, shm_thread, server);
+
+	input.shm = client;
+	input.buf = read_stdin(&input.len);
+	pthread_create(&writer, NULL, shm_writer, &input);
+	/* every message gets a response, with a length of 0 if there is none */
+	for (p = shm_message(&input, input.buf, &len); p;
+			p = shm_message(&input, p + len, &len)) {
+		if (jsonrpc_shm_receive(client, &rsp, &rsp_len)) {
+			break;
+		}
+		if (rsp) {
+			printf("%s\n", rsp);
+		}
+		free(rsp);
+	}
+	jsonrpc_shm_stop(client);
+	pthread_join(writer, NULL);
+	pthread_join(thread, NULL);
+	free(input.buf);
+
+	jsonrpc_shm_destroy(client);
+	jsonrpc_shm_destroy(server);
+	rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	char *buf;
+	int i;
+	bool async = false, into = false, cb = false, iov = false, hook = false;
+	bool server = false, limit = false, shm = false, msgpack = false;
+	bool split = false;
+	int stream = -1;
+	jsonrpc_ctx_t *ctx = NULL;
+	jsonrpc_pool_t *pool = NULL;
+	jsonrpc_confflags_t flags =
+			  JSONRPC_DISABLE_ERROR_TEXT
+			| JSONRPC_ORDERED_RESPONSE;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--arena")) {
+			flags |= JSONRPC_REQUEST_ARENA;
+		} else if (!strcmp(argv[i], "--error-text")) {
+			flags &= ~JSONRPC_DISABLE_ERROR_TEXT;
+		} else if (!strcmp(argv[i], "--stream-batch")) {
+			flags |= JSONRPC_STREAM_BATCH;
+		} else if (!strcmp(argv[i], "--stats")) {
+			flags |= JSONRPC_STATS_METHOD;
+		} else if (!strcmp(argv[i], "--limits")) {
+			limit = true;
+		} else if (!strcmp(argv[i], "--hooks")) {
+			hook = true;
+		} else if (!strcmp(argv[i], "--ctx")) {
+			ctx = create_ctx();
+		} else if (!strcmp(argv[i], "--stream")) {
+			stream = JSONRPC_FRAMING_NEWLINE;
+		} else if (!strcmp(argv[i], "--content-length")) {
+			stream = JSONRPC_FRAMING_CONTENT_LENGTH;
+		} else if (!strcmp(argv[i], "--http")) {
+			stream = JSONRPC_FRAMING_HTTP;
+		} else if (!strcmp(argv[i], "--into")) {
+			into = true;
+		} else if (!strcmp(argv[i], "--cb")) {
+			cb = true;
+		} else if (!strcmp(argv[i], "--iov")) {
+			iov = true;
+		} else if (!strcmp(argv[i], "--server")) {
+			server = true;
+		} else if (!strcmp(argv[i], "--split")) {
+			split = true;
+		} else if (!strcmp(argv[i], "--msgpack")) {
+			msgpack = true;
+		} else if (!strcmp(argv[i], "--shm")) {
+			shm = true;
+		} else if (!strcmp(argv[i], "--async")) {
+			async = true;
+		} else if (!strcmp(argv[i], "--parallel")) {
+			flags |= JSONRPC_PARALLEL_BATCH;
+			pool = jsonrpc_pool_create(4);
+		}
+	}
+
+	jsonrpc_ctx_config_set(ctx, flags);
+	for (i = 0; i < sizeof(invalid_methods) / sizeof(invalid_methods[0]);
+			i++) {
+		if (!jsonrpc_ctx_register_method(ctx, &invalid_methods[i])) {
+			fprintf(stderr, "%s registered\n", invalid_methods[i].name);
+		}
+	}
+	self_ctx = ctx;
+	if (limit) {
+		jsonrpc_ctx_set_limits(ctx, &limits);
+	}
+	for (i = 0; hook && i < sizeof(hooks) / sizeof(hooks[0]); i++) {
+		jsonrpc_ctx_add_hook(ctx, &hooks[i]);
+	}
+	if (pool && jsonrpc_ctx_set_executor(ctx, jsonrpc_pool_execute, pool)) {
+		fprintf(stderr, "executor not set\n");
+	}
+
+	if (msgpack) {
+		handle_msgpack(ctx);
+	} else if (shm) {
+		handle_shm(stream >= 0, limit);
+	} else if (server && stream >= 0) {
+		handle_server(ctx, stream, limit, split);
+	} else if (stream >= 0) {
+		jsonrpc_ctx_handle_stream(ctx, stdin, stdout, stream);
+	} else if (async) {
+		handle_async(ctx);
+	} else if (into) {
+		handle_into(ctx);
+	} else if (cb) {
+		handle_cb(ctx);
+	} else if (iov) {
+		handle_iov(ctx);
+	} else {
+		buf = jsonrpc_ctx_handle_request_from_file(ctx, stdin);
+		if (buf) {
+			printf("%s\n", buf);
+		}
+		free(buf);
+	}
+	jsonrpc_pool_destroy(pool);
+	jsonrpc_ctx_destroy(ctx);
 
 	return 0;
 }